@@ -6,6 +6,7 @@ __attribute__((aligned(8))) gdt_entry_t kernel_gdt[] = {
   { 0xffff, 0, 0, 0x9a, 0xcf, 0 }, /* code segment */
   { 0xffff, 0, 0, 0x92, 0xcf, 0 }, /* data segment */
   { 0, 0, 0, 0, 0, 0 }, /* placeholder for task descriptor */
+  { 0, 0, 0, 0, 0, 0 }, /* placeholder for page fault task descriptor */
 };
 
 gdtp_t kernel_gdtp = {
@@ -34,6 +34,7 @@ enum {
   GDT_CODE,
   GDT_DATA,
   GDT_TASK,
+  GDT_FAULT_TASK,
 
   GDT_NUM_ENTRIES,
 };
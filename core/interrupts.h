@@ -6,6 +6,7 @@
 #include <stdint.h>
 
 enum {
+  IDT_NM = 0x7,
   IDT_GP = 0xd,
   IDT_PF = 0xe,
   IDT_IRQ = 0x20,
@@ -3,8 +3,13 @@
 enum {
   CPUID_VENDOR = 0,
   CPUID_GETFEATURES = 1,
+  CPUID_EXTENDED = 0x80000000,
+  CPUID_POWER_MANAGEMENT = 0x80000007,
+  CPUID_ADDRESS_SIZES = 0x80000008,
 };
 
+#define CPUID_PM_INVARIANT_TSC (1 << 8)
+
 int cpuid_is_supported(void)
 {
   uint32_t old, new;
@@ -57,6 +62,46 @@ int cpuid_check_features(uint32_t mask)
   return (cpuid_features() & mask) == mask;
 }
 
+/* query a leaf, return eax and store the other registers */
+static uint32_t cpuid_leaf(uint32_t leaf, uint32_t *ebx,
+                           uint32_t *ecx, uint32_t *edx)
+{
+  uint32_t eax;
+  __asm__
+    ("cpuid\n"
+     : "=a"(eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+     : "a"(leaf), "c"(0));
+  return eax;
+}
+
+/* highest supported extended leaf, or 0 */
+static uint32_t cpuid_max_extended(void)
+{
+  if (!cpuid_is_supported()) return 0;
+  uint32_t ebx, ecx, edx;
+  uint32_t max = cpuid_leaf(CPUID_EXTENDED, &ebx, &ecx, &edx);
+  return max & CPUID_EXTENDED ? max : 0;
+}
+
+unsigned cpuid_phys_address_bits(void)
+{
+  if (cpuid_max_extended() >= CPUID_ADDRESS_SIZES) {
+    uint32_t ebx, ecx, edx;
+    return cpuid_leaf(CPUID_ADDRESS_SIZES, &ebx, &ecx, &edx) & 0xff;
+  }
+
+  /* without the extended leaf, the width is implied by PAE support */
+  return cpuid_check_features(CPUID_FEAT_PAE) ? 36 : 32;
+}
+
+int cpuid_has_invariant_tsc(void)
+{
+  if (cpuid_max_extended() < CPUID_POWER_MANAGEMENT) return 0;
+  uint32_t ebx, ecx, edx;
+  cpuid_leaf(CPUID_POWER_MANAGEMENT, &ebx, &ecx, &edx);
+  return (edx & CPUID_PM_INVARIANT_TSC) != 0;
+}
+
 uint32_t cpu_flags()
 {
   uint32_t flags;
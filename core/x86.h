@@ -15,12 +15,48 @@
 enum {
   CR4_PSE = 1 << 4,
   CR4_PAE = 1 << 5,
+  CR4_PGE = 1 << 7,
 };
 
 enum {
+  CR0_NW = 1 << 29,
+  CR0_CD = 1 << 30,
   CR0_PG = 1 << 31,
 };
 
+/* model specific registers */
+enum {
+  MSR_MTRRCAP = 0xfe,
+  MSR_MTRR_PHYSBASE0 = 0x200,
+  MSR_MTRR_PHYSMASK0 = 0x201,
+  MSR_PAT = 0x277,
+  MSR_MTRR_DEF_TYPE = 0x2ff,
+};
+
+static inline uint64_t rdmsr(uint32_t msr)
+{
+  uint64_t value;
+  __asm__ volatile("rdmsr" : "=A"(value) : "c"(msr));
+  return value;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value)
+{
+  __asm__ volatile("wrmsr" : : "c"(msr), "A"(value));
+}
+
+static inline uint64_t rdtsc(void)
+{
+  uint64_t value;
+  __asm__ volatile("rdtsc" : "=A"(value));
+  return value;
+}
+
+static inline void wbinvd(void)
+{
+  __asm__ volatile("wbinvd" : : : "memory");
+}
+
 enum {
   EFLAGS_CF = 1 << 0,
   EFLAGS_IF = 1 << 9,
@@ -106,6 +142,10 @@ int cpuid_is_supported(void);
 void cpuid_vendor(char *vendor);
 uint32_t cpuid_features(void);
 int cpuid_check_features(uint32_t mask);
+/* width of physical addresses, in bits */
+unsigned cpuid_phys_address_bits(void);
+/* whether the TSC runs at a constant rate in all power states */
+int cpuid_has_invariant_tsc(void);
 
 uint32_t cpu_flags();
 
@@ -0,0 +1,371 @@
+#if _HELIUM
+# include "core/debug.h"
+# include "scheduler.h"
+#else
+# include <stdio.h>
+# define serial_printf printf
+#endif
+
+#include "bcache.h"
+#include "core/storage.h"
+#include "frames.h"
+#include "kmalloc.h"
+#include "list.h"
+#include "memory.h"
+#include "semaphore.h"
+
+#include <string.h>
+
+#define BCACHE_DEBUG 0
+#if BCACHE_DEBUG
+#define TRACE(fmt, ...) serial_printf("[bcache] " fmt \
+                                      __VA_OPT__(,) __VA_ARGS__)
+#else
+#define TRACE(...) do {} while(0)
+#endif
+
+/* block buffers are allocated from kernel frames in chunks */
+#define BCACHE_CHUNK_BITS 16
+#define BCACHE_CHUNK_BLOCKS (1 << (BCACHE_CHUNK_BITS - BCACHE_BLOCK_BITS))
+
+#define BCACHE_NUM_BUCKETS 256
+
+/* reads at least this big bypass the cache */
+#define BCACHE_BYPASS_SIZE (16 * BCACHE_BLOCK_SIZE)
+
+/* default budget: a fraction of the available kernel memory, capped */
+#define BCACHE_BUDGET_SHIFT 4
+#define BCACHE_MAX_BUDGET (8 * 1024 * 1024)
+
+typedef struct bcache_dev {
+  storage_ops_t ops;
+  storage_t *backing;
+  /* underlying device, and offset of the backing storage within it */
+  const void *key;
+  storage_offset_t base;
+} bcache_dev_t;
+
+typedef struct bcache_entry {
+  /* hash bucket, or free list */
+  list_t head;
+  /* position in the LRU list, most recently used first */
+  list_t lru;
+
+  /* device and absolute block number */
+  const void *key;
+  uint64_t block;
+  uint8_t *data;
+} bcache_entry_t;
+
+static int bcache_initialised = 0;
+static semaphore_t bcache_lock;
+
+static list_t *bcache_buckets[BCACHE_NUM_BUCKETS];
+static list_t *bcache_lru = 0;
+static list_t *bcache_free = 0;
+
+/* number of allocated block buffers */
+static uint32_t bcache_capacity = 0;
+static size_t bcache_budget = 0;
+static bcache_stats_t bcache_stats;
+
+/* bumped by every write, so that a block read without holding the
+   lock is only cached if no write could have made it stale */
+static uint32_t bcache_seq = 0;
+
+static inline list_t **bcache_bucket(const void *key, uint64_t block)
+{
+  uint32_t h = ((uint32_t) block * 2654435761U) ^ ((size_t) key >> 4);
+  return &bcache_buckets[h % BCACHE_NUM_BUCKETS];
+}
+
+static bcache_entry_t *bcache_lookup(const void *key, uint64_t block)
+{
+  list_t *bucket = *bcache_bucket(key, block);
+  if (!bucket) return 0;
+
+  list_t *item = bucket;
+  do {
+    bcache_entry_t *entry = LIST_ENTRY(item, bcache_entry_t, head);
+    if (entry->key == key && entry->block == block) return entry;
+    item = item->next;
+  } while (item != bucket);
+
+  return 0;
+}
+
+static void bcache_drop(bcache_entry_t *entry)
+{
+  list_take(bcache_bucket(entry->key, entry->block), &entry->head);
+  list_take(&bcache_lru, &entry->lru);
+  entry->key = 0;
+  list_add(&bcache_free, &entry->head);
+  bcache_stats.blocks--;
+}
+
+/* allocate a new chunk of block buffers, within the budget */
+static int bcache_grow(void)
+{
+  if ((bcache_capacity + BCACHE_CHUNK_BLOCKS) << BCACHE_BLOCK_BITS >
+      bcache_budget)
+    return -1;
+
+  uint8_t *data = (uint8_t *) (size_t)
+    frames_alloc(&kernel_frames, 1 << BCACHE_CHUNK_BITS);
+  if (!data) return -1;
+
+  bcache_entry_t *entries = kmalloc(BCACHE_CHUNK_BLOCKS *
+                                    sizeof(bcache_entry_t));
+  if (!entries) {
+    frames_free(&kernel_frames, (size_t) data);
+    return -1;
+  }
+
+  for (int i = 0; i < BCACHE_CHUNK_BLOCKS; i++) {
+    entries[i].key = 0;
+    entries[i].data = data + (i << BCACHE_BLOCK_BITS);
+    list_add(&bcache_free, &entries[i].head);
+  }
+  bcache_capacity += BCACHE_CHUNK_BLOCKS;
+  TRACE("grown to %u blocks\n", bcache_capacity);
+
+  return 0;
+}
+
+/* get an unused entry, evicting the least recently used block if
+   necessary */
+static bcache_entry_t *bcache_get_entry(void)
+{
+  if (!bcache_free && bcache_grow() == -1 && bcache_lru) {
+    bcache_entry_t *victim = LIST_ENTRY(bcache_lru->prev,
+                                        bcache_entry_t, lru);
+    TRACE("evicting block %llu\n", victim->block);
+    bcache_drop(victim);
+    bcache_stats.evictions++;
+  }
+
+  list_t *item = list_pop(&bcache_free);
+  if (!item) return 0;
+  return LIST_ENTRY(item, bcache_entry_t, head);
+}
+
+/* copy part of a block into a buffer, reading the whole block from
+   the backing storage if it is not cached */
+static int bcache_read_block(bcache_dev_t *dev, uint64_t block,
+                             uint8_t *dst, uint32_t start, uint32_t size)
+{
+  sem_wait(&bcache_lock);
+  bcache_entry_t *entry = bcache_lookup(dev->key, block);
+  if (entry) {
+    bcache_stats.hits++;
+    list_take(&bcache_lru, &entry->lru);
+    list_push(&bcache_lru, &entry->lru);
+    memcpy(dst, entry->data + start, size);
+    sem_signal(&bcache_lock);
+    return 0;
+  }
+
+  bcache_stats.misses++;
+  entry = bcache_get_entry();
+  uint32_t seq = bcache_seq;
+  sem_signal(&bcache_lock);
+
+  /* the entry is neither in the table nor in the LRU list, so the
+     read can be done without holding the lock */
+  storage_offset_t offset = (block << BCACHE_BLOCK_BITS) - dev->base;
+  if (!entry) {
+    /* no memory for the cache, read directly */
+    return storage_read(dev->backing, dst, offset + start, size);
+  }
+
+  int ret = storage_read(dev->backing, entry->data,
+                         offset, BCACHE_BLOCK_SIZE);
+  if (ret != -1) memcpy(dst, entry->data + start, size);
+
+  sem_wait(&bcache_lock);
+  if (ret == -1 || seq != bcache_seq ||
+      bcache_lookup(dev->key, block)) {
+    /* failed, possibly stale, or cached by another reader meanwhile */
+    list_add(&bcache_free, &entry->head);
+  }
+  else {
+    entry->key = dev->key;
+    entry->block = block;
+    list_add(bcache_bucket(dev->key, block), &entry->head);
+    list_push(&bcache_lru, &entry->lru);
+    bcache_stats.blocks++;
+  }
+  sem_signal(&bcache_lock);
+
+  /* the whole block may not be readable, e.g. at the end of a disk
+     with an odd number of sectors, so read just the requested part */
+  if (ret == -1)
+    return storage_read(dev->backing, dst, offset + start, size);
+
+  return ret;
+}
+
+static int bcache_read(void *data, void *buf,
+                       storage_offset_t offset, uint32_t bytes)
+{
+  bcache_dev_t *dev = data;
+
+  if (bytes >= BCACHE_BYPASS_SIZE)
+    return storage_read(dev->backing, buf, offset, bytes);
+
+  uint8_t *dst = buf;
+  while (bytes > 0) {
+    storage_offset_t pos = dev->base + offset;
+    uint64_t block = pos >> BCACHE_BLOCK_BITS;
+    uint32_t start = pos & (BCACHE_BLOCK_SIZE - 1);
+    uint32_t size = BCACHE_BLOCK_SIZE - start;
+    if (size > bytes) size = bytes;
+
+    if (bcache_read_block(dev, block, dst, start, size) == -1)
+      return -1;
+
+    dst += size;
+    offset += size;
+    bytes -= size;
+  }
+
+  return 0;
+}
+
+static int bcache_write(void *data, void *buf,
+                        storage_offset_t offset, uint32_t bytes)
+{
+  bcache_dev_t *dev = data;
+
+  /* the lock is held across the write, so that cached copies are
+     updated in the same order as the backing storage */
+  sem_wait(&bcache_lock);
+  int ret = storage_write(dev->backing, buf, offset, bytes);
+  bcache_seq++;
+
+  /* update cached copies, or drop them if the write failed */
+  uint8_t *src = buf;
+  while (bytes > 0) {
+    storage_offset_t pos = dev->base + offset;
+    uint64_t block = pos >> BCACHE_BLOCK_BITS;
+    uint32_t start = pos & (BCACHE_BLOCK_SIZE - 1);
+    uint32_t size = BCACHE_BLOCK_SIZE - start;
+    if (size > bytes) size = bytes;
+
+    bcache_entry_t *entry = bcache_lookup(dev->key, block);
+    if (entry) {
+      if (ret == -1)
+        bcache_drop(entry);
+      else
+        memcpy(entry->data + start, src, size);
+    }
+
+    src += size;
+    offset += size;
+    bytes -= size;
+  }
+  sem_signal(&bcache_lock);
+
+  return ret;
+}
+
+static int bcache_read_unaligned(void *data, void *buf, void *scratch,
+                                 storage_offset_t offset, uint32_t bytes)
+{
+  bcache_dev_t *dev = data;
+  return storage_read_unaligned_helper(&dev->ops, data, buf, scratch,
+                                       offset, bytes);
+}
+
+static int bcache_write_unaligned(void *data, void *buf, void *scratch,
+                                  storage_offset_t offset, uint32_t bytes)
+{
+  bcache_dev_t *dev = data;
+  return storage_write_unaligned_helper(&dev->ops, data, buf, scratch,
+                                        offset, bytes);
+}
+
+static void bcache_init(void)
+{
+#if _HELIUM
+  sched_disable_preemption();
+#endif
+  if (!bcache_initialised) {
+    sem_init(&bcache_lock, 1);
+    if (!bcache_budget) {
+      bcache_budget = frames_available_memory(&kernel_frames)
+        >> BCACHE_BUDGET_SHIFT;
+      if (bcache_budget > BCACHE_MAX_BUDGET)
+        bcache_budget = BCACHE_MAX_BUDGET;
+    }
+    bcache_initialised = 1;
+  }
+#if _HELIUM
+  sched_enable_preemption();
+#endif
+}
+
+void bcache_set_budget(size_t budget)
+{
+  bcache_budget = budget;
+}
+
+int bcache_storage_init(storage_t *storage, storage_t *backing,
+                        const void *device, storage_offset_t base)
+{
+  /* blocks must be made of whole sectors */
+  if (storage_sector_size(backing) > BCACHE_BLOCK_SIZE) return -1;
+
+  bcache_init();
+
+  bcache_dev_t *dev = kmalloc(sizeof(bcache_dev_t));
+  if (!dev) return -1;
+
+  dev->ops.read = bcache_read;
+  dev->ops.read_unaligned = bcache_read_unaligned;
+  dev->ops.write = bcache_write;
+  dev->ops.write_unaligned = bcache_write_unaligned;
+  dev->ops.sector_size = storage_sector_size(backing);
+  dev->backing = backing;
+  if (base & (BCACHE_BLOCK_SIZE - 1)) {
+    /* blocks would straddle the start of the backing storage, so
+       cache them separately from the rest of the device */
+    dev->key = dev;
+    dev->base = 0;
+  }
+  else {
+    dev->key = device;
+    dev->base = base;
+  }
+
+  storage->ops = &dev->ops;
+  storage->ops_data = dev;
+  return 0;
+}
+
+storage_t *bcache_storage_cleanup(storage_t *storage)
+{
+  bcache_dev_t *dev = storage->ops_data;
+  storage_t *backing = dev->backing;
+
+  sem_wait(&bcache_lock);
+  list_t *item = bcache_lru;
+  for (uint32_t n = bcache_stats.blocks; n > 0; n--) {
+    list_t *next = item->next;
+    bcache_entry_t *entry = LIST_ENTRY(item, bcache_entry_t, lru);
+    if (entry->key == dev->key) bcache_drop(entry);
+    item = next;
+  }
+  sem_signal(&bcache_lock);
+
+  kfree(dev);
+  storage->ops = 0;
+  storage->ops_data = 0;
+  return backing;
+}
+
+void bcache_get_stats(bcache_stats_t *stats)
+{
+  *stats = bcache_stats;
+  stats->max_blocks = bcache_budget >> BCACHE_BLOCK_BITS;
+}
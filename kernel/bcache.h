@@ -0,0 +1,47 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include "core/storage.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Block buffer cache.
+
+   A cached storage forwards every operation to a backing storage,
+   keeping recently read blocks in memory. Blocks are indexed by
+   (device, absolute block number) in a table shared by all cached
+   storages, so that storages on the same device share cached blocks,
+   and evicted in LRU order once the memory budget is exhausted.
+
+   Writes go through to the backing storage immediately, so the cache
+   never holds dirty data.
+*/
+
+#define BCACHE_BLOCK_BITS 10
+#define BCACHE_BLOCK_SIZE (1 << BCACHE_BLOCK_BITS)
+
+typedef struct bcache_stats {
+  uint32_t hits;
+  uint32_t misses;
+  uint32_t evictions;
+  /* blocks currently cached, and maximum allowed by the budget */
+  uint32_t blocks;
+  uint32_t max_blocks;
+} bcache_stats_t;
+
+/* set the memory budget of the cache, in bytes */
+void bcache_set_budget(size_t budget);
+
+/* wrap a backing storage into a cached one, where base is the byte
+   offset of the backing storage within the given device */
+int bcache_storage_init(storage_t *storage, storage_t *backing,
+                        const void *device, storage_offset_t base);
+
+/* drop all cached blocks of the device of a cached storage and
+   release it, returning the backing storage */
+storage_t *bcache_storage_cleanup(storage_t *storage);
+
+void bcache_get_stats(bcache_stats_t *stats);
+
+#endif /* BCACHE_H */
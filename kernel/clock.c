@@ -0,0 +1,177 @@
+#include "atomic.h"
+#include "clock.h"
+#include "core/debug.h"
+#include "core/io.h"
+#include "core/serial.h"
+#include "core/x86.h"
+#include "timer.h"
+
+#define CLOCK_DEBUG 0
+
+#if CLOCK_DEBUG
+# define TRACE(fmt, ...) serial_printf("[clock] " fmt \
+                                       __VA_OPT__(,) __VA_ARGS__)
+#else
+# define TRACE(...) do {} while(0)
+#endif
+
+/* PIT channel 2 gate and output are controlled through this port */
+#define PORT_B 0x61
+#define PORT_B_GATE2 (1 << 0)
+#define PORT_B_SPEAKER (1 << 1)
+#define PORT_B_OUT2 (1 << 5)
+
+/* about 10 ms worth of PIT counts */
+#define CLOCK_CALIBRATION_COUNT 11932
+#define CLOCK_CALIBRATION_NS \
+  ((uint32_t) ((uint64_t) CLOCK_CALIBRATION_COUNT * 1000000000ULL / PIT_FREQ))
+/* give up waiting for the PIT after this many polls */
+#define CLOCK_CALIBRATION_POLLS (1 << 22)
+
+/* fractional bits of the cycle to nanosecond multiplier */
+#define CLOCK_SHIFT 24
+
+typedef struct {
+  clock_source_t source;
+  uint32_t khz;
+  /* nanoseconds per cycle, as a fixed point number */
+  uint32_t mult;
+  /* TSC value and time at initialisation */
+  uint64_t base_cycles;
+  uint64_t base_ns;
+} clock_state_t;
+
+static clock_state_t clock_state;
+
+/* divide a 64 bit number by a 32 bit one without libgcc */
+static uint64_t div64_32(uint64_t n, uint32_t d)
+{
+  uint32_t hi = n >> 32;
+  uint32_t lo = n;
+  uint32_t qhi = hi / d;
+  uint32_t r = hi % d;
+  uint32_t qlo;
+  /* r < d, so the quotient fits in 32 bits */
+  __asm__("divl %4" : "=a"(qlo), "=d"(r) : "a"(lo), "d"(r), "rm"(d));
+  return ((uint64_t) qhi << 32) | qlo;
+}
+
+/* count the TSC cycles taken by the PIT to count down a fixed period,
+   return 0 on failure */
+static uint64_t clock_measure(void)
+{
+  uint32_t flags = cpu_flags();
+  cli();
+
+  /* stop channel 2 and disconnect the speaker */
+  uint8_t port_b = inb(PORT_B) & ~(PORT_B_GATE2 | PORT_B_SPEAKER);
+  outb(PORT_B, port_b);
+
+  outb(PIT_CMD, PIT_CHANNEL2 | PIT_MODE_INTERRUPT | PIT_ACCESS_LOHI);
+  outb(PIT_DATA2, CLOCK_CALIBRATION_COUNT & 0xff);
+  outb(PIT_DATA2, CLOCK_CALIBRATION_COUNT >> 8);
+
+  /* the count starts when the gate goes high, and the output goes
+     high when it reaches zero */
+  outb(PORT_B, port_b | PORT_B_GATE2);
+  uint64_t start = rdtsc();
+  unsigned polls = 0;
+  while (!(inb(PORT_B) & PORT_B_OUT2)) {
+    if (++polls == CLOCK_CALIBRATION_POLLS) break;
+  }
+  uint64_t end = rdtsc();
+
+  outb(PORT_B, port_b);
+  if (flags & EFLAGS_IF) sti();
+
+  if (polls == CLOCK_CALIBRATION_POLLS) return 0;
+  return end - start;
+}
+
+static int clock_calibrate(void)
+{
+  if (!cpuid_is_supported() || !cpuid_check_features(CPUID_FEAT_TSC)) {
+    TRACE("no TSC\n");
+    return -1;
+  }
+
+  /* a TSC that changes rate with the CPU frequency cannot be
+     converted with a fixed multiplier */
+  if (!cpuid_has_invariant_tsc()) {
+    TRACE("TSC not invariant\n");
+    return -1;
+  }
+
+  uint64_t c1 = clock_measure();
+  uint64_t c2 = clock_measure();
+  TRACE("calibration: %llu, %llu cycles\n", c1, c2);
+  if (c1 == 0 || c2 == 0) return -1;
+
+  /* the frequency must fit in 32 bits of kHz and the TSC must
+     advance at the same rate in both runs */
+  if (c1 >> 32 || c2 >> 32) return -1;
+  uint32_t cycles = c2;
+  uint32_t delta = c1 > c2 ? c1 - c2 : c2 - c1;
+  if (delta > cycles / 100) return -1;
+
+  /* cycles per nanosecond must be representable by the multiplier */
+  uint64_t mult = div64_32((uint64_t) CLOCK_CALIBRATION_NS << CLOCK_SHIFT,
+                           cycles);
+  if (mult == 0 || mult >> 32) return -1;
+
+  clock_state.mult = mult;
+  clock_state.khz = div64_32((uint64_t) cycles * 1000000, CLOCK_CALIBRATION_NS);
+  return 0;
+}
+
+int clock_init(void)
+{
+  if (clock_calibrate() == -1) {
+    int col = serial_set_colour(SERIAL_COLOUR_ERR);
+    serial_printf("TSC unavailable, not invariant or unstable, "
+                  "using timer ticks\n");
+    serial_set_colour(col);
+    clock_state.source = CLOCK_SOURCE_TICKS;
+    return 0;
+  }
+
+  /* start counting from the current tick, so that both sources agree
+     on the time since boot */
+  uint32_t flags = cpu_flags();
+  cli();
+  clock_state.base_cycles = rdtsc();
+  clock_state.base_ns = (uint64_t) timer_get_tick() * 1000000;
+  clock_state.source = CLOCK_SOURCE_TSC;
+  if (flags & EFLAGS_IF) sti();
+
+  serial_printf("TSC frequency: %u kHz\n", clock_state.khz);
+  return 0;
+}
+
+uint64_t clock_cycles_to_ns(uint64_t cycles)
+{
+  if (clock_state.source != CLOCK_SOURCE_TSC) return 0;
+
+  /* split the multiplication to avoid overflowing 64 bits */
+  uint64_t hi = (cycles >> 32) * clock_state.mult;
+  uint64_t lo = (cycles & 0xffffffff) * clock_state.mult;
+  return (hi << (32 - CLOCK_SHIFT)) + (lo >> CLOCK_SHIFT);
+}
+
+uint64_t clock_ns(void)
+{
+  if (clock_state.source != CLOCK_SOURCE_TSC)
+    return (uint64_t) timer_get_tick() * 1000000;
+
+  return clock_state.base_ns + clock_cycles_to_ns(rdtsc() - clock_state.base_cycles);
+}
+
+clock_source_t clock_source(void)
+{
+  return clock_state.source;
+}
+
+uint32_t clock_tsc_khz(void)
+{
+  return clock_state.source == CLOCK_SOURCE_TSC ? clock_state.khz : 0;
+}
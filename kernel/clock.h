@@ -0,0 +1,33 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+
+/* High resolution monotonic clock.
+
+   The time stamp counter is calibrated against channel 2 of the PIT
+   at boot, and cycle counts are converted to nanoseconds with a fixed
+   point multiplier. When the TSC is missing, is not invariant, or
+   calibration gives inconsistent results, the clock falls back to
+   timer ticks, and only has millisecond resolution.
+*/
+
+typedef enum {
+  CLOCK_SOURCE_TICKS,
+  CLOCK_SOURCE_TSC,
+} clock_source_t;
+
+int clock_init(void);
+
+/* nanoseconds since boot */
+uint64_t clock_ns(void);
+
+/* convert a TSC cycle count to nanoseconds, returns 0 when the TSC is
+   not used */
+uint64_t clock_cycles_to_ns(uint64_t cycles);
+
+clock_source_t clock_source(void);
+/* calibrated TSC frequency in kHz, 0 when the TSC is not used */
+uint32_t clock_tsc_khz(void);
+
+#endif /* CLOCK_H */
@@ -62,7 +62,7 @@ int console_init(console_backend_t *backend)
   console.offset = 0;
   if (console.width <= 0 || console.height <= 0) return -1;
 
-  console.buffer = (uint8_t *) falloc(console.width * console.height * sizeof(uint8_t));
+  console.buffer = (uint8_t *) falloc_zeroed(console.width * console.height * sizeof(uint8_t));
   console.fg_buffer = (uint32_t *) falloc(console.width * console.height * sizeof(uint32_t));
   console.bg_buffer = (uint32_t *) falloc(console.width * console.height * sizeof(uint32_t));
 
@@ -72,7 +72,6 @@ int console_init(console_backend_t *backend)
   }
 
   for (int i = 0; i < console.width * console.height; i++) {
-    console.buffer[i] = 0;
     console.fg_buffer[i] = DEFAULT_FG;
     console.bg_buffer[i] = DEFAULT_BG;
   }
@@ -88,13 +87,15 @@ static void console_renderer(void)
 {
   while (1) {
     sem_wait(&console.write_sem);
-    unsigned int ticks = timer_get_tick();
+    unsigned long ticks = timer_get_tick();
     console.backend->ops->repaint
       (console.backend->ops_data, &console);
-#if CONSOLE_DEBUG
-    serial_printf("[console] rendered in %u ticks\n",
-                  timer_get_tick() - ticks);
-#endif
+    ticks = timer_get_tick() - ticks;
+    TRACE("rendered in %lu ticks\n", ticks);
+    console.repaints++;
+    console.repaint_ticks += ticks;
+    if (ticks > console.max_repaint_ticks)
+      console.max_repaint_ticks = ticks;
     console.needs_repaint = 0;
     sem_signal(&console.write_sem);
 
@@ -104,7 +105,7 @@ static void console_renderer(void)
 
 void console_start_background_task()
 {
-  sched_spawn_task(console_renderer);
+  sched_spawn_task(console_renderer, "console", SCHED_PRIO_NORMAL);
 }
 
 void console_clear_line(int y)
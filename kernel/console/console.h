@@ -30,6 +30,11 @@ typedef struct console {
   semaphore_t paint_sem;
   int needs_repaint;
 
+  /* repaint timing, in timer ticks */
+  unsigned long repaints;
+  unsigned long repaint_ticks;
+  unsigned long max_repaint_ticks;
+
   uint8_t *buffer;
   uint32_t *fg_buffer;
   uint32_t *bg_buffer;
@@ -0,0 +1,32 @@
+#include "dma_pool.h"
+#include "frames.h"
+#include "slab.h"
+
+#include <assert.h>
+
+dma_pool_t *dma_pool_create(const char *name, frames_t *frames,
+                            size_t size, size_t align)
+{
+  if (frames->end > KERNEL_MEMORY_END) return 0;
+  return kmem_cache_create_on(frames, name, size, align, 0);
+}
+
+void *dma_pool_alloc(dma_pool_t *pool)
+{
+  void *buf = kmem_cache_alloc(pool);
+  assert((size_t) buf < KERNEL_MEMORY_END);
+  return buf;
+}
+
+int dma_pool_alloc_bulk(dma_pool_t *pool, unsigned n, void **bufs)
+{
+  if (kmem_cache_alloc_bulk(pool, n, bufs) == -1) return -1;
+  for (unsigned i = 0; i < n; i++)
+    assert((size_t) bufs[i] < KERNEL_MEMORY_END);
+  return 0;
+}
+
+void dma_pool_free(dma_pool_t *pool, void *buf)
+{
+  kmem_cache_free(pool, buf);
+}
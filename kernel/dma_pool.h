@@ -0,0 +1,25 @@
+#ifndef DMA_POOL_H
+#define DMA_POOL_H
+
+#include <stddef.h>
+
+/* Pools of DMA buffers smaller than a frame.
+
+   A pool hands out buffers of a fixed size and alignment, carved out
+   of frames of the given allocator, which must lie in identity mapped
+   memory. Buffers are therefore physically contiguous, and their
+   address can be passed to a device as is. */
+
+struct frames;
+struct kmem_cache;
+
+typedef struct kmem_cache dma_pool_t;
+
+dma_pool_t *dma_pool_create(const char *name, struct frames *frames,
+                            size_t size, size_t align);
+void *dma_pool_alloc(dma_pool_t *pool);
+/* allocate n buffers at once, or none */
+int dma_pool_alloc_bulk(dma_pool_t *pool, unsigned n, void **bufs);
+void dma_pool_free(dma_pool_t *pool, void *buf);
+
+#endif /* DMA_POOL_H */
@@ -1,18 +1,35 @@
 #include "ata.h"
+#include "bcache.h"
 #include "core/debug.h"
+#include "core/interrupts.h"
 #include "core/io.h"
 #include "core/storage.h"
 #include "core/util.h"
 #include "drivers/drivers.h"
+#include "frames.h"
 #include "handlers.h"
 #include "kmalloc.h"
+#include "memory.h"
 #include "pci.h"
+#include "semaphore.h"
+
+#include <string.h>
 
 #define MAX_BUSY_ATTEMPTS 50000
+/* give up waiting for an interrupt after this many ticks */
+#define ATA_IRQ_TIMEOUT 2000
 
 #define ATA_DEBUG 1
 #define SECTOR_ALIGNMENT 9
 
+/* maximum size of a single DMA transfer, this is also the size of
+   the bounce buffer of each channel */
+#define DMA_MAX_BYTES 0x10000
+#define DMA_MAX_SECTORS (DMA_MAX_BYTES >> SECTOR_ALIGNMENT)
+/* a PRD entry cannot cross a 64K boundary */
+#define DMA_BOUNDARY_BITS 16
+#define DMA_PRDT_SIZE (1 << PAGE_BITS)
+
 extern storage_ops_t ata_ops;
 
 typedef struct ata_sector {
@@ -25,15 +42,33 @@ enum {
   IDE_PROGIF_BM = 0x80,
 };
 
+/* physical region descriptor */
+typedef struct prd {
+  uint32_t address;
+  /* 0 means 64K */
+  uint16_t size;
+  uint16_t flags;
+} __attribute__((packed)) prd_t;
+
+enum {
+  PRD_EOT = 1 << 15,
+};
+
 /* offsets into identify structure */
 enum {
   IDENTIFY_MODEL_NUMBER = 27,
+  IDENTIFY_CAPABILITIES = 49,
   IDENTIFY_LBA28_SECTORS = 60,
   IDENTIFY_VERSION_MAJOR = 80,
   IDENTIFY_SUPPORTED_COMMANDS = 82,
   IDENTIFY_LBA48_SECTORS = 100,
 };
 
+/* bits of IDENTIFY_CAPABILITIES */
+enum {
+  CAPABILITY_DMA = 1 << 8,
+};
+
 /* bits of IDENTIFY_SUPPORTED_COMMANDS */
 enum {
   SUPPORTED_LBA48 = 1 << 26,
@@ -46,16 +81,35 @@ struct channel_struct {
   uint16_t ctrl;
   /* last drive selected */
   uint8_t last_drive;
+
+  /* bus master IO port, 0 if DMA is not available */
+  uint16_t bmi;
+  /* descriptor table and bounce buffer, in DMA memory */
+  prd_t *prdt;
+  uint8_t *bounce;
+
+  /* irq line, 0 while the channel is polled */
+  uint8_t irq;
+  /* set while a command is waiting for its completion interrupt */
+  volatile int pending;
+  /* signalled by the interrupt handler */
+  semaphore_t irq_sem;
+  /* serialises commands on the channel */
+  semaphore_t lock;
 };
 
 channel_t ata_channels[2] = {0};
 drive_t drives[4] = {0};
 static int ata_initialised = 0;
-static uint8_t ata_irq_number = 0;
 
 /* bus master */
 static uint16_t ata_bmi;
 
+static inline uint16_t bm_port(uint8_t channel, uint8_t reg)
+{
+  return ata_channels[channel].bmi + reg;
+}
+
 static inline uint16_t reg_port(uint8_t channel, uint8_t reg)
 {
   if (reg < ATA_REG_CTRL)
@@ -134,6 +188,47 @@ uint8_t ata_poll_busy(uint8_t channel, unsigned max)
   return status;
 }
 
+/* mark the channel as expecting an interrupt; must be called before
+   the command (or data transfer) that triggers it */
+static inline void ata_expect_irq(uint8_t channel)
+{
+  channel_t *ch = &ata_channels[channel];
+  if (!ch->irq) return;
+  if (ch->bmi) {
+    /* the bus master sets its interrupt bit on every drive interrupt,
+       so clear it for the irq handler to tell ours apart; the error
+       bit is left alone */
+    uint16_t bm_status = bm_port(channel, ATA_BM_REG_STATUS);
+    outb(bm_status, (inb(bm_status) & ~ATA_BM_ST_ERR) | ATA_BM_ST_IRQ);
+  }
+  sem_reset(&ch->irq_sem, 0);
+  ch->pending = 1;
+}
+
+/* sleep until the interrupt expected by the channel arrives, returns
+   -1 if it does not arrive in time */
+static int ata_sleep_irq(uint8_t channel)
+{
+  channel_t *ch = &ata_channels[channel];
+  if (sem_wait_timeout(&ch->irq_sem, ATA_IRQ_TIMEOUT) == 0) return 0;
+
+  ch->pending = 0;
+  int col = serial_set_colour(SERIAL_COLOUR_WARN);
+  serial_printf("[ata] interrupt timeout on channel %u\n", channel);
+  serial_set_colour(col);
+  return -1;
+}
+
+/* sleep until the interrupt expected by the channel arrives, then wait
+   for the drive to be ready; a lost interrupt falls back to polling */
+static uint8_t ata_wait_irq(uint8_t channel)
+{
+  channel_t *ch = &ata_channels[channel];
+  if (ch->irq) ata_sleep_irq(channel);
+  ata_poll_busy(channel, MAX_BUSY_ATTEMPTS);
+  return ata_poll_ready(channel);
+}
+
 static int ata_prepare_read_write(drive_t *drive, uint64_t lba, uint32_t count)
 {
   ata_write(drive->channel, ATA_REG_DRIVE_HEAD,
@@ -160,7 +255,8 @@ static int ata_prepare_read_write(drive_t *drive, uint64_t lba, uint32_t count)
   return 0;
 }
 
-int ata_write_bytes(drive_t *drive, void *buf, uint64_t offset, uint32_t bytes)
+static int ata_pio_write_bytes(drive_t *drive, void *buf,
+                               uint64_t offset, uint32_t bytes)
 {
   assert(ALIGNED_BITS(offset, SECTOR_ALIGNMENT));
   assert(ALIGNED_BITS(bytes, SECTOR_ALIGNMENT));
@@ -178,6 +274,7 @@ int ata_write_bytes(drive_t *drive, void *buf, uint64_t offset, uint32_t bytes)
 
   ata_sector_t *sector = buf;
   for (unsigned i = 0; i < count; i++) {
+    /* the first sector is requested without an interrupt */
     uint8_t status = ATA_ST_BSY;
     status = ata_poll_busy(drive->channel, MAX_BUSY_ATTEMPTS);
     status = ata_poll_ready(drive->channel);
@@ -189,21 +286,26 @@ int ata_write_bytes(drive_t *drive, void *buf, uint64_t offset, uint32_t bytes)
       return -1;
     }
 
+    /* the drive interrupts once it has consumed the sector */
+    ata_expect_irq(drive->channel);
     for (unsigned k = 0; k < 256; k++) {
       ata_writew(drive->channel, ATA_REG_DATA, sector->data[k]);
     }
+    ata_wait_irq(drive->channel);
 
     sector++;
   }
 
   /* flush cache */
+  ata_expect_irq(drive->channel);
   ata_write(drive->channel, ATA_REG_STATUS, ATA_CMD_FLUSH_CACHE);
-  ata_wait(drive->channel);
+  ata_wait_irq(drive->channel);
 
   return 0;
 }
 
-void *ata_read_bytes(drive_t *drive, void *buf, uint64_t offset, uint32_t bytes)
+static void *ata_pio_read_bytes(drive_t *drive, void *buf,
+                                uint64_t offset, uint32_t bytes)
 {
   uint64_t lba = offset >> SECTOR_ALIGNMENT;
   uint64_t lba_end = DIV_UP(offset + bytes, 1 << SECTOR_ALIGNMENT);
@@ -216,6 +318,7 @@ void *ata_read_bytes(drive_t *drive, void *buf, uint64_t offset, uint32_t bytes)
     return 0;
 
   /* send read command */
+  ata_expect_irq(drive->channel);
   ata_write(drive->channel, ATA_REG_STATUS, ATA_CMD_READ_PIO);
 
   unsigned int j = 0;
@@ -224,9 +327,7 @@ void *ata_read_bytes(drive_t *drive, void *buf, uint64_t offset, uint32_t bytes)
 
   /* read data */
   for (unsigned int i = 0; i < count; i++) {
-    uint8_t status = ATA_ST_BSY;
-    status = ata_poll_busy(drive->channel, MAX_BUSY_ATTEMPTS);
-    status = ata_poll_ready(drive->channel);
+    uint8_t status = ata_wait_irq(drive->channel);
 
     if (status & ATA_ST_ERR) {
       int col = serial_set_colour(SERIAL_COLOUR_ERR);
@@ -235,6 +336,8 @@ void *ata_read_bytes(drive_t *drive, void *buf, uint64_t offset, uint32_t bytes)
       return 0;
     }
 
+    /* the next sector is signalled as soon as this one is drained */
+    if (i + 1 < count) ata_expect_irq(drive->channel);
     for (unsigned int k = 0; k < 256; k++) {
       uint16_t val = ata_readw(drive->channel, ATA_REG_DATA);
       if (buf_offset) {
@@ -253,6 +356,218 @@ void *ata_read_bytes(drive_t *drive, void *buf, uint64_t offset, uint32_t bytes)
   return result;
 }
 
+/* whether a buffer can be handed directly to the bus master */
+static int dma_direct_buffer(void *buf, uint32_t bytes)
+{
+  size_t p = (size_t) buf;
+  return ALIGNED_BITS(p, 1) && p + bytes <= KERNEL_MEMORY_END;
+}
+
+/* fill the PRD table of a channel for a physically contiguous buffer */
+static void dma_setup_prdt(channel_t *ch, uint32_t address, uint32_t bytes)
+{
+  prd_t *prd = ch->prdt;
+  while (bytes) {
+    uint32_t boundary = ALIGN_BITS(address, DMA_BOUNDARY_BITS) +
+      (1 << DMA_BOUNDARY_BITS);
+    uint32_t size = boundary - address;
+    if (size > bytes) size = bytes;
+
+    prd->address = address;
+    prd->size = size & 0xffff;
+    prd->flags = 0;
+
+    address += size;
+    bytes -= size;
+    if (!bytes) prd->flags = PRD_EOT;
+    prd++;
+  }
+}
+
+/* wait for the bus master to finish the current transfer */
+static uint8_t ata_dma_wait(uint8_t channel)
+{
+  uint8_t status;
+  if (ata_channels[channel].irq) {
+    int ret = ata_sleep_irq(channel);
+    status = inb(bm_port(channel, ATA_BM_REG_STATUS));
+    if (ret == 0) return status | ATA_BM_ST_IRQ;
+
+    /* report a transfer that is still in progress as failed */
+    if ((status & ATA_BM_ST_ACTIVE) && !(status & ATA_BM_ST_IRQ))
+      status |= ATA_BM_ST_ERR;
+    return status;
+  }
+
+  do {
+    status = inb(bm_port(channel, ATA_BM_REG_STATUS));
+    if (ata_read(channel, ATA_REG_STATUS) & ATA_ST_ERR) break;
+  } while ((status & ATA_BM_ST_ACTIVE) &&
+           !(status & (ATA_BM_ST_ERR | ATA_BM_ST_IRQ)));
+  return status;
+}
+
+/* transfer at most DMA_MAX_SECTORS sectors between the drive and a
+   physically contiguous buffer */
+static int ata_dma_transfer(drive_t *drive, int write, void *buf,
+                            uint64_t lba, uint32_t count)
+{
+  channel_t *ch = &ata_channels[drive->channel];
+  uint16_t bm_cmd = bm_port(drive->channel, ATA_BM_REG_CMD);
+  uint16_t bm_status = bm_port(drive->channel, ATA_BM_REG_STATUS);
+  assert(count > 0 && count <= DMA_MAX_SECTORS);
+
+  dma_setup_prdt(ch, (uint32_t) buf, count << SECTOR_ALIGNMENT);
+  outl(bm_port(drive->channel, ATA_BM_REG_PRDT), (uint32_t) ch->prdt);
+
+  /* set direction and clear error and interrupt bits */
+  outb(bm_cmd, write ? 0 : ATA_BM_CMD_READ);
+  outb(bm_status, inb(bm_status) | ATA_BM_ST_ERR | ATA_BM_ST_IRQ);
+
+  /* send lba and count */
+  if (ata_prepare_read_write(drive, lba, count) == -1)
+    return -1;
+
+  uint8_t cmd;
+  if (write)
+    cmd = drive->lba48 ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA;
+  else
+    cmd = drive->lba48 ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA;
+  ata_expect_irq(drive->channel);
+  ata_write(drive->channel, ATA_REG_STATUS, cmd);
+
+  /* start transfer */
+  outb(bm_cmd, inb(bm_cmd) | ATA_BM_CMD_START);
+  uint8_t dma_status = ata_dma_wait(drive->channel);
+  outb(bm_cmd, inb(bm_cmd) & ~ATA_BM_CMD_START);
+  outb(bm_status, dma_status | ATA_BM_ST_ERR | ATA_BM_ST_IRQ);
+
+  uint8_t status = ata_poll_busy(drive->channel, MAX_BUSY_ATTEMPTS);
+  if ((dma_status & ATA_BM_ST_ERR) || (status & (ATA_ST_ERR | ATA_ST_DR))) {
+    int col = serial_set_colour(SERIAL_COLOUR_ERR);
+    serial_printf("[ata] DMA error, status: %#02x bus master: %#02x\n",
+                  status, dma_status);
+    serial_set_colour(col);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int ata_dma_write_bytes(drive_t *drive, void *buf,
+                               uint64_t offset, uint32_t bytes)
+{
+  assert(ALIGNED_BITS(offset, SECTOR_ALIGNMENT));
+  assert(ALIGNED_BITS(bytes, SECTOR_ALIGNMENT));
+  channel_t *ch = &ata_channels[drive->channel];
+  uint64_t lba = offset >> SECTOR_ALIGNMENT;
+  uint32_t count = bytes >> SECTOR_ALIGNMENT;
+  int direct = dma_direct_buffer(buf, bytes);
+
+  uint8_t *src = buf;
+  while (count > 0) {
+    uint32_t n = count > DMA_MAX_SECTORS ? DMA_MAX_SECTORS : count;
+    uint32_t size = n << SECTOR_ALIGNMENT;
+
+    void *p = src;
+    if (!direct) {
+      memcpy(ch->bounce, src, size);
+      p = ch->bounce;
+    }
+    if (ata_dma_transfer(drive, 1, p, lba, n) == -1)
+      return -1;
+
+    src += size;
+    lba += n;
+    count -= n;
+  }
+
+  /* flush cache */
+  ata_expect_irq(drive->channel);
+  ata_write(drive->channel, ATA_REG_STATUS, ATA_CMD_FLUSH_CACHE);
+  ata_wait_irq(drive->channel);
+
+  return 0;
+}
+
+static void *ata_dma_read_bytes(drive_t *drive, void *buf,
+                                uint64_t offset, uint32_t bytes)
+{
+  channel_t *ch = &ata_channels[drive->channel];
+  uint64_t lba = offset >> SECTOR_ALIGNMENT;
+  uint64_t lba_end = (offset + bytes + (1 << SECTOR_ALIGNMENT) - 1)
+    >> SECTOR_ALIGNMENT;
+  uint32_t skip = offset - (lba << SECTOR_ALIGNMENT);
+
+  /* read straight into the destination if possible, otherwise go
+     through the bounce buffer */
+  int direct = !skip && ALIGNED_BITS(bytes, SECTOR_ALIGNMENT) &&
+    dma_direct_buffer(buf, bytes);
+
+  uint8_t *dst = buf;
+  while (lba < lba_end) {
+    uint32_t n = lba_end - lba > DMA_MAX_SECTORS ?
+      DMA_MAX_SECTORS : lba_end - lba;
+
+    if (direct) {
+      if (ata_dma_transfer(drive, 0, dst, lba, n) == -1)
+        return 0;
+      dst += n << SECTOR_ALIGNMENT;
+    }
+    else {
+      if (ata_dma_transfer(drive, 0, ch->bounce, lba, n) == -1)
+        return 0;
+      uint32_t size = (n << SECTOR_ALIGNMENT) - skip;
+      if (size > bytes) size = bytes;
+      memcpy(dst, ch->bounce + skip, size);
+      dst += size;
+      bytes -= size;
+      skip = 0;
+    }
+
+    lba += n;
+  }
+
+  return buf;
+}
+
+static inline int ata_use_dma(drive_t *drive)
+{
+  return drive->dma && ata_channels[drive->channel].bmi;
+}
+
+int ata_write_bytes(drive_t *drive, void *buf, uint64_t offset, uint32_t bytes)
+{
+  channel_t *ch = &ata_channels[drive->channel];
+  int ret;
+
+  sem_wait(&ch->lock);
+  if (ata_use_dma(drive))
+    ret = ata_dma_write_bytes(drive, buf, offset, bytes);
+  else
+    ret = ata_pio_write_bytes(drive, buf, offset, bytes);
+  ch->pending = 0;
+  sem_signal(&ch->lock);
+
+  return ret;
+}
+
+void *ata_read_bytes(drive_t *drive, void *buf, uint64_t offset, uint32_t bytes)
+{
+  channel_t *ch = &ata_channels[drive->channel];
+  void *ret;
+
+  sem_wait(&ch->lock);
+  if (ata_use_dma(drive))
+    ret = ata_dma_read_bytes(drive, buf, offset, bytes);
+  else
+    ret = ata_pio_read_bytes(drive, buf, offset, bytes);
+  ch->pending = 0;
+  sem_signal(&ch->lock);
+
+  return ret;
+}
+
 void ata_controller_type(device_t *ide,
                          int (*print)(const char *, ...))
 {
@@ -337,6 +652,7 @@ int ata_identify_drive(drive_t *drive)
     identify_readl(id, IDENTIFY_SUPPORTED_COMMANDS);
 
   drive->lba48 = supported_commands & SUPPORTED_LBA48;
+  drive->dma = (id[IDENTIFY_CAPABILITIES] & CAPABILITY_DMA) != 0;
   drive->lba_sectors = drive->lba48
     ? identify_readll(id, IDENTIFY_LBA48_SECTORS)
     : identify_readl(id, IDENTIFY_LBA28_SECTORS);
@@ -391,22 +707,38 @@ void ata_list_drives(void)
   }
 }
 
-void ata_irq(struct isr_stack *stack)
+void ata_irq(isr_stack_t *stack)
 {
-  int serviced = 0;
+  int irq = stack->int_num - IDT_IRQ;
+
   for (int channel = 0; channel < 2; channel++) {
+    channel_t *ch = &ata_channels[channel];
+    if (ch->irq != irq || !ch->pending) continue;
+
+    if (ch->bmi) {
+      /* ignore interrupts raised by other devices on a shared line */
+      uint8_t bm_status = inb(bm_port(channel, ATA_BM_REG_STATUS));
+      if (!(bm_status & ATA_BM_ST_IRQ)) continue;
+    }
+
+    /* reading the status register acknowledges the interrupt */
     uint8_t status = ata_read(channel, ATA_REG_STATUS);
-    serviced = serviced || (status != 0);
+    if (status & ATA_ST_BSY) continue;
     if (status & ATA_ST_ERR) {
       int col = serial_set_colour(SERIAL_COLOUR_ERR);
       serial_printf("[ata] error: %#02x\n",
                     ata_read(channel, ATA_REG_ERROR));
       serial_set_colour(col);
     }
+
+    ch->pending = 0;
+    _sem_signal(&ch->irq_sem);
   }
-  if (serviced) pic_eoi(ata_irq_number);
+
+  pic_eoi(irq);
 }
-HANDLER_STATIC(ata_irq_handler, ata_irq);
+HANDLER_STATIC(ata_irq_handler0, ata_irq);
+HANDLER_STATIC(ata_irq_handler1, ata_irq);
 
 int ata_init(void *data, device_t *ide)
 {
@@ -431,14 +763,47 @@ int ata_init(void *data, device_t *ide)
     (ide->bars[3] & ~3) : ATA_SECONDARY_CTRL;
   ata_bmi = ide->bars[4];
 
-  ata_irq_number = ide->irq & 0xff;
-  if (!ata_irq_number) ata_irq_number = ATA_SECONDARY_IRQ;
+  /* set up bus mastering */
+  if ((ide->prog_if & IDE_PROGIF_BM) && (ata_bmi & 1)) {
+    for (int channel = 0; channel < 2; channel++) {
+      channel_t *ch = &ata_channels[channel];
+      ch->prdt = (prd_t *) (size_t) frames_alloc(&dma_frames, DMA_PRDT_SIZE);
+      ch->bounce = (uint8_t *) (size_t) frames_alloc(&dma_frames, DMA_MAX_BYTES);
+      if (ch->prdt && ch->bounce) {
+        ch->bmi = (ata_bmi & ~3) + 8 * channel;
+      }
+      else {
+        if (ch->prdt) frames_free(&dma_frames, (size_t) ch->prdt);
+        if (ch->bounce) frames_free(&dma_frames, (size_t) ch->bounce);
+      }
+    }
+    device_command_set_mask(ide, PCI_CMD_BUS_MASTER);
+  }
+#if ATA_DEBUG
+  serial_printf("[ata] DMA: %s\n", ata_channels[0].bmi ? "yes" : "no");
+#endif
+
+  /* channels in native mode use the PCI interrupt line, the others
+     their legacy irq */
+  ata_channels[0].irq = (ide->prog_if & IDE_PROGIF_PCI) && (ide->irq & 0xff) ?
+    (ide->irq & 0xff) : ATA_PRIMARY_IRQ;
+  ata_channels[1].irq = (ide->prog_if & IDE_PROGIF_PCI) && (ide->irq & 0xff) ?
+    (ide->irq & 0xff) : ATA_SECONDARY_IRQ;
 
 #if ATA_DEBUG
-  serial_printf("[ata] irq number = %u\n", ata_irq_number);
+  serial_printf("[ata] irq numbers = %u %u\n",
+                ata_channels[0].irq, ata_channels[1].irq);
 #endif
-  if (ata_irq_number) {
-    irq_grab(ata_irq_number, &ata_irq_handler);
+  irq_grab(ata_channels[0].irq, &ata_irq_handler0);
+  if (ata_channels[1].irq != ata_channels[0].irq)
+    irq_grab(ata_channels[1].irq, &ata_irq_handler1);
+
+  /* identify drives by polling, interrupts are enabled afterwards */
+  uint8_t irqs[2] = { ata_channels[0].irq, ata_channels[1].irq };
+  for (int channel = 0; channel < 2; channel++) {
+    ata_channels[channel].irq = 0;
+    sem_init(&ata_channels[channel].irq_sem, 0);
+    sem_init(&ata_channels[channel].lock, 1);
   }
 
   /* initialise drives */
@@ -459,7 +824,8 @@ int ata_init(void *data, device_t *ide)
       int ok = ata_identify_drive(&drives[i]);
       if (ok) {
 #if ATA_DEBUG
-        serial_printf("[ata] drive %u channel %u: ", i);
+        serial_printf("[ata] drive %u channel %u%s: ", i, channel,
+                      ata_use_dma(&drives[i]) ? " (DMA)" : "");
         {
           uint64_t kb = drives[i].lba_sectors >> 1;
           uint64_t mb = kb >> 10;
@@ -484,6 +850,10 @@ int ata_init(void *data, device_t *ide)
       }
       i++;
     }
+
+    /* switch the channel to interrupt-driven completion */
+    ata_channels[channel].irq = irqs[channel];
+    ata_write(channel, ATA_REG_CTRL, 0);
   }
 
   return 0;
@@ -492,6 +862,8 @@ int ata_init(void *data, device_t *ide)
 typedef struct {
   drive_t *drive;
   uint32_t part_offset;
+  /* uncached storage, wrapped by the buffer cache */
+  storage_t raw;
 } ata_ops_data_t;
 
 static int ata_ops_write_unaligned(void *data, void *buf, void *scratch,
@@ -550,11 +922,16 @@ void ata_storage_init(storage_t *storage, drive_t *drive, unsigned part_offset)
   data->drive = drive;
   data->part_offset = part_offset;
 
-  storage->ops = &ata_ops;
-  storage->ops_data = data;
+  data->raw.ops = &ata_ops;
+  data->raw.ops_data = data;
+  if (bcache_storage_init(storage, &data->raw, drive,
+                          (uint64_t) part_offset << SECTOR_ALIGNMENT) == -1)
+    *storage = data->raw;
 }
 
 void ata_storage_cleanup(storage_t *storage)
 {
+  if (storage->ops != &ata_ops)
+    storage = bcache_storage_cleanup(storage);
   kfree(storage->ops_data);
 }
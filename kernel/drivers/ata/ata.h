@@ -69,11 +69,36 @@ enum {
 /* ATA commands */
 enum {
   ATA_CMD_READ_PIO = 0x20,
+  ATA_CMD_READ_DMA_EXT = 0x25,
   ATA_CMD_WRITE_PIO = 0x30,
+  ATA_CMD_WRITE_DMA_EXT = 0x35,
+  ATA_CMD_READ_DMA = 0xc8,
+  ATA_CMD_WRITE_DMA = 0xca,
   ATA_CMD_FLUSH_CACHE = 0xe7,
   ATA_CMD_IDENTIFY = 0xec,
 };
 
+/* bus master registers, relative to the channel base */
+enum {
+  ATA_BM_REG_CMD = 0,
+  ATA_BM_REG_STATUS = 2,
+  ATA_BM_REG_PRDT = 4,
+};
+
+/* bus master command register */
+enum {
+  ATA_BM_CMD_START = 1 << 0,
+  /* direction: device to memory */
+  ATA_BM_CMD_READ = 1 << 3,
+};
+
+/* bus master status register */
+enum {
+  ATA_BM_ST_ACTIVE = 1 << 0,
+  ATA_BM_ST_ERR = 1 << 1,
+  ATA_BM_ST_IRQ = 1 << 2,
+};
+
 /* ATA control register */
 enum {
   ATA_CTRL_NIEN = 1 << 1,
@@ -85,6 +110,7 @@ typedef struct drive {
   uint8_t channel;
   uint8_t index;
   uint8_t lba48;
+  uint8_t dma;
   uint64_t lba_sectors;
   char model[41];
 } drive_t;
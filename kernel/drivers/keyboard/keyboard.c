@@ -6,19 +6,17 @@
 #include "core/io.h"
 #include "core/v8086.h"
 #include "handlers.h"
+#include "ring.h"
 #include "scheduler.h"
 #include "timer.h"
+#include "work.h"
 
 #include <stddef.h>
 
 #define KB_TASKLET 1
 
-static uint32_t kb_tasklet_stack[512];
-static task_t kb_tasklet = {
-  .state = TASK_STOPPED,
-};
-/* whether the tasklet is already processing a keyboard event */
-static int kb_tasklet_running = 0;
+static void kb_process_scancodes(void *data);
+static work_t kb_work = WORK_INIT(kb_process_scancodes, 0);
 
 void (*kb_on_event)(kb_event_t *event, void *data) = 0;
 void *kb_on_event_data = 0;
@@ -101,13 +99,9 @@ static char kb_printable_1[] = ")!\"#$%^&*(ABCDEFGHIJKLMNOPQRSTUVWXYZ<>?|{}:*_++
 uint8_t kb_mods = 0;
 
 #define EVENT_BUFFER_SIZE 512
-uint8_t kb_scancode_buffer[EVENT_BUFFER_SIZE];
-queue_t kb_scancodes = {
-  .size = EVENT_BUFFER_SIZE,
-  .start = 0,
-  .end = 0,
-  .items = (void *)kb_scancode_buffer,
-};
+/* scancodes read by the interrupt handler */
+static uint8_t kb_scancode_buffer[EVENT_BUFFER_SIZE];
+static ring_t kb_scancodes = RING_INIT(EVENT_BUFFER_SIZE);
 
 #define MOD_SET(pressed, mod) \
   kb_mods = (kb_mods & ~MOD_MASK(mod)) | ((pressed) << (mod));
@@ -168,26 +162,11 @@ void kb_emit(kb_event_t *event)
     kb_on_event(event, kb_on_event_data);
 }
 
-void kb_process_scancodes()
+static void kb_process_scancodes(void *data)
 {
-  while (1) {
-    sched_disable_preemption();
-    pic_mask(IRQ_KEYBOARD);
-    while (kb_scancodes.start != kb_scancodes.end) {
-      uint8_t scancode = kb_scancode_buffer[kb_scancodes.start];
-      kb_scancodes.start = (kb_scancodes.start + 1) % kb_scancodes.size;
-      pic_unmask(IRQ_KEYBOARD);
-      sched_enable_preemption();
-      kb_propagate_event(scancode);
-      sched_disable_preemption();
-      pic_mask(IRQ_KEYBOARD);
-    }
-
-    sched_current->state = TASK_WAITING;
-    kb_tasklet_running = 0;
-    pic_unmask(IRQ_KEYBOARD);
-    sched_yield();
-  }
+  uint8_t scancode;
+  while (RING_POP(&kb_scancodes, kb_scancode_buffer, &scancode))
+    kb_propagate_event(scancode);
 }
 
 void kb_irq(struct isr_stack *stack)
@@ -196,22 +175,10 @@ void kb_irq(struct isr_stack *stack)
   uint8_t scancode = inb(PS2_DATA);
 
 #if KB_TASKLET
-  kb_scancode_buffer[kb_scancodes.end] = scancode;
-  kb_scancodes.end = (kb_scancodes.end + 1) % kb_scancodes.size;
-  if (kb_scancodes.end == kb_scancodes.start) {
-    /* drop old scancodes */
-    kb_scancodes.start++;
-  }
-
-  /* add tasklet to scheduler */
-  if (!kb_tasklet_running) {
-    /* note that we can't just check the task state to determine if the
-    tasklet is running, because it may be blocked on a semaphore, in
-    which case we don't want to wake it prematurely */
-    kb_tasklet.state = TASK_RUNNING;
-    list_add(&sched_runqueue, &kb_tasklet.head);
-    kb_tasklet_running = 1;
-  }
+  /* the oldest scancodes belong to the consumer, so drop the new one
+     if the buffer is full */
+  RING_PUSH(&kb_scancodes, kb_scancode_buffer, scancode);
+  work_schedule(&kb_work);
 #else
   kb_event_t *event = kb_generate_event(scancode);
   if (event->pressed && event->printable) {
@@ -228,14 +195,6 @@ int kb_init(void)
   /* flush PS2 buffer */
   inb(PS2_DATA);
 
-  /* prepare tasklet */
-  isr_stack_t *stack = (void *)kb_tasklet_stack + sizeof(kb_tasklet_stack) - sizeof(isr_stack_t);
-  stack->eip = (uint32_t) kb_process_scancodes;
-  stack->eflags = EFLAGS_IF;
-  stack->cs = GDT_SEL(GDT_CODE);
-  kb_tasklet.stack = stack;
-  kb_tasklet.state = TASK_WAITING;
-
   /* register irq handler */
   irq_grab(IRQ_KEYBOARD, &kb_irq_handler);
 
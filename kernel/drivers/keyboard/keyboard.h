@@ -35,16 +35,6 @@ typedef struct {
   unsigned long timestamp;
 } kb_event_t;
 
-/* circular array */
-typedef struct {
-  unsigned int size;
-  unsigned int start;
-  unsigned int end;
-  void *items;
-} queue_t;
-
-extern queue_t kb_events;
-
 /* add a process to the keyboard waiting queue */
 void kb_grab(void (*on_event)(kb_event_t *event, void *data), void *data);
 void kb_reset_system(void);
@@ -13,6 +13,7 @@
 #include "pci.h"
 #include "scheduler.h"
 #include "semaphore.h"
+#include "work.h"
 
 #define DEBUG_LOCAL 0
 
@@ -46,12 +47,8 @@ typedef struct {
 
 data_t rtl8139_data = {0};
 
-/* rx tasklet */
-static uint32_t tasklet_stack[512];
-static task_t tasklet = {
-  .state = TASK_STOPPED,
-};
-static int tasklet_running = 0;
+static void receive(void *data);
+static work_t rx_work = WORK_INIT(receive, &rtl8139_data);
 
 enum {
   TSD_TOK = 1 << 15,
@@ -113,57 +110,51 @@ static void cleanup_transmissions(data_t *data)
   }
 }
 
-static void receive(void)
+static void receive(void *_data)
 {
-  data_t *data = &rtl8139_data;
+  data_t *data = _data;
 
-  while (1) {
 #if DEBUG_LOCAL
-    serial_printf("[rtl8139] rx capr: %#x: cbr: %#x\n",
-                  inw(data->iobase + REG_CAPR),
-                  inw(data->iobase + REG_CBR));
+  serial_printf("[rtl8139] rx capr: %#x: cbr: %#x\n",
+                inw(data->iobase + REG_CAPR),
+                inw(data->iobase + REG_CBR));
 #endif
-    while (!(inb(data->iobase + REG_CMD) & CMD_BUFE)) {
-      uint16_t intr = inw(data->iobase + REG_INT_STATUS);
+  while (!(inb(data->iobase + REG_CMD) & CMD_BUFE)) {
+    uint16_t intr = inw(data->iobase + REG_INT_STATUS);
 #if DEBUG_LOCAL
-      serial_printf("[rtl8139] tasklet intr: %#x\n", intr);
+    serial_printf("[rtl8139] rx intr: %#x\n", intr);
 #endif
 
-      packet_t *packet = (packet_t *)data->rx;
+    packet_t *packet = (packet_t *)data->rx;
 
-      uint16_t cbr = inw(data->iobase + REG_CBR);
-      uint16_t capr = inw(data->iobase + REG_CAPR);
+    uint16_t cbr = inw(data->iobase + REG_CBR);
+    uint16_t capr = inw(data->iobase + REG_CAPR);
 
 #if DEBUG_LOCAL
-      serial_printf("[rtl8139] rx info: %#x length: %#x\n",
-                    packet->info, packet->length);
-      for (int i = 0; i < packet->length; i++) {
-        serial_printf("%02x ", packet->payload[i]);
-      }
-      serial_printf("\n");
+    serial_printf("[rtl8139] rx info: %#x length: %#x\n",
+                  packet->info, packet->length);
+    for (int i = 0; i < packet->length; i++) {
+      serial_printf("%02x ", packet->payload[i]);
+    }
+    serial_printf("\n");
 #endif
 
-      if (data->on_packet) {
-        data->on_packet(data->on_packet_data, &rtl8139_nic, packet->payload, packet->length);
-      }
-
-      /* advance rx pointer and align */
-      assert(ALIGNED_BITS((size_t) data->rx, 2));
-      data->rx += ALIGN_UP_BITS(packet->length + 4, 2);
-      while (data->rx > data->rxbuf + RXBUF_SIZE) {
-        data->rx -= RXBUF_SIZE;
-      }
+    if (data->on_packet) {
+      data->on_packet(data->on_packet_data, &rtl8139_nic, packet->payload, packet->length);
+    }
 
-      uint16_t offset = data->rx - data->rxbuf - 0x10;
-      outw(data->iobase + REG_CAPR, offset);
+    /* advance rx pointer and align */
+    assert(ALIGNED_BITS((size_t) data->rx, 2));
+    data->rx += ALIGN_UP_BITS(packet->length + 4, 2);
+    while (data->rx > data->rxbuf + RXBUF_SIZE) {
+      data->rx -= RXBUF_SIZE;
     }
 
-    sched_disable_preemption();
-    sched_current->state = TASK_WAITING;
-    tasklet_running = 0;
-    pic_unmask(data->irq);
-    sched_yield();
+    uint16_t offset = data->rx - data->rxbuf - 0x10;
+    outw(data->iobase + REG_CAPR, offset);
   }
+
+  pic_unmask(data->irq);
 }
 
 int rtl8139_matches(void *data, device_t *dev)
@@ -202,17 +193,13 @@ void rtl8139_irq(isr_stack_t *stack)
   uint16_t intr = inw(data->iobase + REG_INT_STATUS);
   outw(data->iobase + REG_INT_STATUS, intr);
 
-  if (!tasklet_running) {
-    tasklet.state = TASK_RUNNING;
-    list_add(&sched_runqueue, &tasklet.head);
-    tasklet_running = 1;
-  }
+  work_schedule(&rx_work);
 
   if (intr & INT_MASK_TOK)
     cleanup_transmissions(data);
 
   /* we need to mask interrupts here, because the interrupt pin
-  won't be cleared until we update CAPR; the tasklet will unmask
+  won't be cleared until we update CAPR; the rx work will unmask
   them when all the packets have been processed. */
   pic_mask(data->irq);
   pic_eoi(data->irq);
@@ -242,14 +229,6 @@ int rtl8139_init(void *_data, device_t *dev)
 #endif
   }
 
-  /* initialise rx tasklet */
-  isr_stack_t *stack = (void *)tasklet_stack + sizeof(tasklet_stack) - sizeof(isr_stack_t);
-  stack->eip = (uint32_t) receive;
-  stack->eflags = EFLAGS_IF;
-  stack->cs = GDT_SEL(GDT_CODE);
-  tasklet.stack = stack;
-  tasklet.state = TASK_WAITING;
-
   /* set bus master bit in PCI configuration */
   device_command_set_mask(dev, PCI_CMD_BUS_MASTER);
 
@@ -5,6 +5,8 @@
 #include "drivers/drivers.h"
 #include "drivers/realtek/common.h"
 #include "drivers/realtek/rtl8169.h"
+#include "dma_pool.h"
+#include "frames.h"
 #include "handlers.h"
 #include "memory.h"
 #include "network/types.h"
@@ -12,16 +14,21 @@
 #include "pci.h"
 #include "scheduler.h"
 #include "semaphore.h"
+#include "work.h"
 
 #include <stdint.h>
 #include <string.h>
 
 #define DEBUG_LOCAL 1
 
-#define MAX_RX_DESC 1024
-#define MAX_TX_DESC 1024
+#define NUM_RX_DESC 256
+#define NUM_TX_DESC 256
 #define RX_BUFSIZE ETH_MTU
 #define TX_BUFSIZE ETH_MTU
+#define RING_ALIGN 256
+#define RX_BUF_ALIGN 256
+/* receive buffers allocated at once */
+#define RX_ALLOC_BATCH 32
 
 typedef struct descriptor {
   uint32_t flags;
@@ -57,6 +64,9 @@ typedef struct rtl8169 {
   descriptor_t *tx_desc;
   int tx_num_desc;
 
+  /* DMA memory for receive buffers */
+  dma_pool_t *rx_pool;
+
   /* receive callback */
   nic_on_packet_t on_packet;
   void *on_packet_data;
@@ -74,51 +84,40 @@ enum {
   LOCK_CONFIG_WRITE = 3 << 6,
 };
 
-static uint32_t tasklet_stack[512];
-static task_t tasklet = {
-  .state = TASK_STOPPED,
-};
-static int tasklet_running = 0;
+static void rtl8169_receive(void *data);
+static work_t rx_work = WORK_INIT(rtl8169_receive, &rtl8169_instance);
 
 int rtl8169_matches(void *data, device_t *dev)
 {
   return dev->id == 0x816810ec;
 }
 
-static void rtl8169_receive(void)
+static void rtl8169_receive(void *data)
 {
-  rtl8169_t *rtl = &rtl8169_instance;
+  rtl8169_t *rtl = data;
 
-  while (1) {
-    for (int i = 0; i < rtl->rx_num_desc; i++) {
-      descriptor_t *desc = &rtl->rx_desc[i];
-      if (!(desc->flags & DESC_OWN)) {
-        if (!(desc->flags & DESC_LS) ||
-            !(desc->flags & DESC_LS)) {
+  for (int i = 0; i < rtl->rx_num_desc; i++) {
+    descriptor_t *desc = &rtl->rx_desc[i];
+    if (!(desc->flags & DESC_OWN)) {
+      if (!(desc->flags & DESC_LS) ||
+          !(desc->flags & DESC_LS)) {
 #if DEBUG_LOCAL
-          int col = serial_set_colour(SERIAL_COLOUR_WARN);
-          serial_printf("[rtl8169] ignoring partial packet\n");
-          serial_set_colour(col);
+        int col = serial_set_colour(SERIAL_COLOUR_WARN);
+        serial_printf("[rtl8169] ignoring partial packet\n");
+        serial_set_colour(col);
 #endif
-          continue;
-        }
-        if (rtl->on_packet) {
-          uint8_t *buf = descriptor_buffer(desc);
-          rtl->on_packet(rtl->on_packet_data,
-                         &rtl8169_nic,
-                         buf,
-                         descriptor_length(desc));
-        }
-
-        desc->flags |= DESC_OWN;
+        continue;
+      }
+      if (rtl->on_packet) {
+        uint8_t *buf = descriptor_buffer(desc);
+        rtl->on_packet(rtl->on_packet_data,
+                       &rtl8169_nic,
+                       buf,
+                       descriptor_length(desc));
       }
-    }
 
-    sched_disable_preemption();
-    sched_current->state = TASK_WAITING;
-    tasklet_running = 0;
-    pic_unmask(rtl->irq);
-    sched_yield();
+      desc->flags |= DESC_OWN;
+    }
   }
 }
 
@@ -126,16 +125,12 @@ void rtl8169_irq(isr_stack_t *stack)
 {
   rtl8169_t *rtl = &rtl8169_instance;
   uint16_t status = inw(rtl->iobase + REG_INT_STATUS);
-  serial_printf("[rtl8169] irq fired status: %#02x\n", status);
   outw(rtl->iobase + REG_INT_STATUS, status); /* ack */
 
-  if (!tasklet_running) {
-    tasklet.state = TASK_RUNNING;
-    list_add(&sched_runqueue, &tasklet.head);
-    tasklet_running = 1;
-  }
+  /* acknowledging the status releases the interrupt line, so the line
+     does not need masking while the descriptors are scanned */
+  work_schedule(&rx_work);
 
-  pic_mask(rtl->irq);
   pic_eoi(rtl->irq);
 }
 HANDLER_STATIC(rtl8169_irq_handler, rtl8169_irq);
@@ -169,23 +164,35 @@ static void rtl8169_setup_tx(rtl8169_t *rtl)
 
   /* set descriptor */
   uint64_t descp = (size_t) rtl->tx_desc;
-  assert((descp & 0xff) == 0);
+  assert((descp & (RING_ALIGN - 1)) == 0);
 
   outl(rtl->iobase + REG_TX_DESC_HI, descp >> 32);
   outl(rtl->iobase + REG_TX_DESC_LO, descp);
 }
 
-static void rtl8169_setup_rx(rtl8169_t *rtl)
+static int rtl8169_setup_rx(rtl8169_t *rtl)
 {
-  /* prepare descriptors */
-  for (int i = 0; i < rtl->rx_num_desc; i++) {
-    descriptor_t *desc = &rtl->rx_desc[i];
-    desc->flags = DESC_OWN | (RX_BUFSIZE & 0x3fff);
-    desc->vlan_tag = 0;
+  /* allocate receive buffers a batch at a time, and prepare
+     descriptors */
+  void *bufs[RX_ALLOC_BATCH];
+  for (int i = 0; i < rtl->rx_num_desc; i += RX_ALLOC_BATCH) {
+    int n = rtl->rx_num_desc - i;
+    if (n > RX_ALLOC_BATCH) n = RX_ALLOC_BATCH;
+    if (dma_pool_alloc_bulk(rtl->rx_pool, n, bufs) == -1) {
+      /* release the buffers of the previous batches */
+      while (i-- > 0)
+        dma_pool_free(rtl->rx_pool, descriptor_buffer(&rtl->rx_desc[i]));
+      return -1;
+    }
+
+    for (int j = 0; j < n; j++) {
+      descriptor_t *desc = &rtl->rx_desc[i + j];
+      desc->flags = DESC_OWN | (RX_BUFSIZE & 0x3fff);
+      desc->vlan_tag = 0;
 
-    void *buf = falloc(RX_BUFSIZE);
-    assert(((size_t) buf & 0x7) == 0);
-    desc->buffer = (size_t) buf;
+      assert(((size_t) bufs[j] & 0x7) == 0);
+      desc->buffer = (size_t) bufs[j];
+    }
   }
   if (rtl->rx_num_desc > 0)
     rtl->rx_desc[rtl->rx_num_desc - 1].flags |= DESC_EOR;
@@ -212,9 +219,20 @@ static void rtl8169_setup_rx(rtl8169_t *rtl)
 
   /* set descriptor */
   uint64_t descp = (size_t) rtl->rx_desc;
-  assert((descp & 0xff) == 0);
+  assert((descp & (RING_ALIGN - 1)) == 0);
   outl(rtl->iobase + REG_RX_DESC_HI, descp >> 32);
   outl(rtl->iobase + REG_RX_DESC_LO, descp);
+
+  return 0;
+}
+
+/* release the descriptor rings after a failed initialisation */
+static void rtl8169_free_rings(rtl8169_t *rtl)
+{
+  if (rtl->rx_desc) frames_free(&dma_frames, (size_t) rtl->rx_desc);
+  if (rtl->tx_desc) frames_free(&dma_frames, (size_t) rtl->tx_desc);
+  rtl->rx_desc = 0;
+  rtl->tx_desc = 0;
 }
 
 int rtl8169_init(void *data, device_t *dev)
@@ -223,13 +241,38 @@ int rtl8169_init(void *data, device_t *dev)
 
   rtl->iobase = rtl_find_iobase(dev);
   rtl->irq = dev->irq & 0xff;
-  rtl->rx_desc = falloc(MAX_RX_DESC * sizeof(descriptor_t));
-  rtl->rx_num_desc = 256;
-  rtl->tx_desc = falloc(MAX_TX_DESC * sizeof(descriptor_t));
-  rtl->tx_num_desc = 256;
+
+  if (!rtl->iobase) {
+    int col = serial_set_colour(SERIAL_COLOUR_ERR);
+    serial_printf("[rtl8169] could not find IO base address for device\n");
+    serial_set_colour(col);
+    return -1;
+  }
+
+  /* receive buffers are carved from shared frames; the pool cannot be
+     destroyed, so it is kept if initialisation fails */
+  if (!rtl->rx_pool)
+    rtl->rx_pool = dma_pool_create("rtl8169 rx", &kernel_frames,
+                                   RX_BUFSIZE, RX_BUF_ALIGN);
+
+  /* descriptor rings take whole frames, which are aligned enough */
+  rtl->rx_desc = (descriptor_t *) (size_t)
+    frames_alloc(&dma_frames, NUM_RX_DESC * sizeof(descriptor_t));
+  rtl->rx_num_desc = NUM_RX_DESC;
+  rtl->tx_desc = (descriptor_t *) (size_t)
+    frames_alloc(&dma_frames, NUM_TX_DESC * sizeof(descriptor_t));
+  rtl->tx_num_desc = NUM_TX_DESC;
   rtl->on_packet = 0;
   rtl->on_packet_data = 0;
 
+  if (!rtl->rx_pool || !rtl->rx_desc || !rtl->tx_desc) {
+    int col = serial_set_colour(SERIAL_COLOUR_ERR);
+    serial_printf("[rtl8169] could not allocate DMA memory\n");
+    serial_set_colour(col);
+    rtl8169_free_rings(rtl);
+    return -1;
+  }
+
   rtl->tx_index = 0;
   sem_init(&rtl->tx_sem, rtl->tx_num_desc);
   sem_init(&rtl->tx_index_mutex, 1);
@@ -239,29 +282,14 @@ int rtl8169_init(void *data, device_t *dev)
 #endif
 
   /* register irq */
-  int ret = irq_grab(rtl->irq, &rtl8169_irq_handler);
-  if (ret == -1) {
-#if DEBUG_LOCAL
+  if (irq_grab(rtl->irq, &rtl8169_irq_handler) == -1) {
+    int col = serial_set_colour(SERIAL_COLOUR_ERR);
     serial_printf("[rtl8169] could not register irq handler\n");
-#endif
-  }
-
-  if (!rtl->iobase) {
-#if DEBUG_LOCAL
-    serial_printf("[rtl8169] FATAL: could not find IO base address for device\n");
+    serial_set_colour(col);
+    rtl8169_free_rings(rtl);
     return -1;
-#endif
   }
 
-  /* prepare tasklet */
-  isr_stack_t *stack = (void *)tasklet_stack +
-    sizeof(tasklet_stack) - sizeof(isr_stack_t);
-  stack->eip = (uint32_t) rtl8169_receive;
-  stack->eflags = EFLAGS_IF;
-  stack->cs = GDT_SEL(GDT_CODE);
-  tasklet.stack = stack;
-  tasklet.state = TASK_WAITING;
-
   /* reset */
   outb(rtl->iobase + REG_CMD, CMD_RST);
   while (inb(rtl->iobase + REG_CMD) & CMD_RST);
@@ -271,7 +299,14 @@ int rtl8169_init(void *data, device_t *dev)
   outw(rtl->iobase + REG_CMD_PLUS,
        inw(rtl->iobase + REG_CMD_PLUS));
 
-  rtl8169_setup_rx(rtl);
+  if (rtl8169_setup_rx(rtl) == -1) {
+    int col = serial_set_colour(SERIAL_COLOUR_ERR);
+    serial_printf("[rtl8169] could not allocate receive buffers\n");
+    serial_set_colour(col);
+    irq_ungrab(rtl->irq);
+    rtl8169_free_rings(rtl);
+    return -1;
+  }
   rtl8169_setup_tx(rtl);
 
   /* mask interrupts and ack */
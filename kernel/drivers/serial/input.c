@@ -7,10 +7,13 @@
 #include "drivers/serial/input.h"
 #include "drivers/keyboard/keyboard.h"
 #include "handlers.h"
+#include "ring.h"
 #include "scheduler.h"
 #include "timer.h"
+#include "work.h"
 
 #define SERIAL_IRQ 0x4
+#define SERIAL_BUFFER_SIZE 256
 
 kb_event_t event = {
   .pressed = 1,
@@ -21,21 +24,24 @@ kb_event_t event = {
   .timestamp = 0
 };
 
-static uint32_t tasklet_stack[512];
-static task_t tasklet = {
-  .state = TASK_STOPPED,
-};
-static int tasklet_running = 0;
+/* characters read by the interrupt handler */
+static char serial_buffer[SERIAL_BUFFER_SIZE];
+static ring_t serial_chars = RING_INIT(SERIAL_BUFFER_SIZE);
+
+static void serial_receive(void *data);
+static work_t serial_work = WORK_INIT(serial_receive, 0);
 
 static void serial_irq(struct isr_stack *stack)
 {
-  if (!tasklet_running) {
-    tasklet.state = TASK_RUNNING;
-    list_add(&sched_runqueue, &tasklet.head);
-    tasklet_running = 1;
+  /* reading the receive register clears the interrupt, characters
+     that do not fit in the buffer are lost */
+  while ((inb(COM1_PORT + SERIAL_LINE_STATUS) &
+          SERIAL_STATUS_DATA_READY) != 0) {
+    char c = inb(COM1_PORT + SERIAL_RECEIVE_REGISTER);
+    RING_PUSH(&serial_chars, serial_buffer, c);
   }
+  work_schedule(&serial_work);
 
-  pic_mask(SERIAL_IRQ);
   pic_eoi(SERIAL_IRQ);
 }
 HANDLER_STATIC(serial_irq_handler, serial_irq);
@@ -60,23 +66,14 @@ static void event_init(kb_event_t *event, char c)
   event->timestamp = timer_get_tick();
 }
 
-static void serial_receive(void)
+static void serial_receive(void *data)
 {
-  while (1) {
-    while ((inb(COM1_PORT + SERIAL_LINE_STATUS) &
-            SERIAL_STATUS_DATA_READY) != 0) {
-      char c = inb(COM1_PORT + SERIAL_RECEIVE_REGISTER);
-      serial_printf("[serial input] %02x\n", c);
+  char c;
+  while (RING_POP(&serial_chars, serial_buffer, &c)) {
+    serial_printf("[serial input] %02x\n", c);
 
-      event_init(&event, c);
-      kb_emit(&event);
-    }
-
-    sched_disable_preemption();
-    sched_current->state = TASK_WAITING;
-    tasklet_running = 0;
-    pic_unmask(SERIAL_IRQ);
-    sched_yield();
+    event_init(&event, c);
+    kb_emit(&event);
   }
 }
 
@@ -84,13 +81,4 @@ void serial_input_init(void)
 {
   outb(COM1_PORT + SERIAL_INTERRUPT_ENABLE, 1);
   irq_grab(SERIAL_IRQ, &serial_irq_handler);
-
-  /* init tasklet */
-  isr_stack_t *stack = (void *)tasklet_stack +
-    sizeof(tasklet_stack) - sizeof(isr_stack_t);
-  stack->eip = (uint32_t) serial_receive;
-  stack->eflags = EFLAGS_IF;
-  stack->cs = GDT_SEL(GDT_CODE);
-  tasklet.stack = stack;
-  tasklet.state = TASK_WAITING;
 }
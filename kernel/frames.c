@@ -36,6 +36,10 @@
 # define TRACE(...) do {} while(0)
 #endif
 
+/* out-of-band links can use at most 1/2^FRAMES_LINKS_BUDGET_SHIFT of
+   the available memory of the auxiliary allocator */
+#define FRAMES_LINKS_BUDGET_SHIFT 2
+
 #if FRAMES_DEBUG
 #define DIAGNOSTICS(frames) \
   TRACE("----\n"); \
@@ -135,12 +139,13 @@ There are essentially two operations in the system: allocation and
 deallocation. Allocation creates a new allocated block of the given
 order, while deallocation destroys it.
 
-Allocation works quite simply: we first check the linked list of the
-given order to see whether it contains an available block; if so, we
-turn it into an allocated block and return it. Otherwise, we
-recursively allocate a block of larger order, make half available and
-the other allocated, and return the allocated one. In either case, we
-set the metadata bit of the returned block.
+Allocation works quite simply: we find the smallest order, not less
+than the requested one, whose linked list contains an available
+block. A bitmap of non-empty lists makes this a single bit scan. The
+block is then repeatedly split in half, making the second half
+available, until it reaches the requested order. We set the metadata
+bit of the returned block, as well as those of all the blocks it was
+split from.
 
 Deallocation is more complicated. First, it needs to determine the
 order of the block being deallocated, given just its offset. Every
@@ -196,8 +201,41 @@ static inline uint64_t *block_head(frames_t *frames, unsigned int order)
   return &frames->free[order - frames->min_order];
 }
 
-static inline void list_add(uint64_t *list, block_t *block)
+/* Out-of-band links: entry i describes the block starting at the i-th
+   block of minimum order. Links are stored as entry numbers plus one,
+   so that 0 can be used as the end of a list. */
+static inline uint32_t link_number(frames_t *frames, uint64_t p)
+{
+  return ((p - frames->start) >> frames->min_order) + 1;
+}
+
+static inline uint64_t link_block(frames_t *frames, uint32_t n)
 {
+  if (!n) return 0;
+  return frames->start + ((uint64_t) (n - 1) << frames->min_order);
+}
+
+static inline frames_link_t *block_link(frames_t *frames, uint64_t p)
+{
+  return &frames->links[link_number(frames, p) - 1];
+}
+
+static inline void list_add(frames_t *frames, uint64_t *list, uint64_t p)
+{
+  if (frames->links) {
+    frames_link_t *link = block_link(frames, p);
+    link->prev = 0;
+    link->next = 0;
+    if (*list) {
+      link->next = link_number(frames, *list);
+      block_link(frames, *list)->prev = link_number(frames, p);
+    }
+    *list = p;
+    return;
+  }
+
+  block_t *block = map_block(p);
+  block->current = p;
   block->prev = 0;
   block->next = 0;
 
@@ -210,12 +248,24 @@ static inline void list_add(uint64_t *list, block_t *block)
   }
 
   *list = block->current;
+  unmap_block(block);
 }
 
-static inline void list_remove(uint64_t *list, block_t *block)
+static inline void list_remove(frames_t *frames, uint64_t *list, uint64_t p)
 {
+  if (frames->links) {
+    frames_link_t *link = block_link(frames, p);
+    if (link->next) frames->links[link->next - 1].prev = link->prev;
+    if (link->prev) frames->links[link->prev - 1].next = link->next;
+    else *list = link_block(frames, link->next);
+    return;
+  }
+
+  block_t *block = map_block(p);
+  assert(block->current == p);
   uint64_t prev = block->prev;
   uint64_t next = block->next;
+  unmap_block(block);
 
   block_t *nextb = map_block(next);
   block_t *prevb = map_block(prev);
@@ -228,24 +278,66 @@ static inline void list_remove(uint64_t *list, block_t *block)
   unmap_block(prevb);
 }
 
-static inline uint64_t list_take(uint64_t *list)
+static inline uint64_t list_take(frames_t *frames, uint64_t *list)
 {
-  if (*list) {
-    uint64_t ret = *list;
-    block_t *block = map_block(ret);
-    assert(block->current == ret);
-    if (block->next) {
-      block_t *next = map_block(block->next);
-      assert(next->current == block->next);
-      next->prev = 0;
-      unmap_block(next);
-    }
-    *list = block->next;
-    unmap_block(block);
-    return ret;
-  }
+  uint64_t ret = *list;
+  if (ret) list_remove(frames, list, ret);
+  return ret;
+}
 
-  return 0;
+/* return the block following p in its list */
+static inline uint64_t list_next(frames_t *frames, uint64_t p)
+{
+  if (frames->links)
+    return link_block(frames, block_link(frames, p)->next);
+
+  block_t *block = map_block(p);
+  assert(block->current == p);
+  uint64_t next = block->next;
+  unmap_block(block);
+  return next;
+}
+
+/* count trailing zeros of a non-zero 64-bit word, without relying on
+   libgcc on 32-bit targets */
+static inline unsigned int ctz64(uint64_t x)
+{
+  uint32_t lo = (uint32_t) x;
+  if (lo) return __builtin_ctz(lo);
+  return 32 + __builtin_ctz((uint32_t) (x >> 32));
+}
+
+/* operations on the list of available blocks of a given order, keeping
+   the bitmap of non-empty orders up to date */
+static inline void free_list_add(frames_t *frames, unsigned int order,
+                                 uint64_t p)
+{
+  list_add(frames, block_head(frames, order), p);
+  frames->free_orders |= 1ULL << (order - frames->min_order);
+  frames->stats.free_blocks[order - frames->min_order]++;
+  frames->stats.free_bytes += 1ULL << order;
+}
+
+static inline void free_list_remove(frames_t *frames, unsigned int order,
+                                    uint64_t p)
+{
+  uint64_t *head = block_head(frames, order);
+  list_remove(frames, head, p);
+  if (!*head) frames->free_orders &= ~(1ULL << (order - frames->min_order));
+  frames->stats.free_blocks[order - frames->min_order]--;
+  frames->stats.free_bytes -= 1ULL << order;
+}
+
+static inline uint64_t free_list_take(frames_t *frames, unsigned int order)
+{
+  uint64_t *head = block_head(frames, order);
+  uint64_t frame = list_take(frames, head);
+  if (!*head) frames->free_orders &= ~(1ULL << (order - frames->min_order));
+  if (frame) {
+    frames->stats.free_blocks[order - frames->min_order]--;
+    frames->stats.free_bytes -= 1ULL << order;
+  }
+  return frame;
 }
 
 static void frames_lock(frames_t *frames)
@@ -269,11 +361,8 @@ static void add_blocks(unsigned int order, uint64_t start, frames_t *frames,
 
   /* if the block is usable, just add it to the list */
   if (info == MEM_INFO_USABLE) {
-    block_t *block = map_block(start);
-    block->current = start;
     TRACE("adding block %#" PRIx64 " order %u\n", start, order);
-    list_add(block_head(frames, order), block);
-    unmap_block(block);
+    free_list_add(frames, order, start);
     return;
   }
 
@@ -315,24 +404,27 @@ uint64_t take_block(frames_t *frames, unsigned int order)
   if (order > frames->max_order) return 0;
   if (order <= frames->min_order) order = frames->min_order;
 
-  uint64_t *head = block_head(frames, order);
-  /* if there is an available block of the correct order, take it */
-  uint64_t frame = list_take(head);
-  if (!frame) {
-    /* otherwise, split the next one up */
-    uint64_t frame1 = take_block(frames, order + 1);
-    if (!frame1) return 0;
-    uint64_t frame2 = frame1 + (1ULL << order);
-    block_t *block2 = map_block(frame2);
-    block2->current = frame2;
+  /* find the smallest non-empty list of at least the given order */
+  uint64_t mask = frames->free_orders & ~((1ULL << (order - frames->min_order)) - 1);
+  if (!mask) return 0;
+  unsigned int k = frames->min_order + ctz64(mask);
+
+  uint64_t frame = free_list_take(frames, k);
+  assert(frame >= frames->start && frame < frames->end);
+
+  /* split it down to the requested order, making the upper halves
+     available */
+  for (; k > order; k--) {
+    if (frames->metadata && k < frames->max_order) {
+      SET_BIT(frames->metadata, frames_block_index(frames, frame, k));
+    }
+
+    uint64_t frame2 = frame + (1ULL << (k - 1));
     TRACE("  adding split block %" PRIx64 " order %u\n",
-          frame2, order);
-    list_add(head, block2);
-    unmap_block(block2);
-    frame = frame1;
+          frame2, k - 1);
+    free_list_add(frames, k - 1, frame2);
   }
 
-  assert(frame >= frames->start && frame < frames->end);
   if (frames->metadata && order < frames->max_order) {
     TRACE("set bit order %u index 0x%x\n", order,
            frames_block_index(frames, frame, order));
@@ -348,6 +440,13 @@ uint64_t take_block(frames_t *frames, unsigned int order)
   mem_info, data - closure that returns whether a fragment of the
     memory chunk is available for use
 
+  If FRAMES_OUT_OF_BAND is passed in flags, the links of the lists of
+  available blocks are kept in an array allocated from aux_frames,
+  instead of in the blocks themselves. This means that blocks outside
+  of the identity mapped memory do not need to be temporarily mapped
+  when they are added to or removed from a list. If the array cannot
+  be allocated, the allocator falls back to intrusive links.
+
   First, the available blocks are constructed and added to the lists
   using recursive invocations of mem_info.
 
@@ -361,6 +460,36 @@ int frames_init(frames_t *frames, frames_t *aux_frames,
                 unsigned int min_order,
                 int (*mem_info)(uint64_t start, uint64_t size, void *data),
                 void *data)
+{
+  return frames_init_flags(frames, aux_frames, start, end, min_order, 0,
+                           mem_info, data);
+}
+
+/* allocate out-of-band links from the auxiliary allocator, unless they
+   would take too large a fraction of it */
+static void frames_init_links(frames_t *frames, frames_t *aux_frames)
+{
+  uint64_t count = ((frames->end - frames->start - 1) >> frames->min_order) + 1;
+  if (count >= 0xffffffffULL) return;
+  uint64_t size = count * sizeof(frames_link_t);
+  if (size > frames_available_memory(aux_frames) >> FRAMES_LINKS_BUDGET_SHIFT) {
+    TRACE("not enough memory for %" PRIu64 " out-of-band links\n", count);
+    return;
+  }
+
+  uint64_t links = frames_alloc(aux_frames, size);
+  if (!links) return;
+#if _HELIUM
+  assert(links < KERNEL_MEMORY_END);
+#endif
+  frames->links = (frames_link_t *) (size_t) links;
+}
+
+int frames_init_flags(frames_t *frames, frames_t *aux_frames,
+                      uint64_t start, uint64_t end,
+                      unsigned int min_order, unsigned int flags,
+                      int (*mem_info)(uint64_t start, uint64_t size, void *data),
+                      void *data)
 {
   if (min_order < ORDER_OF(sizeof(block_t))) {
     FRAMES_PANIC(-1, "min_order must be at least %u\n", ORDER_OF(sizeof(block_t)));
@@ -378,6 +507,14 @@ int frames_init(frames_t *frames, frames_t *aux_frames,
   for (unsigned int k = frames->min_order; k <= frames->max_order; k++) {
     *block_head(frames, k) = 0;
   }
+  frames->free_orders = 0;
+  memset(&frames->stats, 0, sizeof(frames->stats));
+
+  /* out-of-band links need to be in place before any block is added */
+  frames->links = 0;
+  if ((flags & FRAMES_OUT_OF_BAND) && aux_frames) {
+    frames_init_links(frames, aux_frames);
+  }
 
   /* add all blocks */
   add_blocks(frames->max_order, start, frames, mem_info, data);
@@ -418,7 +555,7 @@ int frames_init(frames_t *frames, frames_t *aux_frames,
     TRACE("replaying metadata for %p order %u\n",
           frames->metadata, meta_order);
     int index = frames_block_index(frames, metadata_frame, meta_order);
-    while (index > 0) {
+    while (index >= 0) {
       TRACE("setting bit for index %d\n", index);
       SET_BIT(frames->metadata, index);
       index = (index >> 1) - 1;
@@ -431,19 +568,7 @@ int frames_init(frames_t *frames, frames_t *aux_frames,
 
 uint64_t frames_available_memory(frames_t *frames)
 {
-  uint64_t total = 0;
-  for (unsigned int k = frames->min_order; k <= frames->max_order; k++) {
-    uint64_t size = 1ULL << k;
-    uint64_t frame = *block_head(frames, k);
-    while (frame) {
-      total += size;
-      block_t *block = map_block(frame);
-      assert(block->current == frame);
-      frame = block->next;
-      unmap_block(block);
-    }
-  }
-  return total;
+  return frames->stats.free_bytes;
 }
 
 uint64_t frames_alloc(frames_t *frames, size_t sz)
@@ -453,6 +578,10 @@ uint64_t frames_alloc(frames_t *frames, size_t sz)
 
   frames_lock(frames);
   uint64_t ret = take_block(frames, order);
+  if (ret)
+    frames->stats.allocs++;
+  else
+    frames->stats.failed++;
   frames_unlock(frames);
 
   TRACE("allocated %#" PRIx64 " size 0x%lx (order %u)\n", ret, sz, order);
@@ -460,6 +589,22 @@ uint64_t frames_alloc(frames_t *frames, size_t sz)
   return ret;
 }
 
+void frames_get_stats(frames_t *frames, frames_stats_t *stats)
+{
+  frames_lock(frames);
+  *stats = frames->stats;
+  frames_unlock(frames);
+
+  stats->largest_free = 0;
+  if (stats->free_bytes) {
+    unsigned int k = 0;
+    for (unsigned int i = 0; i <= frames->max_order - frames->min_order; i++) {
+      if (stats->free_blocks[i]) k = i;
+    }
+    stats->largest_free = 1ULL << (frames->min_order + k);
+  }
+}
+
 void frames_dump_diagnostics(frames_t *frames)
 {
   frames_lock(frames);
@@ -469,11 +614,7 @@ void frames_dump_diagnostics(frames_t *frames)
     if (nonempty) kprintf("order %d: ", k);
     while (frame) {
       kprintf("%#" PRIx64 " ", frame);
-
-      block_t *block = map_block(frame);
-      assert(block->current == frame);
-      frame = block->next;
-      unmap_block(block);
+      frame = list_next(frames, frame);
     }
     if (nonempty) kprintf("\n");
   }
@@ -486,47 +627,32 @@ void frames_dump_diagnostics(frames_t *frames)
 
 void frames_free_order(frames_t *frames, uint64_t p, unsigned int order)
 {
-  block_t *block = map_block(p);
-  block->current = p;
-
-  /* find buddy */
-  block_t *buddy = 0;
-  if (order < frames->max_order) {
-    int index = frames_block_index(frames, block->current, order);
+  /* merge with the buddy as long as it is available */
+  for (; order < frames->max_order; order++) {
+    int index = frames_block_index(frames, p, order);
     UNSET_BIT(frames->metadata, index);
-    TRACE("checking buddy for 0x%lx order %d index 0x%x\n",
+    TRACE("checking buddy for 0x%" PRIx64 " order %d index 0x%x\n",
            p, order, index);
-    if (!GET_BIT(frames->metadata, index ^ 1)) {
-      uint64_t buddy_addr = frames_index_block(frames, index ^ 1, order);
-      TRACE("  buddy_addr = %#" PRIx64 "\n", buddy_addr);
-      buddy = map_block(buddy_addr);
-      TRACE("  buddy current = %#" PRIx64 "\n", buddy->current);
-    }
-  }
+    if (GET_BIT(frames->metadata, index ^ 1)) break;
 
-  /* merge */
-  if (buddy) {
-    TRACE("  buddy found: %#" PRIx64 "\n", buddy->current);
-    list_remove(block_head(frames, order), buddy);
-    if (buddy->current < block->current) block = buddy;
-    frames_free_order(frames, block->current, order + 1);
-
-    unmap_block(buddy);
-    unmap_block(block);
-    return;
-  }
-  else {
-    list_add(block_head(frames, order), block);
-    unmap_block(block);
+    uint64_t buddy = frames_index_block(frames, index ^ 1, order);
+    TRACE("  buddy found: %#" PRIx64 "\n", buddy);
+    free_list_remove(frames, order, buddy);
+    if (buddy < p) p = buddy;
   }
 
+  free_list_add(frames, order, p);
+
   TRACE("freed 0x%" PRIx64 " of order %d\n", p, order);
   DIAGNOSTICS(frames);
 }
 
 unsigned int frames_find_order(frames_t *frames, uint64_t p)
 {
-  unsigned int order = __builtin_ctzl(p - frames->start);
+  /* the block at the start can have any order */
+  uint64_t offset = p - frames->start;
+  unsigned int order = offset ? ctz64(offset) : frames->max_order;
+  if (order > frames->max_order) order = frames->max_order;
   TRACE("maximum order for %#" PRIx64 ": %u\n", p, order);
 
   for (unsigned int k = order - 1; k >= frames->min_order; k--) {
@@ -535,7 +661,10 @@ unsigned int frames_find_order(frames_t *frames, uint64_t p)
   }
   TRACE("  ---\n");
 
-  unsigned int index = frames_block_index(frames, p, order);
+  /* the top block has no index, but the formula for the first child
+     still works if we pretend it is -1 */
+  unsigned int index = order < frames->max_order ?
+    frames_block_index(frames, p, order) : (unsigned int) -1;
   for (; order > frames->min_order; order--) {
     index = (index << 1) + 2; /* first child */
     TRACE("  bit order %u index 0x%x: %s\n",
@@ -551,6 +680,73 @@ void frames_free(frames_t *frames, uint64_t p)
 {
   frames_lock(frames);
   frames_free_order(frames, p, frames_find_order(frames, p));
+  frames->stats.frees++;
+  frames_unlock(frames);
+}
+
+/* Take a block of order order + bits, and split it into allocated
+   blocks of the given order, setting the metadata bits of all the
+   intermediate blocks. */
+static uint64_t take_split_block(frames_t *frames, unsigned int order,
+                                 unsigned int bits)
+{
+  uint64_t frame = take_block(frames, order + bits);
+  if (!frame || !frames->metadata) return frame;
+
+  for (unsigned int k = order; k < order + bits; k++) {
+    unsigned int index = frames_block_index(frames, frame, k);
+    for (unsigned int i = 0; i < (1U << (order + bits - k)); i++)
+      SET_BIT(frames->metadata, index + i);
+  }
+  return frame;
+}
+
+/* Allocate n blocks of the given size, taking the lock only once. The
+   blocks are obtained by splitting as few larger blocks as possible.
+   Either all blocks are allocated, or none is. */
+int frames_alloc_bulk(frames_t *frames, size_t sz, unsigned int n,
+                      uint64_t *blocks)
+{
+  unsigned int order = ORDER_OF(sz);
+  if (order < frames->min_order) order = frames->min_order;
+
+  frames_lock(frames);
+  unsigned int count = 0;
+  while (count < n) {
+    /* try the largest power of two that is not more than we need */
+    unsigned int bits = 31 - __builtin_clz(n - count);
+    uint64_t frame = 0;
+    for (;;) {
+      frame = take_split_block(frames, order, bits);
+      if (frame || bits == 0) break;
+      bits--;
+    }
+    if (!frame) break;
+
+    for (unsigned int i = 0; i < (1U << bits); i++)
+      blocks[count++] = frame + ((uint64_t) i << order);
+  }
+
+  if (count < n) {
+    while (count > 0)
+      frames_free_order(frames, blocks[--count], order);
+    frames->stats.failed++;
+    frames_unlock(frames);
+    return -1;
+  }
+  frames->stats.allocs += n;
+
+  frames_unlock(frames);
+  DIAGNOSTICS(frames);
+  return 0;
+}
+
+void frames_free_bulk(frames_t *frames, uint64_t *blocks, unsigned int n)
+{
+  frames_lock(frames);
+  for (unsigned int i = 0; i < n; i++)
+    frames_free_order(frames, blocks[i], frames_find_order(frames, blocks[i]));
+  frames->stats.frees += n;
   frames_unlock(frames);
 }
 
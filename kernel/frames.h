@@ -11,13 +11,43 @@
 #define KERNEL_MEMORY_END (124 * 1024 * 1024)
 #define USER_MEMORY_START (128 * 1024 * 1024)
 
+/* flags for frames_init_flags */
+#define FRAMES_OUT_OF_BAND 1
+
+/* links of a block in a list of available blocks */
+typedef struct frames_link {
+  uint32_t next;
+  uint32_t prev;
+} frames_link_t;
+
+/* running counters, updated on every operation */
+typedef struct frames_stats {
+  /* number of available blocks of every order, starting from
+     min_order */
+  uint32_t free_blocks[MAX_ORDER];
+  uint64_t free_bytes;
+  /* size of the largest available block, only set by
+     frames_get_stats */
+  uint64_t largest_free;
+  uint32_t allocs;
+  uint32_t frees;
+  uint32_t failed;
+} frames_stats_t;
+
 typedef struct frames {
   uint64_t start;
   uint64_t end;
   uint64_t free[MAX_ORDER];
+  /* bit k is set when the list of order min_order + k is non-empty */
+  uint64_t free_orders;
   unsigned int min_order, max_order;
 
   uint32_t *metadata;
+  /* out-of-band list links, one for every block of minimum order, or
+     null if links are stored in the blocks themselves */
+  frames_link_t *links;
+
+  frames_stats_t stats;
 
   void (*lock)(struct frames *frames);
   void (*unlock)(struct frames *frames);
@@ -41,9 +71,18 @@ int frames_init(frames_t *frames, frames_t *aux_frames,
                 unsigned int min_order,
                 int (*mem_info)(uint64_t start, uint64_t size, void *data),
                 void *data);
+int frames_init_flags(frames_t *frames, frames_t *aux_frames,
+                      uint64_t start, uint64_t end,
+                      unsigned int min_order, unsigned int flags,
+                      int (*mem_info)(uint64_t start, uint64_t size, void *data),
+                      void *data);
 uint64_t frames_available_memory(frames_t *frames);
 uint64_t frames_alloc(frames_t *frames, size_t sz);
 void frames_free(frames_t *frames, uint64_t p);
+int frames_alloc_bulk(frames_t *frames, size_t sz, unsigned int n,
+                      uint64_t *blocks);
+void frames_free_bulk(frames_t *frames, uint64_t *blocks, unsigned int n);
+void frames_get_stats(frames_t *frames, frames_stats_t *stats);
 void frames_dump_diagnostics(frames_t *frames);
 
 #endif /* FRAMES_H */
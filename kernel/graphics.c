@@ -266,10 +266,13 @@ int graphics_init(vbe_mode_t *req_mode, uint16_t *debug_buf)
   /* map framebuffer into virtual memory */
   req_mode->fb_size = info_mem << 16;
 
-  /* only map one page of the framebuffer */
-  req_mode->framebuffer = paging_perm_map_pages
+  /* only the visible part of the framebuffer is mapped, with
+     write-combining so that blits are not done one uncached write at
+     a time */
+  req_mode->framebuffer = paging_perm_map_pages_flags
     ((size_t) req_mode->framebuffer,
-     req_mode->height * req_mode->pitch);
+     req_mode->height * req_mode->pitch,
+     PAGING_MAP_WC);
 
   /* save debug console */
   for (int i = 0; i < 25; i++) {
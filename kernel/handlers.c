@@ -1,4 +1,5 @@
 #include "core/debug.h"
+#include "core/gdt.h"
 #include "core/interrupts.h"
 #include "core/io.h"
 #include "core/serial.h"
@@ -7,6 +8,7 @@
 #include "handlers.h"
 #include "paging/paging.h"
 #include "scheduler.h"
+#include "stacks.h"
 
 #define DEBUG_LOCAL 1
 
@@ -69,6 +71,8 @@ int handle_irq(isr_stack_t *stack)
     item = item->next;
   } while (item != hs);
 
+  /* run tasks woken by the handlers straight away */
+  sched_preempt(stack);
   return 1;
 }
 
@@ -91,6 +95,14 @@ int __attribute__((noinline)) handle_page_fault(isr_stack_t *stack)
 {
   if (stack->int_num != IDT_PF) return 0;
 
+  /* task stacks are committed on demand */
+  if (stack_handle_fault(CR_GET(2), stack->error) == 0) {
+    /* the faulting code could have been interrupted anyway, so it is
+       safe to wake a worker */
+    if (stack->eflags & EFLAGS_IF) stacks_check_reserve();
+    return 1;
+  }
+
   int col = serial_set_colour(SERIAL_COLOUR_ERR);
   serial_printf("unhandled page fault (code: %#x)\n", stack->error);
   serial_printf("  eip: %#x flags: %#x\n", stack->eip, stack->eflags);
@@ -101,6 +113,98 @@ int __attribute__((noinline)) handle_page_fault(isr_stack_t *stack)
   return 1;
 }
 
+/* the TS flag is set by every hardware task switch */
+int handle_device_not_available(isr_stack_t *stack)
+{
+  if (stack->int_num != IDT_NM) return 0;
+  __asm__ volatile("clts");
+  return 1;
+}
+
+/* Page faults are delivered to a separate hardware task through a
+   task gate, so that they can be handled even when the faulting stack
+   has no room for an exception frame. The state of the interrupted
+   code is saved in the kernel TSS. */
+static tss_t fault_tss;
+static uint8_t fault_stack[0x1000] __attribute__((aligned(16)));
+
+void handle_fault_task(uint32_t error);
+
+__asm__
+("fault_task_entry:\n"
+ "call handle_fault_task\n"
+ "add $4, %esp\n"
+ "iret\n"
+ "jmp fault_task_entry\n");
+void fault_task_entry(void);
+
+static uint16_t pic_in_service(void)
+{
+  outb(PIC_MASTER_CMD, 0x0b);
+  outb(PIC_SLAVE_CMD, 0x0b);
+  uint16_t isr = inb(PIC_MASTER_CMD) | (inb(PIC_SLAVE_CMD) << 8);
+  outb(PIC_MASTER_CMD, 0x0a);
+  outb(PIC_SLAVE_CMD, 0x0a);
+  /* ignore the cascade line */
+  if (isr & 0xff00) isr &= ~IRQ_MASK(2);
+  return isr;
+}
+
+void handle_fault_task(uint32_t error)
+{
+  tss_t *tss = &kernel_tss.tss;
+  isr_stack_t frame = {
+    .edi = tss->edi, .esi = tss->esi, .ebp = tss->ebp, .esp_ = tss->esp,
+    .ebx = tss->ebx, .edx = tss->edx, .ecx = tss->ecx, .eax = tss->eax,
+    .int_num = IDT_PF, .error = error,
+    .eip = tss->eip, .cs = tss->cs, .eflags = tss->eflags,
+  };
+  handle_page_fault(&frame);
+
+  /* A fault while pushing the frame of an external interrupt loses
+     the interrupt, which has already been acknowledged. Handlers only
+     enable interrupts after their EOI, so an interrupt in service
+     while the faulting code had interrupts enabled must be such a
+     lost one: deliver it by hand, now that the stack is mapped. */
+  if (!(tss->eflags & EFLAGS_IF) || (tss->eflags & EFLAGS_VM)) return;
+  uint16_t isr = pic_in_service();
+  if (!isr) return;
+
+  int irq = __builtin_ctz(isr);
+  uint32_t *sp = (uint32_t *) tss->esp;
+  *--sp = tss->eflags;
+  *--sp = tss->cs;
+  *--sp = tss->eip;
+  tss->esp = (uint32_t) sp;
+  tss->eip = (uint32_t) &kernel_isr[NUM_ISR + irq];
+  tss->eflags &= ~EFLAGS_IF;
+}
+
+void handlers_init_fault_task(void)
+{
+  fault_tss.cr3 = paging_kernel_root();
+  fault_tss.eip = (uint32_t) fault_task_entry;
+  fault_tss.eflags = 0x2;
+  fault_tss.esp = (uint32_t) (fault_stack + sizeof(fault_stack));
+  fault_tss.cs = GDT_SEL(GDT_CODE);
+  fault_tss.ss = fault_tss.ds = fault_tss.es =
+    fault_tss.fs = fault_tss.gs = GDT_SEL(GDT_DATA);
+  fault_tss.iomap_base = sizeof(tss_t);
+
+  gdt_set_entry(&kernel_gdt[GDT_FAULT_TASK],
+                (uint32_t) &fault_tss,
+                sizeof(fault_tss),
+                0x89, 0);
+
+  /* task gate */
+  kernel_idt[IDT_PF] = (idt_entry_t) {
+    .offset_low = 0,
+    .segment = GDT_SEL(GDT_FAULT_TASK),
+    .flags = 0x8500,
+    .offset_high = 0,
+  };
+}
+
 void handle_interrupt(isr_stack_t *stack)
 {
   /* if (stack->int_num != IDT_IRQ) serial_printf("[handlers] interrupt %#x @ %p flags: %#x\n", stack->int_num, stack, cpu_flags()); */
@@ -108,7 +212,8 @@ void handle_interrupt(isr_stack_t *stack)
     v8086_manager(stack) ||
     handle_irq(stack) ||
     handle_syscall(stack) ||
-    handle_page_fault(stack);
+    handle_page_fault(stack) ||
+    handle_device_not_available(stack);
 
   if (!done) {
     serial_printf("Unhandled exception %#x (code: %#x)\n", stack->int_num, stack->error);
@@ -18,5 +18,7 @@ typedef struct handler {
 int irq_grab(int irq, handler_t *handler);
 int irq_ungrab(int irq);
 void handle_interrupt(struct isr_stack *stack);
+/* route page faults to a dedicated hardware task */
+void handlers_init_fault_task(void);
 
 #endif /* HANDLERS_H */
@@ -10,39 +10,177 @@
 #include <stdint.h>
 
 #define KMALLOC_DEBUG 0
-#define KMALLOC_UNIT 4
 
 #ifndef _HELIUM
 # include <stdio.h>
 # define serial_printf printf
 #endif
 
-/* simplistic allocator design, with just one list of free blocks */
+/* Segregated-fit allocator with boundary tags.
 
-struct block;
+   Memory is obtained from the frame allocator in spans. Each span is
+   divided into blocks, each starting with a header word containing
+   its size and two flags: whether the block itself is in use, and
+   whether the preceding block is. Free blocks also store their size
+   in their last word (the footer), so that the previous block can be
+   found in constant time when freeing, and adjacent free blocks are
+   always merged.
+
+   Free blocks are kept in bins by size class, where bin i contains
+   blocks of size in [2^i, 2^(i+1)). A bitmap records which bins are
+   non-empty.
+
+   Every span ends with a fencepost: a header marked as in use, which
+   stops coalescing from crossing span boundaries. The fencepost of a
+   span obtained when growing the heap records the size of the block
+   covering the whole span, so that when such a block is formed by
+   freeing, the span can be given back to the frame allocator. Free
+   spans are only released while the free memory in the heap stays
+   above a watermark, to avoid repeatedly releasing and requesting
+   spans under a fluctuating load.
+*/
+
+#define WORD sizeof(size_t)
+#define BLOCK_ALIGN (2 * WORD)
+
+#define BLOCK_INUSE 1
+#define BLOCK_PINUSE 2
+#define BLOCK_FENCE 4
+#define BLOCK_FLAGS (BLOCK_INUSE | BLOCK_PINUSE | BLOCK_FENCE)
 
 typedef struct block {
-  uint32_t size;
-  union {
-    struct {
-      struct block *next;
-      struct block *prev;
-    };
-    unsigned char memory[0];
-  };
+  size_t head;
+  /* only valid in free blocks */
+  struct block *next;
+  struct block *prev;
 } block_t;
 
-#define MIN_ALLOC_SIZE sizeof(block_t)
+#define MIN_BLOCK_SIZE ALIGN_UP(sizeof(block_t) + WORD, BLOCK_ALIGN)
+#define HEAP_NUM_BINS 32
 #define DEFAULT_PAGE_GROWTH 16
 
 struct heap {
-  /* linked list of free blocks, in increasing order
-     of address */
-  block_t *free_blocks;
   frames_t *frames;
   int page_growth;
+  /* free memory that is kept when releasing spans */
+  size_t watermark;
+
+  /* bit i is set when bins[i] is non-empty */
+  uint32_t bitmap;
+  block_t *bins[HEAP_NUM_BINS];
+
+  heap_stats_t stats;
 };
 
+static inline size_t block_size(block_t *c)
+{
+  return c->head & ~BLOCK_FLAGS;
+}
+
+static inline block_t *block_at(void *p, size_t offset)
+{
+  return p + offset;
+}
+
+static inline void block_set_footer(block_t *c, size_t size)
+{
+  *(size_t *)((void *) c + size - WORD) = size;
+}
+
+static inline unsigned size_bin(size_t size)
+{
+  unsigned bin = sizeof(unsigned long) * 8 - 1 - __builtin_clzl(size);
+  return bin < HEAP_NUM_BINS ? bin : HEAP_NUM_BINS - 1;
+}
+
+static void bin_insert(heap_t *heap, block_t *c)
+{
+  unsigned bin = size_bin(block_size(c));
+  c->prev = 0;
+  c->next = heap->bins[bin];
+  if (c->next) c->next->prev = c;
+  heap->bins[bin] = c;
+  heap->bitmap |= 1U << bin;
+}
+
+static void bin_remove(heap_t *heap, block_t *c)
+{
+  unsigned bin = size_bin(block_size(c));
+  if (c->prev)
+    c->prev->next = c->next;
+  else
+    heap->bins[bin] = c->next;
+  if (c->next) c->next->prev = c->prev;
+  if (!heap->bins[bin]) heap->bitmap &= ~(1U << bin);
+}
+
+/* find a free block of at least the given size, and remove it from
+   its bin */
+static block_t *bin_take(heap_t *heap, size_t size)
+{
+  unsigned bin = size_bin(size);
+
+  /* first fit within the size class of the request */
+  for (block_t *c = heap->bins[bin]; c; c = c->next) {
+    if (block_size(c) >= size) {
+      bin_remove(heap, c);
+      return c;
+    }
+  }
+
+  /* any block from a larger size class fits */
+  uint32_t mask = bin + 1 < HEAP_NUM_BINS ?
+    heap->bitmap & ~((2U << bin) - 1) : 0;
+  if (!mask) return 0;
+
+  block_t *c = heap->bins[__builtin_ctz(mask)];
+  bin_remove(heap, c);
+  return c;
+}
+
+/* turn a region of memory into a span containing a single free block,
+   followed by a fencepost, which is marked with the size of the block
+   if the span can be released */
+static block_t *heap_init_span(void *start, size_t size, int releasable)
+{
+  assert(size >= MIN_BLOCK_SIZE + WORD);
+  assert(((size_t) start + WORD) % BLOCK_ALIGN == 0);
+  assert((size - WORD) % BLOCK_ALIGN == 0);
+
+  block_t *c = start;
+  size_t csize = size - WORD;
+  c->head = csize | BLOCK_PINUSE;
+  block_set_footer(c, csize);
+  block_at(c, csize)->head = BLOCK_INUSE | BLOCK_FENCE |
+    (releasable ? csize : 0);
+  return c;
+}
+
+/* request a new span large enough to contain a block of the given
+   size */
+static int heap_grow(heap_t *heap, size_t size)
+{
+  int num_pages = DIV_UP(size + BLOCK_ALIGN, 1 << PAGE_BITS);
+  if (num_pages < heap->page_growth) num_pages = heap->page_growth;
+  size_t span_size = (size_t) num_pages << PAGE_BITS;
+
+  uint64_t frame = frames_alloc(heap->frames, span_size);
+#ifdef _HELIUM
+  assert(frame < KERNEL_MEMORY_END);
+#endif
+  if (!frame) return -1;
+
+#if KMALLOC_DEBUG
+  serial_printf("  got span of size %lu\n", span_size);
+#endif
+
+  /* leave the first word unused, so that block payloads are aligned */
+  void *start = (void *) (size_t) frame + WORD;
+  bin_insert(heap, heap_init_span(start, span_size - WORD, 1));
+  heap->stats.reserved += span_size;
+  return 0;
+}
+
 heap_t *heap_new(frames_t *frames)
 {
   return heap_new_with_growth(frames, DEFAULT_PAGE_GROWTH);
@@ -51,25 +189,29 @@ heap_t *heap_new(frames_t *frames)
 heap_t *heap_new_with_growth(frames_t *frames, int page_growth)
 {
   /* get a block from the frame allocator */
-  uint32_t size = page_growth << PAGE_BITS;
-  assert(size >= sizeof(heap_t));
+  size_t size = (size_t) page_growth << PAGE_BITS;
+  size_t offset = ALIGN_UP(sizeof(heap_t) + WORD, BLOCK_ALIGN) - WORD;
+  assert(size >= offset + MIN_BLOCK_SIZE + WORD);
   uint64_t frame = frames_alloc(frames, size);
 #ifdef _HELIUM
   assert(frame < KERNEL_MEMORY_END);
 #endif
   void *block = (void *) (size_t) frame;
-  assert((size_t) block % KMALLOC_UNIT == 0);
+  assert((size_t) block % BLOCK_ALIGN == 0);
   if (!block) return 0;
 
   /* reserve space for the heap data structures */
   heap_t *heap = block;
-  heap->free_blocks = (block_t *)(heap + 1);
-
-  heap->free_blocks->size = size - sizeof(heap_t);
-  heap->free_blocks->prev = 0;
-  heap->free_blocks->next = 0;
   heap->frames = frames;
   heap->page_growth = page_growth;
+  heap->watermark = size;
+  heap->bitmap = 0;
+  for (int i = 0; i < HEAP_NUM_BINS; i++)
+    heap->bins[i] = 0;
+  heap->stats = (heap_stats_t) {0};
+  heap->stats.reserved = size;
+
+  bin_insert(heap, heap_init_span(block + offset, size - offset, 0));
   return heap;
 }
 
@@ -79,76 +221,101 @@ void *heap_malloc(heap_t *heap, size_t bytes)
   serial_printf("heap_malloc(%lu) heap: %p\n", bytes, heap);
 #endif
 
-  /* only allocate multiples of KMALLOC_UNIT bytes */
-  bytes += KMALLOC_UNIT - 1;
-  bytes = bytes - (bytes % KMALLOC_UNIT);
+  /* add room for the header and round up */
+  size_t size = ALIGN_UP(bytes + WORD, BLOCK_ALIGN);
+  if (size < MIN_BLOCK_SIZE) size = MIN_BLOCK_SIZE;
 
-  if (bytes < MIN_ALLOC_SIZE) bytes = MIN_ALLOC_SIZE;
-  block_t *b = heap->free_blocks;
-  while (b) {
-    if (b->size >= bytes + sizeof(block_t) + MIN_ALLOC_SIZE) {
+  block_t *c = bin_take(heap, size);
+  if (!c) {
 #if KMALLOC_DEBUG
-      serial_printf("  splitting block of size %u\n", b->size);
+    serial_printf("  no suitable block, requesting a new span\n");
 #endif
-      /* split */
-      void *mem = b->memory;
-      block_t *b1 = mem + bytes;
-      assert((size_t) b1 % KMALLOC_UNIT == 0);
-      if (b->prev) {
-        b->prev->next = b1;
-      } else {
-        heap->free_blocks = b1;
-      }
-      b1->size = b->size - ((void*)b1 - (void*)b);
-      b1->prev = b->prev;
-      b1->next = b->next;
-      if (b1->next)
-        b1->next->prev = b1;
-      b->size = bytes;
-      return mem;
-    } else if (b->size >= bytes) {
-#if KMALLOC_DEBUG
-      serial_printf("  taking whole block of size %u\n", b->size);
-#endif
-      /* just take the whole block */
-      block_t *prev = b->prev;
-      block_t *next = b->next;
-      if (prev)
-        prev->next = b->next;
-      else
-        heap->free_blocks = b->next;
-
-      if (next)
-        next->prev = b->prev;
-      return b->memory;
+    if (heap_grow(heap, size) == -1) {
+      heap->stats.failed++;
+      return 0;
     }
-    if (!b->next) {
+    c = bin_take(heap, size);
+    assert(c);
+  }
+
+  size_t csize = block_size(c);
+  if (csize >= size + MIN_BLOCK_SIZE) {
 #if KMALLOC_DEBUG
-      serial_printf("  no more blocks, requesting a new one\n");
+    serial_printf("  splitting block of size %lu\n", csize);
 #endif
-      /* request more memory */
-      int num_pages = DIV_UP(bytes, 1 << PAGE_BITS);
-      if (num_pages < heap->page_growth) num_pages = heap->page_growth;
-      unsigned long size = num_pages << PAGE_BITS;
-      uint64_t frame = frames_alloc(heap->frames, size);
-#if _HELIUM
-      assert(frame < KERNEL_MEMORY_END);
-#endif
-      block_t *block = (void *) (size_t) frame;
-      b->next = block;
-      if (block) {
-        block->size = size;
-        block->prev = b;
-        block->next = 0;
+    /* split, the remainder goes back to the bins */
+    block_t *rest = block_at(c, size);
+    rest->head = (csize - size) | BLOCK_PINUSE;
+    block_set_footer(rest, csize - size);
+    bin_insert(heap, rest);
+    c->head = size | BLOCK_INUSE | (c->head & BLOCK_PINUSE);
+  }
+  else {
+    /* take the whole block */
+    c->head |= BLOCK_INUSE;
+    block_at(c, csize)->head |= BLOCK_PINUSE;
+  }
+
+  heap->stats.allocs++;
+  heap->stats.in_use += block_size(c);
+  return (void *) c + WORD;
+}
+
+/* Allocate n blocks of the same size, carving them out of a single
+   free block. Either all blocks are allocated, or none is. */
+int heap_malloc_bulk(heap_t *heap, size_t bytes, unsigned int n, void **ptrs)
+{
 #if KMALLOC_DEBUG
-        serial_printf("  got block of size %u\n", block->size);
+  serial_printf("heap_malloc_bulk(%lu, %u) heap: %p\n", bytes, n, heap);
 #endif
-      }
-      b = block;
-    } else {
-      b = b->next;
+
+  if (n == 0) return 0;
+
+  size_t size = ALIGN_UP(bytes + WORD, BLOCK_ALIGN);
+  if (size < MIN_BLOCK_SIZE) size = MIN_BLOCK_SIZE;
+  if (size * n / n != size) {
+    heap->stats.failed++;
+    return -1;
+  }
+  size_t total = size * n;
+
+  block_t *c = bin_take(heap, total);
+  if (!c) {
+    if (heap_grow(heap, total) == -1) {
+      heap->stats.failed++;
+      return -1;
     }
+    c = bin_take(heap, total);
+    assert(c);
+  }
+
+  size_t csize = block_size(c);
+  size_t pinuse = c->head & BLOCK_PINUSE;
+  size_t last = size;
+  if (csize >= total + MIN_BLOCK_SIZE) {
+    /* the remainder goes back to the bins */
+    block_t *rest = block_at(c, total);
+    rest->head = (csize - total) | BLOCK_PINUSE;
+    block_set_footer(rest, csize - total);
+    bin_insert(heap, rest);
   }
+  else {
+    /* the last block takes the whole remainder */
+    last += csize - total;
+    block_at(c, csize)->head |= BLOCK_PINUSE;
+  }
+
+  for (unsigned int i = 0; i < n; i++) {
+    size_t bsize = i + 1 < n ? size : last;
+    c->head = bsize | BLOCK_INUSE | pinuse;
+    ptrs[i] = (void *) c + WORD;
+    c = block_at(c, bsize);
+    pinuse = BLOCK_PINUSE;
+  }
+
+  heap->stats.allocs += n;
+  heap->stats.in_use += total + last - size;
+
   return 0;
 }
 
@@ -161,46 +328,68 @@ void heap_free(heap_t *heap, void *address)
   /* freeing a null pointer does nothing */
   if (!address) return;
 
-  block_t *block = address - sizeof(uint32_t);
-  if (block < heap->free_blocks) {
-    block->next = heap->free_blocks;
-    block->prev = 0;
-    heap->free_blocks->prev = block;
-    heap->free_blocks = block;
-    return;
+  block_t *c = address - WORD;
+  assert(c->head & BLOCK_INUSE);
+  size_t size = block_size(c);
+  heap->stats.frees++;
+  heap->stats.in_use -= size;
+
+  /* merge with the previous block */
+  if (!(c->head & BLOCK_PINUSE)) {
+    size_t prev_size = *(size_t *)((void *) c - WORD);
+    block_t *prev = (void *) c - prev_size;
+    bin_remove(heap, prev);
+    c = prev;
+    size += prev_size;
   }
-  block_t *b = heap->free_blocks;
-  while (b && b < block) {
-    block_t *next = b->next;
-    if (next >= block) {
-      b->next = block;
-      block->prev = b;
-      block->next = next;
-      if (next)
-        next->prev = block;
-      return;
-    }
-    else {
-      b = next;
-    }
+
+  /* merge with the next block */
+  block_t *next = block_at(c, size);
+  if (!(next->head & BLOCK_INUSE)) {
+    bin_remove(heap, next);
+    size += block_size(next);
+    next = block_at(c, size);
   }
-  if (b) {
-    b->next = block;
-    block->prev = b;
-    block->next = 0;
-  } else {
-    heap->free_blocks = block;
-    block->prev = 0;
-    block->next = 0;
+
+  /* release the span if it is now completely free */
+  if ((next->head & BLOCK_FENCE) && block_size(next) == size &&
+      heap->stats.reserved - heap->stats.in_use >=
+      heap->watermark + size + 2 * WORD) {
+#if KMALLOC_DEBUG
+    serial_printf("  releasing span of size %lu\n", size + 2 * WORD);
+#endif
+    heap->stats.reserved -= size + 2 * WORD;
+    frames_free(heap->frames, (size_t) c - WORD);
+    return;
   }
+
+  /* adjacent blocks are never both free, so the previous one is in
+     use */
+  c->head = size | BLOCK_PINUSE;
+  block_set_footer(c, size);
+  next->head &= ~BLOCK_PINUSE;
+  bin_insert(heap, c);
+}
+
+void heap_set_watermark(heap_t *heap, size_t watermark)
+{
+  heap->watermark = watermark;
+}
+
+void heap_get_stats(heap_t *heap, heap_stats_t *stats)
+{
+  *stats = heap->stats;
+  stats->largest_free = heap->bitmap ?
+    1UL << (31 - __builtin_clz(heap->bitmap)) : 0;
 }
 
 void heap_print_diagnostics(heap_t *heap)
 {
-  block_t *b = heap->free_blocks;
-  while (b) {
-    serial_printf("block size: %d at %p\n", b->size, b);
-    b = b->next;
+  for (int i = 0; i < HEAP_NUM_BINS; i++) {
+    for (block_t *c = heap->bins[i]; c; c = c->next) {
+      serial_printf("bin %d: block size: %lu at %p\n",
+                    i, (unsigned long) block_size(c), c);
+    }
   }
 }
 
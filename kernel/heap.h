@@ -2,15 +2,33 @@
 #define HEAP_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 struct heap;
 typedef struct heap heap_t;
 struct frames;
 
+typedef struct heap_stats {
+  uint32_t allocs;
+  uint32_t frees;
+  uint32_t failed;
+  /* bytes taken by allocated blocks, including headers */
+  size_t in_use;
+  /* bytes obtained from the frame allocator */
+  size_t reserved;
+  /* lower bound on the size of the largest free block */
+  size_t largest_free;
+} heap_stats_t;
+
 heap_t *heap_new(struct frames *frames);
 heap_t *heap_new_with_growth(struct frames *frames, int page_growth);
 void *heap_malloc(heap_t *heap, size_t bytes);
+int heap_malloc_bulk(heap_t *heap, size_t bytes, unsigned int n, void **ptrs);
 void heap_free(heap_t *heap, void *address);
+/* set the amount of free memory that the heap keeps instead of
+   returning empty spans to the frame allocator */
+void heap_set_watermark(heap_t *heap, size_t watermark);
+void heap_get_stats(heap_t *heap, heap_stats_t *stats);
 void heap_print_diagnostics(heap_t *heap);
 
 struct allocator;
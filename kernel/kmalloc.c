@@ -23,3 +23,8 @@ void kfree(void *address)
 {
   heap_free(kernel_heap, address);
 }
+
+void kmalloc_get_stats(heap_stats_t *stats)
+{
+  heap_get_stats(kernel_heap, stats);
+}
@@ -4,10 +4,12 @@
 #include <stddef.h>
 
 struct frames;
+struct heap_stats;
 
 int kmalloc_init();
 
 void *kmalloc(size_t bytes);
 void kfree(void *p);
+void kmalloc_get_stats(struct heap_stats *stats);
 
 #endif /* KMALLOC_H */
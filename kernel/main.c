@@ -1,4 +1,5 @@
 #include "atomic.h"
+#include "clock.h"
 #include "cmos.h"
 #include "console/console.h"
 #include "console/fbcon.h"
@@ -18,6 +19,7 @@
 #include "drivers/serial/input.h"
 #include "fs/ext2/ext2.h"
 #include "graphics.h"
+#include "handlers.h"
 #include "list.h"
 #include "kmalloc.h"
 #include "mbr.h"
@@ -27,9 +29,11 @@
 #include "network/tftp.h"
 #include "paging/paging.h"
 #include "pci.h"
+#include "prezero.h"
 #include "scheduler.h"
 #include "shell.h"
 #include "timer.h"
+#include "work.h"
 
 #include <stdint.h>
 #include <stddef.h>
@@ -60,9 +64,9 @@ void root_task(void)
   drivers_init();
   list_t *devices = pci_scan();
 
-  sched_spawn_task(network_init);
+  sched_spawn_task(network_init, "network", SCHED_PRIO_NORMAL);
 
-  sched_spawn_task(shell_main);
+  sched_spawn_task(shell_main, "shell", SCHED_PRIO_NORMAL);
 
   tftp_start_server(69);
 }
@@ -108,9 +112,11 @@ void kernel_start(void *multiboot, uint32_t magic)
 
   sti();
   if (timer_init() == -1) panic();
+  if (clock_init() == -1) panic();
   if (kb_init() == -1) panic();
 
   if (memory_init(multiboot) == -1) panic();
+  handlers_init_fault_task();
 
   serial_printf("entering graphic mode\n");
 
@@ -146,10 +152,12 @@ void kernel_start(void *multiboot, uint32_t magic)
   console_render_buffer();
   print_char_function = &console_debug_print_char;
   redraw_screen_function = &console_render_buffer;
+  work_start_background_tasks();
   console_start_background_task();
+  prezero_start_background_task();
   ffree(debug_buf);
 
-  sched_spawn_task(root_task);
+  sched_spawn_task(root_task, "root", SCHED_PRIO_NORMAL);
   sched_yield();
 }
 
@@ -6,6 +6,7 @@
 #include "memory.h"
 #include "multiboot.h"
 #include "paging/paging.h"
+#include "prezero.h"
 #include "scheduler.h"
 
 #include <stdint.h>
@@ -322,11 +323,12 @@ int mem_info(uint64_t start, uint64_t length, void *data)
 int chunk_info_init_frame(chunk_info_t *chunk_info,
                           frames_t *frames,
                           frames_t *aux_frames,
-                          unsigned int order)
+                          unsigned int order,
+                          unsigned int flags)
 {
-  int ret = frames_init(frames, aux_frames,
-                        chunk_info->start, chunk_info->end,
-                        order, &mem_info, chunk_info);
+  int ret = frames_init_flags(frames, aux_frames,
+                              chunk_info->start, chunk_info->end,
+                              order, flags, &mem_info, chunk_info);
   if (ret == -1) return -1;
 
   frames->lock = _lock_frames;
@@ -387,7 +389,7 @@ int memory_init(multiboot_t *multiboot)
 
     if (chunk_info_init_frame(&chunk_info,
                               &kernel_frames, 0,
-                              KERNEL_FRAMES_ORDER) == -1)
+                              KERNEL_FRAMES_ORDER, 0) == -1)
       return -1;
   }
 
@@ -417,7 +419,7 @@ int memory_init(multiboot_t *multiboot)
 
     if (chunk_info_init_frame(&chunk_info,
                               &dma_frames, &kernel_frames,
-                              DMA_FRAMES_ORDER) == -1)
+                              DMA_FRAMES_ORDER, 0) == -1)
       return -1;
   }
 
@@ -443,7 +445,8 @@ int memory_init(multiboot_t *multiboot)
 
     if (chunk_info_init_frame(&chunk_info,
                               &user_frames, &kernel_frames,
-                              USER_FRAMES_ORDER) == -1)
+                              USER_FRAMES_ORDER,
+                              FRAMES_OUT_OF_BAND) == -1)
       return -1;
   }
 
@@ -457,6 +460,18 @@ void *falloc(size_t sz)
   return (void *) (size_t) frame;
 }
 
+void *falloc_zeroed(size_t sz)
+{
+  if (sz <= (1UL << kernel_frames.min_order)) {
+    void *frame = prezero_take_frame();
+    if (frame) return frame;
+  }
+
+  void *frame = falloc(sz);
+  if (frame) memset(frame, 0, sz);
+  return frame;
+}
+
 void ffree(void *p)
 {
   uint64_t frame = (size_t) p;
@@ -23,6 +23,9 @@ extern struct frames user_frames;
 struct multiboot;
 
 void *falloc(size_t sz);
+/* allocate zeroed kernel frames, taking them from the pre-zeroed pool
+   when possible */
+void *falloc_zeroed(size_t sz);
 void ffree(void *p);
 
 void memory_reserve_chunk(chunk_t *chunks, int *num_chunks,
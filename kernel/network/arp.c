@@ -9,6 +9,7 @@
 #include "network/arp.h"
 #include "scheduler.h"
 #include "semaphore.h"
+#include "slab.h"
 
 #include <string.h>
 
@@ -32,6 +33,7 @@ enum {
 };
 
 hashtable_u32_t *arp_table = 0;
+static kmem_cache_t *mac_cache = 0;
 
 hashtable_u32_t *arp_get_table(void) {
   heap_t *heap = network_get_heap();
@@ -109,9 +111,14 @@ int process_packet(nic_t *nic, arp_packet_t *packet)
 
       /* save mapping in the table */
       hashtable_u32_t *table = arp_get_table();
-      void *mac = heap_malloc(network_get_heap(), sizeof(mac_t));
+      mac_t *mac = ht_u32_get(table, packet->sender_ip);
+      if (!mac) {
+        if (!mac_cache)
+          mac_cache = kmem_cache_create("mac", sizeof(mac_t), 1, 0);
+        mac = kmem_cache_alloc(mac_cache);
+        ht_u32_insert(table, packet->sender_ip, mac);
+      }
       memcpy(mac, &packet->sender_mac, sizeof(mac_t));
-      ht_u32_insert(table, packet->sender_ip, mac);
     }
     break;
   case OP_REPLY:
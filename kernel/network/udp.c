@@ -7,6 +7,7 @@
 #include "network/udp.h"
 #include "network/network.h"
 #include "network/types.h"
+#include "slab.h"
 
 #include <arpa/inet.h>
 
@@ -40,6 +41,7 @@ typedef struct udp_handler {
 } udp_handler_t;
 
 static hashtable_u32_t *udp_handlers = 0;
+static kmem_cache_t *udp_handler_cache = 0;
 
 hashtable_u32_t *udp_get_handlers()
 {
@@ -53,7 +55,6 @@ int udp_grab_port(uint16_t port,
                   udp_on_packet_t on_packet,
                   void *on_packet_data)
 {
-  heap_t *heap = network_get_heap();
   hashtable_u32_t *handlers = udp_get_handlers();
   udp_handler_t *handler = ht_u32_get(handlers, port);
   if (handler) {
@@ -65,7 +66,11 @@ int udp_grab_port(uint16_t port,
     return -1;
   }
 
-  handler = heap_malloc(heap, sizeof(udp_handler_t));
+  if (!udp_handler_cache) {
+    udp_handler_cache = kmem_cache_create("udp_handler",
+                                          sizeof(udp_handler_t), 0, 0);
+  }
+  handler = kmem_cache_alloc(udp_handler_cache);
   handler->data = on_packet_data;
   handler->handle = on_packet;
   ht_u32_insert(udp_get_handlers(), port, handler);
@@ -0,0 +1,185 @@
+#include "core/debug.h"
+#include "frames.h"
+#include "list.h"
+#include "memory.h"
+#include "pages.h"
+#include "paging/paging.h"
+#include "prezero.h"
+#include "scheduler.h"
+
+#include <assert.h>
+#include <string.h>
+
+#define PAGES_DEBUG 0
+
+#if PAGES_DEBUG
+# define TRACE(fmt, ...) serial_printf("[pages] " fmt \
+                                       __VA_OPT__(,) __VA_ARGS__)
+#else
+# define TRACE(...) do {} while(0)
+#endif
+
+/* pages are obtained from kernel frames in chunks */
+#define PAGES_CHUNK_BITS 16
+#define PAGES_PER_CHUNK (1 << (PAGES_CHUNK_BITS - PAGE_BITS))
+#define PAGES_MAX_CHUNKS (KERNEL_MEMORY_END >> PAGES_CHUNK_BITS)
+
+/* free pages kept when a chunk becomes completely free */
+#define PAGES_KEEP PAGES_PER_CHUNK
+
+/* header stored at the beginning of a free page */
+typedef struct free_page {
+  list_t head;
+  int zeroed;
+} free_page_t;
+
+static list_t *pages_dirty = 0;
+static list_t *pages_zeroed = 0;
+
+/* number of allocated pages in each chunk */
+static uint8_t pages_used[PAGES_MAX_CHUNKS];
+static pages_stats_t pages_stats;
+
+static inline unsigned page_chunk(void *page)
+{
+  unsigned index = ((size_t) page - kernel_frames.start) >> PAGES_CHUNK_BITS;
+  assert(index < PAGES_MAX_CHUNKS);
+  return index;
+}
+
+static inline void *chunk_page(unsigned chunk, unsigned i)
+{
+  return (void *) (size_t) kernel_frames.start +
+    ((size_t) chunk << PAGES_CHUNK_BITS) + (i << PAGE_BITS);
+}
+
+static void pages_insert(free_page_t *page, int zeroed)
+{
+  page->zeroed = zeroed;
+  list_add(zeroed ? &pages_zeroed : &pages_dirty, &page->head);
+  pages_stats.free++;
+  if (zeroed) pages_stats.zeroed++;
+}
+
+static void pages_remove(free_page_t *page)
+{
+  list_take(page->zeroed ? &pages_zeroed : &pages_dirty, &page->head);
+  pages_stats.free--;
+  if (page->zeroed) pages_stats.zeroed--;
+}
+
+static int pages_grow(void)
+{
+  void *start = (void *) (size_t)
+    frames_alloc(&kernel_frames, 1 << PAGES_CHUNK_BITS);
+  if (!start) return -1;
+  assert((size_t) start < KERNEL_MEMORY_END);
+
+  unsigned chunk = page_chunk(start);
+  assert(chunk_page(chunk, 0) == start);
+  pages_used[chunk] = 0;
+  for (unsigned i = 0; i < PAGES_PER_CHUNK; i++)
+    pages_insert(chunk_page(chunk, i), 0);
+
+  pages_stats.chunks++;
+  TRACE("new chunk at %p\n", start);
+  return 0;
+}
+
+/* take a page from the given pool, falling back to the other one */
+static free_page_t *pages_take(int zeroed)
+{
+  if (!pages_dirty && !pages_zeroed && pages_grow() == -1)
+    return 0;
+
+  list_t *item = zeroed ? pages_zeroed : pages_dirty;
+  if (!item) item = zeroed ? pages_dirty : pages_zeroed;
+
+  free_page_t *page = LIST_ENTRY(item, free_page_t, head);
+  pages_remove(page);
+  pages_used[page_chunk(page)]++;
+  return page;
+}
+
+void *page_alloc(void)
+{
+  sched_disable_preemption();
+  free_page_t *page = pages_take(0);
+  sched_enable_preemption();
+  return page;
+}
+
+void *page_alloc_zeroed(void)
+{
+  sched_disable_preemption();
+  free_page_t *page = pages_take(1);
+  unsigned zeroed = pages_stats.zeroed;
+  sched_enable_preemption();
+  if (!page) return 0;
+
+  /* let the background task replenish the zeroed pool */
+  if (zeroed < PREZERO_PAGES / 2) prezero_kick();
+
+  /* only the header of a page from the zeroed pool needs clearing */
+  if (page->zeroed)
+    memset(page, 0, sizeof(free_page_t));
+  else
+    page_zero((page_t *) page);
+  return page;
+}
+
+static void pages_free(void *ptr, int zeroed)
+{
+  unsigned chunk = page_chunk(ptr);
+  assert(pages_used[chunk] > 0);
+  pages_insert(ptr, zeroed);
+
+  if (--pages_used[chunk] > 0) return;
+  if (pages_stats.free < PAGES_KEEP + PAGES_PER_CHUNK) return;
+
+  /* give the whole chunk back */
+  for (unsigned i = 0; i < PAGES_PER_CHUNK; i++)
+    pages_remove(chunk_page(chunk, i));
+  frames_free(&kernel_frames, (size_t) chunk_page(chunk, 0));
+  pages_stats.chunks--;
+  TRACE("released chunk at %p\n", chunk_page(chunk, 0));
+}
+
+void page_free(void *page)
+{
+  if (!page) return;
+  assert(((size_t) page & ((1 << PAGE_BITS) - 1)) == 0);
+
+  sched_disable_preemption();
+  pages_free(page, 0);
+  sched_enable_preemption();
+}
+
+unsigned pages_zero_free(unsigned max)
+{
+  unsigned count = 0;
+  while (count < max) {
+    /* take a dirty page out of the pool, so that it can be zeroed
+       with preemption enabled */
+    sched_disable_preemption();
+    free_page_t *page = 0;
+    if (pages_dirty) page = pages_take(0);
+    sched_enable_preemption();
+    if (!page) break;
+
+    page_zero((page_t *) page);
+
+    sched_disable_preemption();
+    pages_free(page, 1);
+    sched_enable_preemption();
+    count++;
+  }
+  return count;
+}
+
+void pages_get_stats(pages_stats_t *stats)
+{
+  sched_disable_preemption();
+  *stats = pages_stats;
+  sched_enable_preemption();
+}
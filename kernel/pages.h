@@ -0,0 +1,34 @@
+#ifndef PAGES_H
+#define PAGES_H
+
+#include <stdint.h>
+
+/* Allocator for single pages of identity mapped kernel memory.
+
+   The minimum order of the kernel frame allocator is larger than a
+   page, so page-sized objects like page tables are carved out of
+   larger chunks of kernel frames. Chunks are returned to the frame
+   allocator when all their pages are free.
+
+   Free pages are kept in two pools: pages with undefined contents,
+   and pages that have already been zeroed, which can be handed out
+   by page_alloc_zeroed without clearing them on the spot.
+*/
+
+typedef struct pages_stats {
+  uint32_t chunks;
+  uint32_t free;
+  uint32_t zeroed;
+} pages_stats_t;
+
+void *page_alloc(void);
+void *page_alloc_zeroed(void);
+void page_free(void *page);
+
+/* zero up to max free pages, moving them to the zeroed pool, and
+   return the number of pages zeroed */
+unsigned pages_zero_free(unsigned max);
+
+void pages_get_stats(pages_stats_t *stats);
+
+#endif /* PAGES_H */
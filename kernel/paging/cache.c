@@ -0,0 +1,115 @@
+#include "core/debug.h"
+#include "core/serial.h"
+#include "core/x86.h"
+#include "atomic.h"
+#include "paging/cache.h"
+#include "paging/paging.h"
+
+#include <inttypes.h>
+
+/* memory type encodings used by the PAT and MTRRs */
+enum {
+  MEMTYPE_UC = 0,
+  MEMTYPE_WC = 1,
+  MEMTYPE_WT = 4,
+  MEMTYPE_WB = 6,
+};
+
+#define PAT_WC_INDEX 1 /* PWT set, PCD and PAT clear */
+#define MTRR_ENABLE (1 << 11)
+#define MTRR_VALID (1 << 11)
+
+static int pat_enabled = 0;
+
+static void cache_flush(void)
+{
+  wbinvd();
+  paging_flush_tlb_global();
+}
+
+/* Memory types are changed following the sequence in the SDM:
+   interrupts off, caches in no-fill mode, caches and TLBs flushed
+   before and after the update, then caching turned back on. */
+static void cache_update_begin(uint32_t *flags, uint32_t *cr0)
+{
+  *flags = cpu_flags();
+  cli();
+  *cr0 = CR_GET(0);
+  CR_SET(0, (*cr0 | CR0_CD) & ~CR0_NW);
+  cache_flush();
+}
+
+static void cache_update_end(uint32_t flags, uint32_t cr0)
+{
+  CR_SET(0, cr0);
+  if (flags & EFLAGS_IF) sti();
+}
+
+void cache_init(void)
+{
+  if (!cpuid_check_features(CPUID_FEAT_MSR | CPUID_FEAT_PAT)) return;
+
+  uint64_t pat = rdmsr(MSR_PAT);
+  pat &= ~(0xffULL << (PAT_WC_INDEX * 8));
+  pat |= (uint64_t) MEMTYPE_WC << (PAT_WC_INDEX * 8);
+
+  uint32_t flags, cr0;
+  cache_update_begin(&flags, &cr0);
+  wrmsr(MSR_PAT, pat);
+  cache_flush();
+  cache_update_end(flags, cr0);
+
+  pat_enabled = 1;
+#if PAGING_DEBUG
+  serial_printf("PAT: %#" PRIx64 "\n", pat);
+#endif
+}
+
+uint16_t cache_entry_flags(int type)
+{
+  if (type == CACHE_WRITE_COMBINING && pat_enabled)
+    return PT_ENTRY_PWT;
+  return 0;
+}
+
+int cache_mtrr_set(uint64_t base, uint64_t size, int type)
+{
+  if (type != CACHE_WRITE_COMBINING) return -1;
+  if (!cpuid_check_features(CPUID_FEAT_MSR | CPUID_FEAT_MTRR)) return -1;
+
+  /* variable ranges must be naturally aligned powers of two */
+  uint64_t len = 1 << 12;
+  while (len < size) len <<= 1;
+  if (base & (len - 1)) return -1;
+
+  uint64_t def_type = rdmsr(MSR_MTRR_DEF_TYPE);
+  if (!(def_type & MTRR_ENABLE)) return -1;
+
+  unsigned count = rdmsr(MSR_MTRRCAP) & 0xff;
+  unsigned i;
+  for (i = 0; i < count; i++) {
+    if (!(rdmsr(MSR_MTRR_PHYSMASK0 + 2 * i) & MTRR_VALID)) break;
+  }
+  if (i == count) return -1;
+
+  unsigned phys_bits = cpuid_phys_address_bits();
+  uint64_t mask = ~(len - 1) & ((1ULL << phys_bits) - 1);
+
+  /* MTRRs are also disabled while the range is updated */
+  uint32_t flags, cr0;
+  cache_update_begin(&flags, &cr0);
+  wrmsr(MSR_MTRR_DEF_TYPE, def_type & ~MTRR_ENABLE);
+
+  wrmsr(MSR_MTRR_PHYSBASE0 + 2 * i, base | MEMTYPE_WC);
+  wrmsr(MSR_MTRR_PHYSMASK0 + 2 * i, mask | MTRR_VALID);
+
+  cache_flush();
+  wrmsr(MSR_MTRR_DEF_TYPE, def_type);
+  cache_update_end(flags, cr0);
+
+#if PAGING_DEBUG
+  serial_printf("MTRR %u: %#" PRIx64 " - %#" PRIx64 " write-combining\n",
+                i, base, base + len);
+#endif
+  return 0;
+}
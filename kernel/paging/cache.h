@@ -0,0 +1,27 @@
+#ifndef PAGING_CACHE_H
+#define PAGING_CACHE_H
+
+#include <stdint.h>
+
+/* Memory types for kernel mappings.
+
+   Write-combining is obtained through the PAT, by reprogramming the
+   entry selected by PWT alone, which is write-through by default and
+   never used by the kernel. When the PAT is not available, a variable
+   MTRR covering the physical range is used instead. */
+
+enum {
+  CACHE_DEFAULT,
+  CACHE_WRITE_COMBINING,
+};
+
+void cache_init(void);
+
+/* page table flags selecting a memory type */
+uint16_t cache_entry_flags(int type);
+
+/* set the memory type of a physical range through an MTRR, returns
+   -1 if no MTRR can cover the range */
+int cache_mtrr_set(uint64_t base, uint64_t size, int type);
+
+#endif /* PAGING_CACHE_H */
@@ -3,6 +3,7 @@
 #include "core/serial.h"
 #include "core/util.h"
 #include "frames.h"
+#include "pages.h"
 #include "paging/paging.h"
 #include "paging/legacy.h"
 
@@ -27,34 +28,31 @@ static inline pg_legacy_entry_t mk_entry(page_t *page, uint16_t flags)
   return (uint32_t) page | flags;
 }
 
-static void paging_idmap_large(pg_legacy_entry_t *table, void *address)
+static void paging_idmap_large(paging_legacy_t *pg, void *address)
 {
-  table[DIR_INDEX(address)] =
+  pg->dir_table[DIR_INDEX(address)] =
     mk_entry(LARGE_PAGE((size_t) address),
              PT_ENTRY_PRESENT |
              PT_ENTRY_RW |
-             PT_ENTRY_SIZE);
+             PT_ENTRY_SIZE |
+             pg->global);
 }
 
 int paging_legacy_init(paging_legacy_t *pg)
 {
-  pg->perm = KERNEL_VM_PERM_START;
-  pg->temp = KERNEL_VM_TEMP_START;
+  pg->global = cpuid_check_features(CPUID_FEAT_PGE) ? PT_ENTRY_GLOBAL : 0;
 
-  // TODO: use a page allocator
-  page_t *directory = falloc(sizeof(page_t));
-  page_zero(directory);
+  page_t *directory = page_alloc_zeroed();
   pg->dir_table = (pg_legacy_entry_t *) directory;
 
   /* identity map kernel memory */
   for (void *p = KERNEL_VM_ID_START; p < KERNEL_VM_ID_END; p += (1 << LARGE_PAGE_BITS)) {
-    paging_idmap_large(pg->dir_table, p);
+    paging_idmap_large(pg, p);
   }
 
   /* set up temporary mapping table */
   {
-    page_t *tmp_page = falloc(sizeof(page_t));
-    page_zero(tmp_page);
+    page_t *tmp_page = page_alloc_zeroed();
     pg->dir_table[DIR_INDEX(KERNEL_VM_TEMP_START)] = mk_entry
       (tmp_page, PT_ENTRY_PRESENT | PT_ENTRY_RW);
     pg->tmp_table = (pg_legacy_entry_t *) tmp_page;
@@ -72,85 +70,128 @@ int paging_legacy_init(paging_legacy_t *pg)
 
   paging_enable();
 
+  /* enable global pages */
+  if (pg->global) CR_SET(4, CR_GET(4) | CR4_PGE);
+
   return 0;
 }
 
-/* map a physical page into the temporary VMA space */
-static void *paging_legacy_map_temp(void *data, uint64_t p)
+/* set the temporary mapping at vaddr, the slot must be unused */
+static void paging_legacy_map_temp(void *data, void *vaddr, uint64_t p)
 {
   paging_legacy_t *pg = data;
 
-  TRACE("temp map: %#" PRIx64 "\n", p);
+  TRACE("temp map: %#" PRIx64 " => %p\n", p, vaddr);
 
-  assert(pg->dir_table);
+  assert(pg->tmp_table);
   assert(p < (1ULL << 32));
 
-  page_t *tmp = pg->temp;
-  uint32_t *entry = 0;
-  do {
-    entry = &pg->tmp_table[TABLE_INDEX(tmp)];
-    if (!(*entry & PT_ENTRY_PRESENT)) break;
-    tmp++;
-    if ((void *)tmp >= KERNEL_VM_TEMP_END)
-      tmp = KERNEL_VM_TEMP_START;
-  } while (tmp != pg->temp);
-
-  if (*entry & PT_ENTRY_PRESENT) {
-    serial_set_colour(SERIAL_COLOUR_ERR);
-    serial_printf("ERROR: Out of temporary mappings\n");
-    panic();
-    return 0;
-  }
-
+  pg_legacy_entry_t *entry = &pg->tmp_table[TABLE_INDEX(vaddr)];
+  assert(!(*entry & PT_ENTRY_PRESENT));
   *entry = mk_entry(PAGE((size_t) p), PT_ENTRY_PRESENT | PT_ENTRY_RW);
-
-  pg->temp = tmp + 1;
-  if ((void *) pg->temp >= KERNEL_VM_TEMP_END)
-    pg->temp = KERNEL_VM_TEMP_START;
-
-  return tmp;
 }
 
-static void paging_legacy_unmap_temp(void *data, void *p)
+/* clear a temporary mapping, invalidation is left to the caller */
+static void paging_legacy_unmap_temp(void *data, void *vaddr)
 {
   paging_legacy_t *pg = data;
 
-  assert(p >= KERNEL_VM_TEMP_START && p < KERNEL_VM_TEMP_END);
-  assert(((size_t) p & ((1 << PAGE_BITS) - 1)) == 0);
+  assert(vaddr >= KERNEL_VM_TEMP_START && vaddr < KERNEL_VM_TEMP_END);
+  assert(((size_t) vaddr & ((1 << PAGE_BITS) - 1)) == 0);
 
-  __asm__ volatile("invlpg %0" : : "m"(*(uint8_t *)p));
-  pg->tmp_table[TABLE_INDEX(p)] = 0;
-
-  pg->temp = p;
+  pg->tmp_table[TABLE_INDEX(vaddr)] = 0;
 }
 
-/* map a single physical page into the permanent VMA space */
-static void *paging_legacy_map_perm(void *data, uint64_t p)
+/* map a single physical page at a kernel virtual address */
+static void paging_legacy_map_page(void *data, void *vaddr, uint64_t p,
+                                   uint16_t flags)
 {
   paging_legacy_t *pg = data;
 
   assert(pg->dir_table);
   assert(p < (1ULL << 32));
 
-  TRACE("perm map: %#" PRIx64 "\n", p);
+  TRACE("map page: %#" PRIx64 " => %p\n", p, vaddr);
 
-  uint32_t *entry = &pg->dir_table[DIR_INDEX(pg->perm)];
+  uint32_t *entry = &pg->dir_table[DIR_INDEX(vaddr)];
   page_t *tpage = 0;
   if (*entry & PT_ENTRY_PRESENT) {
+    assert(!(*entry & PT_ENTRY_SIZE));
     tpage = PAGE(*entry);
   }
   else {
     /* allocate new page table */
-    tpage = falloc(sizeof(page_t));
-    page_zero(tpage);
+    tpage = page_alloc_zeroed();
     *entry = mk_entry(tpage, PT_ENTRY_PRESENT | PT_ENTRY_RW);
   }
 
   pg_legacy_entry_t *table = (pg_legacy_entry_t *)tpage;
-  table[TABLE_INDEX(pg->perm)] =
-    mk_entry(PAGE((size_t) p), PT_ENTRY_PRESENT | PT_ENTRY_RW);
+  table[TABLE_INDEX(vaddr)] =
+    mk_entry(PAGE((size_t) p),
+             PT_ENTRY_PRESENT | PT_ENTRY_RW | pg->global | flags);
+}
+
+/* map a 4M page at a kernel virtual address */
+static void paging_legacy_map_large(void *data, void *vaddr, uint64_t p,
+                                    uint16_t flags)
+{
+  paging_legacy_t *pg = data;
+
+  assert(pg->dir_table);
+  assert(p < (1ULL << 32));
+  assert(((size_t) vaddr & ((1 << LARGE_PAGE_BITS) - 1)) == 0);
+  assert((p & ((1 << LARGE_PAGE_BITS) - 1)) == 0);
+
+  TRACE("map large page: %#" PRIx64 " => %p\n", p, vaddr);
 
-  return pg->perm++;
+  /* the whole range is being remapped, so any page table left over
+     from previous mappings is empty */
+  uint32_t *entry = &pg->dir_table[DIR_INDEX(vaddr)];
+  if ((*entry & PT_ENTRY_PRESENT) && !(*entry & PT_ENTRY_SIZE))
+    page_free(PAGE(*entry));
+
+  *entry = mk_entry(LARGE_PAGE((size_t) p),
+                    PT_ENTRY_PRESENT | PT_ENTRY_RW | PT_ENTRY_SIZE |
+                    pg->global | flags);
+}
+
+static size_t paging_legacy_unmap(void *data, void *vaddr)
+{
+  paging_legacy_t *pg = data;
+
+  uint32_t *entry = &pg->dir_table[DIR_INDEX(vaddr)];
+  size_t size = 1 << PAGE_BITS;
+  if (*entry & PT_ENTRY_SIZE) {
+    assert(((size_t) vaddr & ((1 << LARGE_PAGE_BITS) - 1)) == 0);
+    *entry = 0;
+    size = 1 << LARGE_PAGE_BITS;
+  }
+  else if (*entry & PT_ENTRY_PRESENT) {
+    pg_legacy_entry_t *table = (pg_legacy_entry_t *) PAGE(*entry);
+    table[TABLE_INDEX(vaddr)] = 0;
+  }
+
+  __asm__ volatile("invlpg %0" : : "m"(*(uint8_t *)vaddr));
+  return size;
+}
+
+static int paging_legacy_lookup(void *data, void *vaddr, uint64_t *p)
+{
+  paging_legacy_t *pg = data;
+
+  uint32_t entry = pg->dir_table[DIR_INDEX(vaddr)];
+  if (!(entry & PT_ENTRY_PRESENT)) return -1;
+  if (entry & PT_ENTRY_SIZE) {
+    *p = (size_t) LARGE_PAGE(entry) +
+      ((size_t) vaddr & ((1 << LARGE_PAGE_BITS) - 1));
+    return 0;
+  }
+
+  pg_legacy_entry_t *table = (pg_legacy_entry_t *) PAGE(entry);
+  entry = table[TABLE_INDEX(vaddr)];
+  if (!(entry & PT_ENTRY_PRESENT)) return -1;
+  *p = (size_t) PAGE(entry);
+  return 0;
 }
 
 static uint64_t paging_legacy_max_memory(void *data)
@@ -160,8 +201,13 @@ static uint64_t paging_legacy_max_memory(void *data)
 
 void paging_legacy_init_ops(pg_ops_t *ops)
 {
-  ops->map_perm = paging_legacy_map_perm;
+  ops->map_page = paging_legacy_map_page;
+  ops->map_large = paging_legacy_map_large;
+  ops->unmap = paging_legacy_unmap;
+  ops->lookup = paging_legacy_lookup;
   ops->map_temp = paging_legacy_map_temp;
   ops->unmap_temp = paging_legacy_unmap_temp;
+  ops->temp_pages = 1 << (PAGE_BITS - 2);
   ops->max_memory = paging_legacy_max_memory;
+  ops->large_page_bits = LARGE_PAGE_BITS;
 }
@@ -5,10 +5,10 @@ typedef uint32_t pg_legacy_entry_t;
 typedef pg_legacy_entry_t pg_legacy_table_t[1 << (PAGE_BITS - 2)];
 
 typedef struct paging_legacy {
-  page_t *perm;
-  page_t *temp;
   pg_legacy_entry_t *dir_table;
   pg_legacy_entry_t *tmp_table;
+  /* flag set on kernel mappings that survive address space switches */
+  uint16_t global;
 } paging_legacy_t;
 
 int paging_legacy_init(paging_legacy_t *pg);
@@ -2,6 +2,7 @@
 #include "core/serial.h"
 #include "core/x86.h"
 #include "core/util.h"
+#include "pages.h"
 #include "paging/paging.h"
 #include "paging/pae.h"
 
@@ -10,6 +11,8 @@
 #define ENTRY_BITS (PAGE_BITS - 3)
 #define LARGE_PAGE_BITS (PAGE_BITS + ENTRY_BITS)
 #define DEF_FLAGS (PT_ENTRY_PRESENT | PT_ENTRY_RW)
+/* physical address bits of an entry */
+#define ENTRY_ADDR(e) ((e) & 0x000ffffffffff000ULL)
 
 /* level 3 table: four entries, highest 2 bits */
 #define L3_INDEX(x) ((((uint32_t) x) >> 30) & 0x3)
@@ -25,38 +28,34 @@ static inline pg_pae_entry_t mk_entry(uint64_t p, uint16_t flags)
 
 int paging_pae_init(paging_pae_t *pg)
 {
+  pg->global = cpuid_check_features(CPUID_FEAT_PGE) ? PT_ENTRY_GLOBAL : 0;
+
   /* allocate level 3 table */
-  page_t *l3 = falloc(sizeof(page_t));
+  page_t *l3 = page_alloc_zeroed();
   assert(((size_t) l3 & 0xfff) == 0);
-  page_zero(l3);
   pg->table3 = (pg_pae_entry_t *)l3;
 
   /* allocate one level 2 table, this will be enough for the first GB
      of virtual memory */
-  page_t *l2 = falloc(sizeof(page_t));
+  page_t *l2 = page_alloc_zeroed();
   assert(((size_t) l2 & 0xfff) == 0);
-  page_zero(l2);
   pg->table2 = (pg_pae_entry_t *)l2;
   pg->table3[0] = mk_entry((size_t) l2, PT_ENTRY_PRESENT);
 
   /* identity map kernel memory */
   for (void *p = KERNEL_VM_ID_START; p < KERNEL_VM_ID_END; p += (1 << LARGE_PAGE_BITS)) {
     pg->table2[L2_INDEX(p)] = mk_entry(ALIGN_BITS((size_t) p, LARGE_PAGE_BITS),
-                                       DEF_FLAGS | PT_ENTRY_SIZE);
+                                       DEF_FLAGS | PT_ENTRY_SIZE | pg->global);
   }
 
   /* set up temporary mapping table */
   {
-    pg->temp = KERNEL_VM_TEMP_START;
-    page_t *tmp_page = falloc(sizeof(page_t));
-    page_zero(tmp_page);
-    pg->table2[L2_INDEX(pg->temp)] = mk_entry((size_t) tmp_page, DEF_FLAGS);
+    page_t *tmp_page = page_alloc_zeroed();
+    pg->table2[L2_INDEX(KERNEL_VM_TEMP_START)] =
+      mk_entry((size_t) tmp_page, DEF_FLAGS);
     pg->tmp_table = (pg_pae_entry_t *)tmp_page;
   }
 
-  /* set up permanent virtual memory area */
-  pg->perm = KERNEL_VM_PERM_START;
-
   /* install level 3 table */
   CR_SET(3, l3);
 
@@ -73,74 +72,109 @@ int paging_pae_init(paging_pae_t *pg)
 
   paging_enable();
 
+  /* enable global pages */
+  if (pg->global) CR_SET(4, CR_GET(4) | CR4_PGE);
+
   return 0;
 }
 
-static void *map_temp(void *data, uint64_t p)
+/* set the temporary mapping at vaddr, the slot must be unused */
+static void map_temp(void *data, void *vaddr, uint64_t p)
 {
   paging_pae_t *pg = data;
+  assert(pg->tmp_table);
 
-  assert(pg->table2);
-
-  page_t *tmp = pg->temp;
-  pg_pae_entry_t *entry = 0;
-  do {
-    entry = &pg->tmp_table[L1_INDEX(tmp)];
-    if (!(*entry & PT_ENTRY_PRESENT)) break;
-    tmp++;
-    if ((void *)tmp >= KERNEL_VM_TEMP_END)
-      tmp = KERNEL_VM_TEMP_START;
-  } while (tmp != pg->temp);
-
-  if (*entry & PT_ENTRY_PRESENT) {
-    serial_printf("ERROR: Out of temporary mappings\n");
-    panic();
-    return 0;
-  }
-
+  pg_pae_entry_t *entry = &pg->tmp_table[L1_INDEX(vaddr)];
+  assert(!(*entry & PT_ENTRY_PRESENT));
   *entry = mk_entry(ALIGN(p, 1 << PAGE_BITS), DEF_FLAGS);
-
-  pg->temp = tmp + 1;
-  if ((void *) pg->temp >= KERNEL_VM_TEMP_END)
-    pg->temp = KERNEL_VM_TEMP_START;
-
-  return tmp;
 }
 
-static void unmap_temp(void *data, void *p)
+/* clear a temporary mapping, invalidation is left to the caller */
+static void unmap_temp(void *data, void *vaddr)
 {
   paging_pae_t *pg = data;
 
-  assert(p >= KERNEL_VM_TEMP_START && p < KERNEL_VM_TEMP_END);
-  assert(((size_t) p & ((1 << PAGE_BITS) - 1)) == 0);
+  assert(vaddr >= KERNEL_VM_TEMP_START && vaddr < KERNEL_VM_TEMP_END);
+  assert(((size_t) vaddr & ((1 << PAGE_BITS) - 1)) == 0);
 
-  __asm__ volatile("invlpg %0" : : "m"(*(uint8_t *)p));
-  pg->tmp_table[L1_INDEX(p)] = 0;
-
-  pg->temp = p;
+  pg->tmp_table[L1_INDEX(vaddr)] = 0;
 }
 
-static void *map_perm(void *data, uint64_t p)
+static void map_page(void *data, void *vaddr, uint64_t p, uint16_t flags)
 {
   paging_pae_t *pg = data;
   assert(pg->table2);
 
   /* get or create page table */
-  pg_pae_entry_t *entry = &pg->table2[L2_INDEX(pg->perm)];
+  pg_pae_entry_t *entry = &pg->table2[L2_INDEX(vaddr)];
   page_t *tpage = 0;
   if (*entry & PT_ENTRY_PRESENT) {
+    assert(!(*entry & PT_ENTRY_SIZE));
     tpage = PAGE((size_t)(*entry));
   }
   else {
-    tpage = falloc(sizeof(page_t));
-    page_zero(tpage);
+    tpage = page_alloc_zeroed();
     *entry = mk_entry((size_t) tpage, DEF_FLAGS);
   }
 
   pg_pae_entry_t *table = (pg_pae_entry_t *)tpage;
-  table[L1_INDEX(pg->perm)] = mk_entry(ALIGN(p, 1 << PAGE_BITS), DEF_FLAGS);
+  table[L1_INDEX(vaddr)] = mk_entry(ALIGN(p, 1 << PAGE_BITS),
+                                    DEF_FLAGS | pg->global | flags);
+}
+
+static void map_large(void *data, void *vaddr, uint64_t p, uint16_t flags)
+{
+  paging_pae_t *pg = data;
+  assert(pg->table2);
+  assert(((size_t) vaddr & ((1 << LARGE_PAGE_BITS) - 1)) == 0);
+  assert((p & ((1 << LARGE_PAGE_BITS) - 1)) == 0);
 
-  return pg->perm++;
+  /* the whole range is being remapped, so any page table left over
+     from previous mappings is empty */
+  pg_pae_entry_t *entry = &pg->table2[L2_INDEX(vaddr)];
+  if ((*entry & PT_ENTRY_PRESENT) && !(*entry & PT_ENTRY_SIZE))
+    page_free(PAGE((size_t)(*entry)));
+
+  *entry = mk_entry(p, DEF_FLAGS | PT_ENTRY_SIZE | pg->global | flags);
+}
+
+static size_t unmap(void *data, void *vaddr)
+{
+  paging_pae_t *pg = data;
+
+  pg_pae_entry_t *entry = &pg->table2[L2_INDEX(vaddr)];
+  size_t size = 1 << PAGE_BITS;
+  if (*entry & PT_ENTRY_SIZE) {
+    assert(((size_t) vaddr & ((1 << LARGE_PAGE_BITS) - 1)) == 0);
+    *entry = 0;
+    size = 1 << LARGE_PAGE_BITS;
+  }
+  else if (*entry & PT_ENTRY_PRESENT) {
+    pg_pae_entry_t *table = (pg_pae_entry_t *) PAGE((size_t)(*entry));
+    table[L1_INDEX(vaddr)] = 0;
+  }
+
+  __asm__ volatile("invlpg %0" : : "m"(*(uint8_t *)vaddr));
+  return size;
+}
+
+static int lookup(void *data, void *vaddr, uint64_t *p)
+{
+  paging_pae_t *pg = data;
+
+  pg_pae_entry_t entry = pg->table2[L2_INDEX(vaddr)];
+  if (!(entry & PT_ENTRY_PRESENT)) return -1;
+  if (entry & PT_ENTRY_SIZE) {
+    *p = (ENTRY_ADDR(entry) & ~((1ULL << LARGE_PAGE_BITS) - 1)) +
+      ((size_t) vaddr & ((1 << LARGE_PAGE_BITS) - 1));
+    return 0;
+  }
+
+  pg_pae_entry_t *table = (pg_pae_entry_t *) PAGE((size_t) entry);
+  entry = table[L1_INDEX(vaddr)];
+  if (!(entry & PT_ENTRY_PRESENT)) return -1;
+  *p = ENTRY_ADDR(entry);
+  return 0;
 }
 
 static uint64_t max_memory(void *data)
@@ -153,6 +187,12 @@ void paging_pae_init_ops(pg_ops_t *ops)
 {
   ops->map_temp = map_temp;
   ops->unmap_temp = unmap_temp;
-  ops->map_perm = map_perm;
+  /* a single page table covers the first half of the temporary area */
+  ops->temp_pages = 1 << ENTRY_BITS;
+  ops->map_page = map_page;
+  ops->map_large = map_large;
+  ops->unmap = unmap;
+  ops->lookup = lookup;
   ops->max_memory = max_memory;
+  ops->large_page_bits = LARGE_PAGE_BITS;
 }
@@ -1,11 +1,18 @@
 #include "paging/paging.h"
+#include "paging/cache.h"
 #include "paging/legacy.h"
 #include "paging/pae.h"
+#include "bitset.h"
 #include "core/debug.h"
+#include "core/interrupts.h"
+#include "core/serial.h"
+#include "core/util.h"
 #include "core/x86.h"
+#include "scheduler.h"
 
 #include <assert.h>
 #include <inttypes.h>
+#include <string.h>
 
 #define PAGING_ENABLED 1
 
@@ -13,46 +20,285 @@ static pg_ops_t ops;
 static paging_legacy_t legacy;
 static paging_pae_t pae;
 void *ops_data = 0;
+static uint32_t kernel_root = 0;
 
-void *paging_temp_map_page(uint64_t p)
+/* PCID is only available in long mode, so switching address space
+   always drops the non-global TLB entries. Kernel mappings are global
+   whenever the CPU supports it, and are kept. */
+void paging_switch(uint32_t root)
 {
-  if (!ops.map_temp) return (void *)(size_t) p;
+  /* the kernel task state is reloaded when returning from the page
+     fault task, so it has to follow the current root */
+  kernel_tss.tss.cr3 = root;
+  if (CR_GET(3) != root) CR_SET(3, root);
+}
+
+uint32_t paging_kernel_root(void)
+{
+  return kernel_root;
+}
+
+void paging_flush_tlb(void)
+{
+  CR_SET(3, CR_GET(3));
+}
+
+void paging_flush_tlb_global(void)
+{
+  uint32_t cr4 = CR_GET(4);
+  if (cr4 & CR4_PGE) {
+    /* toggling PGE invalidates global entries as well */
+    CR_SET(4, cr4 & ~CR4_PGE);
+    CR_SET(4, cr4);
+  }
+  else {
+    paging_flush_tlb();
+  }
+}
+
+/* Slots of the temporary mapping area are kept in two stacks: clean
+   slots, which are guaranteed not to be cached in the TLB, and stale
+   slots, which have been unmapped without invalidation. When no clean
+   slots are left, the whole TLB is flushed and all stale slots become
+   clean. */
+#define TEMP_MAX_PAGES 1024 /* 124 MB - 128 MB */
+static uint16_t temp_clean[TEMP_MAX_PAGES];
+static uint16_t temp_stale[TEMP_MAX_PAGES];
+static unsigned temp_num_clean = 0;
+static unsigned temp_num_stale = 0;
+
+static void temp_init(void)
+{
+  assert(ops.temp_pages <= TEMP_MAX_PAGES);
 
-  void *ret = ops.map_temp(ops_data, p);
+  /* slots are popped from the top, so push them in reverse order */
+  for (unsigned i = 0; i < ops.temp_pages; i++)
+    temp_clean[i] = ops.temp_pages - 1 - i;
+  temp_num_clean = ops.temp_pages;
+  temp_num_stale = 0;
+}
+
+static inline void *temp_slot_address(unsigned slot)
+{
+  return KERNEL_VM_TEMP_START + (slot << PAGE_BITS);
+}
+
+static void *temp_map(uint64_t p)
+{
+  if (temp_num_clean == 0) {
+    if (temp_num_stale == 0) {
+      serial_set_colour(SERIAL_COLOUR_ERR);
+      serial_printf("ERROR: Out of temporary mappings\n");
+      panic();
+      return 0;
+    }
+
+    /* invalidate all stale slots at once */
+    paging_flush_tlb();
+    memcpy(temp_clean, temp_stale, temp_num_stale * sizeof(uint16_t));
+    temp_num_clean = temp_num_stale;
+    temp_num_stale = 0;
+  }
+
+  void *vaddr = temp_slot_address(temp_clean[--temp_num_clean]);
+  ops.map_temp(ops_data, vaddr, p);
 #if PAGING_DEBUG
-  serial_printf("temp mapping: %#" PRIx64 " => %p\n", p, ret);
+  serial_printf("temp mapping: %#" PRIx64 " => %p\n", p, vaddr);
 #endif
-  return ret;
+  return vaddr;
 }
 
-void paging_temp_unmap_page(void *p)
+static void temp_unmap(void *p)
 {
-  if (!ops.unmap_temp) return;
-
+  p = PAGE((size_t) p);
   ops.unmap_temp(ops_data, p);
+  assert(temp_num_stale < ops.temp_pages);
+  temp_stale[temp_num_stale++] = (p - KERNEL_VM_TEMP_START) >> PAGE_BITS;
 #if PAGING_DEBUG
   serial_printf("temp unmap: %p\n", p);
 #endif
 }
 
-void *paging_perm_map_page(uint64_t p)
+void *paging_temp_map_page(uint64_t p)
 {
-  if (!ops.map_perm) return (void *)(size_t) p;
-  return ops.map_perm(ops_data, p);
+  if (!ops.map_temp) return (void *)(size_t) p;
+
+  sched_disable_preemption();
+  void *ret = temp_map(p);
+  sched_enable_preemption();
+  return ret;
+}
+
+void paging_temp_unmap_page(void *p)
+{
+  if (!ops.unmap_temp) return;
+
+  sched_disable_preemption();
+  temp_unmap(p);
+  sched_enable_preemption();
+}
+
+void paging_temp_map_pages(const uint64_t *ps, unsigned n, void **ptrs)
+{
+  if (!ops.map_temp) {
+    for (unsigned i = 0; i < n; i++) ptrs[i] = (void *)(size_t) ps[i];
+    return;
+  }
+
+  sched_disable_preemption();
+  for (unsigned i = 0; i < n; i++) ptrs[i] = temp_map(ps[i]);
+  sched_enable_preemption();
+}
+
+void paging_temp_unmap_batch(void **ptrs, unsigned n)
+{
+  if (!ops.unmap_temp) return;
+
+  sched_disable_preemption();
+  for (unsigned i = 0; i < n; i++) temp_unmap(ptrs[i]);
+  sched_enable_preemption();
+}
+
+/* Allocator for the permanent mapping area, with one bit for every
+   page of virtual memory. */
+#define PERM_PAGES ((128 * 1024 * 1024) >> PAGE_BITS) /* 128 MB - 256 MB */
+static uint32_t perm_bitmap[PERM_PAGES / 32];
+
+/* Find a free range of virtual pages whose offset from the start of
+   the permanent area is congruent to phase modulo align. */
+static void *perm_alloc(size_t num_pages, size_t phase, size_t align)
+{
+  size_t step = align >> PAGE_BITS;
+  for (size_t i = phase >> PAGE_BITS; i + num_pages <= PERM_PAGES; ) {
+    size_t j = i;
+    while (j < i + num_pages && !GET_BIT(perm_bitmap, j)) j++;
+
+    if (j == i + num_pages) {
+      for (j = i; j < i + num_pages; j++) SET_BIT(perm_bitmap, j);
+      return KERNEL_VM_PERM_START + (i << PAGE_BITS);
+    }
+
+    /* skip to the first candidate past the used page */
+    i += DIV_UP(j + 1 - i, step) * step;
+  }
+
+  return 0;
+}
+
+static void perm_release(void *vaddr, size_t num_pages)
+{
+  size_t i = (vaddr - KERNEL_VM_PERM_START) >> PAGE_BITS;
+  for (size_t j = i; j < i + num_pages; j++) {
+    assert(GET_BIT(perm_bitmap, j));
+    UNSET_BIT(perm_bitmap, j);
+  }
+}
+
+void paging_map_page(void *vaddr, uint64_t p)
+{
+  assert(ops.map_page);
+  ops.map_page(ops_data, vaddr, p, 0);
+}
+
+void paging_unmap_page(void *vaddr)
+{
+  assert(ops.unmap);
+  ops.unmap(ops_data, vaddr);
+}
+
+int paging_lookup(void *vaddr, uint64_t *p)
+{
+  if (!ops.lookup) {
+    *p = (size_t) vaddr;
+    return 0;
+  }
+  return ops.lookup(ops_data, vaddr, p);
 }
 
 void *paging_perm_map_pages(uint64_t p, size_t size)
 {
-  uint64_t p1 = p + size;
-  void *ret = 0;
+  return paging_perm_map_pages_flags(p, size, 0);
+}
+
+void *paging_perm_map_pages_flags(uint64_t p, size_t size, unsigned flags)
+{
+  if (!ops.map_page) return (void *)(size_t) p;
+
+  size_t offset = p & ((1 << PAGE_BITS) - 1);
+  uint64_t start = p - offset;
+  size_t num_pages = DIV_UP(size + offset, 1 << PAGE_BITS);
+  size_t large = 1UL << ops.large_page_bits;
 
-  while (p < p1) {
-    void *vma = paging_perm_map_page(p);
-    if (!ret) ret = vma;
-    p += (1 << PAGE_BITS);
+  uint16_t entry_flags = 0;
+  if (flags & PAGING_MAP_WC) {
+    entry_flags = cache_entry_flags(CACHE_WRITE_COMBINING);
+    /* without a PAT, fall back to an MTRR */
+    if (!entry_flags &&
+        cache_mtrr_set(start, num_pages << PAGE_BITS,
+                       CACHE_WRITE_COMBINING) == -1) {
+      int col = serial_set_colour(SERIAL_COLOUR_ERR);
+      serial_printf("WARNING: cannot map %#" PRIx64 " write-combining\n", p);
+      serial_set_colour(col);
+    }
   }
 
-  return ret;
+  sched_disable_preemption();
+
+  /* when the range covers a large page, align the virtual range like
+     the physical one, so that large pages can be used */
+  void *vaddr = 0;
+  if (num_pages >= large >> PAGE_BITS)
+    vaddr = perm_alloc(num_pages, start & (large - 1), large);
+  if (!vaddr)
+    vaddr = perm_alloc(num_pages, 0, 1 << PAGE_BITS);
+  if (!vaddr) {
+    sched_enable_preemption();
+    int col = serial_set_colour(SERIAL_COLOUR_ERR);
+    serial_printf("ERROR: out of permanent mappings\n");
+    serial_set_colour(col);
+    return 0;
+  }
+
+  for (size_t i = 0; i < num_pages; ) {
+    void *v = vaddr + (i << PAGE_BITS);
+    uint64_t q = start + ((uint64_t) i << PAGE_BITS);
+    if (((size_t) v & (large - 1)) == 0 && (q & (large - 1)) == 0 &&
+        num_pages - i >= large >> PAGE_BITS) {
+      ops.map_large(ops_data, v, q, entry_flags);
+      i += large >> PAGE_BITS;
+    }
+    else {
+      ops.map_page(ops_data, v, q, entry_flags);
+      i++;
+    }
+  }
+
+  sched_enable_preemption();
+
+#if PAGING_DEBUG
+  serial_printf("perm mapping: %#" PRIx64 " (%u pages) => %p\n",
+                p, (unsigned) num_pages, vaddr + offset);
+#endif
+  return vaddr + offset;
+}
+
+void paging_perm_unmap_pages(void *vaddr, size_t size)
+{
+  if (!ops.unmap) return;
+
+  size_t offset = (size_t) vaddr & ((1 << PAGE_BITS) - 1);
+  vaddr -= offset;
+  size_t num_pages = DIV_UP(size + offset, 1 << PAGE_BITS);
+  assert(vaddr >= KERNEL_VM_PERM_START &&
+         vaddr + (num_pages << PAGE_BITS) <= KERNEL_VM_PERM_END);
+
+  sched_disable_preemption();
+  for (size_t i = 0; i < num_pages; ) {
+    size_t unmapped = ops.unmap(ops_data, vaddr + (i << PAGE_BITS));
+    i += unmapped >> PAGE_BITS;
+  }
+  perm_release(vaddr, num_pages);
+  sched_enable_preemption();
 }
 
 int paging_init(uint64_t memory)
@@ -74,6 +320,10 @@ int paging_init(uint64_t memory)
     paging_legacy_init_ops(&ops);
     ops_data = &legacy;
   }
+  temp_init();
+  kernel_root = CR_GET(3);
+  kernel_tss.tss.cr3 = kernel_root;
+  cache_init();
 #endif
   return 0;
 }
@@ -15,7 +15,11 @@ typedef struct page {
 
 static inline void page_zero(page_t *page)
 {
-  memset(page, 0, sizeof(page_t));
+  uint32_t count = sizeof(page_t) / sizeof(uint32_t);
+  __asm__ volatile("rep stosl"
+                   : "+D"(page), "+c"(count)
+                   : "a"(0)
+                   : "memory");
 }
 
 /* kernel virtual memory is as follows:
@@ -23,6 +27,7 @@ static inline void page_zero(page_t *page)
   0 - 124 MB: identity mapping
   124 MB - 128 MB: temporary mappings
   128 MB - 256 MB: permanent mappings
+  256 MB - 384 MB: task stacks
 */
 #define KERNEL_VM_ID_START 0
 #define KERNEL_VM_ID_END ((void *)(124 * 1024 * 1024))
@@ -30,6 +35,8 @@ static inline void page_zero(page_t *page)
 #define KERNEL_VM_TEMP_END ((void *)(128 * 1024 * 1024))
 #define KERNEL_VM_PERM_START KERNEL_VM_TEMP_END
 #define KERNEL_VM_PERM_END ((void *)(256 * 1024 * 1024))
+#define KERNEL_VM_STACK_START KERNEL_VM_PERM_END
+#define KERNEL_VM_STACK_END ((void *)(384 * 1024 * 1024))
 
 enum {
   PT_ENTRY_PRESENT = 1 << 0,
@@ -50,21 +57,65 @@ enum {
 };
 
 typedef struct pg_ops {
-  void *(*map_temp)(void *data, uint64_t p);
-  void (*unmap_temp)(void *data, void *p);
-  void *(*map_perm)(void *data, uint64_t p);
+  /* set or clear the entry of a temporary mapping slot, without
+     invalidating the TLB */
+  void (*map_temp)(void *data, void *vaddr, uint64_t p);
+  void (*unmap_temp)(void *data, void *vaddr);
+  /* map a page or a large page at a given kernel virtual address,
+     adding the given entry flags */
+  void (*map_page)(void *data, void *vaddr, uint64_t p, uint16_t flags);
+  void (*map_large)(void *data, void *vaddr, uint64_t p, uint16_t flags);
+  /* remove the mapping at a virtual address, returning its size */
+  size_t (*unmap)(void *data, void *vaddr);
+  /* physical address mapped at vaddr, returns -1 if not mapped */
+  int (*lookup)(void *data, void *vaddr, uint64_t *p);
   uint64_t (*max_memory)(void *data);
+  unsigned int large_page_bits;
+  /* number of usable temporary mapping slots */
+  unsigned int temp_pages;
 } pg_ops_t;
 
 extern int paging_type;
 
-void *paging_perm_map_pages(uint64_t p, size_t size);
+/* flags for permanent mappings */
+enum {
+  PAGING_MAP_WC = 1 << 0, /* write-combining */
+};
 
+/* map a physical memory range into the permanent area, using large
+   pages where alignment allows */
+void *paging_perm_map_pages(uint64_t p, size_t size);
+void *paging_perm_map_pages_flags(uint64_t p, size_t size, unsigned flags);
+/* unmap a range returned by paging_perm_map_pages, so that its
+   virtual addresses can be reused */
+void paging_perm_unmap_pages(void *vaddr, size_t size);
+
+/* Map or unmap a single page at a kernel virtual address. No locking
+   is done, and the page table covering vaddr must already exist when
+   called from the page fault handler. */
+void paging_map_page(void *vaddr, uint64_t p);
+void paging_unmap_page(void *vaddr);
+int paging_lookup(void *vaddr, uint64_t *p);
+
+/* Temporary mappings of single pages. Unmapped slots are not
+   invalidated individually: they are only reused after a TLB flush,
+   which happens once the clean slots run out. */
 void *paging_temp_map_page(uint64_t p);
 void paging_temp_unmap_page(void * p);
+/* map n physical pages at once, storing their addresses in ptrs */
+void paging_temp_map_pages(const uint64_t *ps, unsigned n, void **ptrs);
+void paging_temp_unmap_batch(void **ptrs, unsigned n);
 
 int paging_init(uint64_t memory);
 
+/* Address space switching. Kernel mappings, except for temporary
+   ones, are marked global, so they stay in the TLB across switches. */
+void paging_switch(uint32_t root);
+uint32_t paging_kernel_root(void);
+/* flush non-global TLB entries, or all of them */
+void paging_flush_tlb(void);
+void paging_flush_tlb_global(void);
+
 uint64_t paging_maximum_memory();
 
 #endif /* PAGING_H */
@@ -5,6 +5,7 @@
 #include "drivers/ata/ata.h"
 #include "kmalloc.h"
 #include "pci.h"
+#include "slab.h"
 
 #define PCI_CONF_ADDR 0xcf8
 #define PCI_CONF_DATA 0xcfc
@@ -100,6 +101,8 @@ void pci_write(uint8_t bus, uint8_t device,
   outl(PCI_CONF_DATA, value);
 }
 
+static kmem_cache_t *device_cache = 0;
+
 list_t *pci_check_function(uint8_t bus, uint8_t device, uint8_t func)
 {
   uint32_t cl = pci_read(bus, device, func, PCI_CLASS);
@@ -115,7 +118,9 @@ list_t *pci_check_function(uint8_t bus, uint8_t device, uint8_t func)
       uint32_t id = pci_read(bus, device, func, PCI_VENDOR_DEVICE);
       uint32_t irq = pci_read(bus, device, func, PCI_H0_IRQ);
       uint8_t prog_if = (cl >> 8) & 0xff;
-      device_t *dev = kmalloc(sizeof(device_t));
+      if (!device_cache)
+        device_cache = kmem_cache_create("device", sizeof(device_t), 0, 0);
+      device_t *dev = kmem_cache_alloc(device_cache);
       dev->bus = bus;
       dev->device = device;
       dev->func = func;
@@ -0,0 +1,113 @@
+#include "core/debug.h"
+#include "frames.h"
+#include "list.h"
+#include "memory.h"
+#include "pages.h"
+#include "paging/paging.h"
+#include "prezero.h"
+#include "scheduler.h"
+#include "semaphore.h"
+
+#include <string.h>
+
+#define PREZERO_DEBUG 0
+
+#if PREZERO_DEBUG
+# define TRACE(fmt, ...) serial_printf("[prezero] " fmt \
+                                       __VA_OPT__(,) __VA_ARGS__)
+#else
+# define TRACE(...) do {} while(0)
+#endif
+
+/* number of zeroed frames to keep around */
+#define PREZERO_FRAMES 4
+
+static int prezero_running = 0;
+static semaphore_t prezero_sem;
+/* set while a kick has not been picked up by the task yet, so that
+   the semaphore count stays bounded */
+static volatile int prezero_kicked = 0;
+
+/* zeroed frames, except for the list links */
+static list_t *prezero_frames = 0;
+static unsigned prezero_num_frames = 0;
+
+static inline size_t prezero_frame_size(void)
+{
+  return 1UL << kernel_frames.min_order;
+}
+
+static int prezero_needs_work(void)
+{
+  pages_stats_t stats;
+  pages_get_stats(&stats);
+  return prezero_num_frames < PREZERO_FRAMES ||
+    (stats.zeroed < PREZERO_PAGES && stats.zeroed < stats.free);
+}
+
+void prezero_kick(void)
+{
+  if (!prezero_running || prezero_kicked) return;
+  prezero_kicked = 1;
+  sem_signal(&prezero_sem);
+}
+
+void *prezero_take_frame(void)
+{
+  sched_disable_preemption();
+  list_t *item = list_pop(&prezero_frames);
+  if (item) prezero_num_frames--;
+  sched_enable_preemption();
+
+  if (!item) return 0;
+  if (prezero_num_frames < PREZERO_FRAMES / 2) prezero_kick();
+
+  memset(item, 0, sizeof(list_t));
+  return item;
+}
+
+/* add one zeroed frame to the pool */
+static int prezero_fill_frame(void)
+{
+  void *frame = falloc(prezero_frame_size());
+  if (!frame) return -1;
+  for (size_t offset = 0; offset < prezero_frame_size();
+       offset += sizeof(page_t)) {
+    page_zero(frame + offset);
+  }
+
+  sched_disable_preemption();
+  list_add(&prezero_frames, frame);
+  prezero_num_frames++;
+  sched_enable_preemption();
+  return 0;
+}
+
+static void prezero_task(void)
+{
+  while (1) {
+    while (prezero_needs_work()) {
+      if (prezero_num_frames < PREZERO_FRAMES) {
+        if (prezero_fill_frame() == -1) break;
+      }
+      else if (pages_zero_free(1) == 0) {
+        break;
+      }
+
+      /* let other tasks run */
+      sched_disable_preemption();
+      sched_yield();
+    }
+
+    TRACE("pools full\n");
+    sem_wait(&prezero_sem);
+    prezero_kicked = 0;
+  }
+}
+
+void prezero_start_background_task(void)
+{
+  sem_init(&prezero_sem, 0);
+  prezero_running = 1;
+  sched_spawn_task(prezero_task, "prezero", SCHED_PRIO_LOW);
+}
@@ -0,0 +1,25 @@
+#ifndef PREZERO_H
+#define PREZERO_H
+
+/* Background zeroing of free memory.
+
+   A kernel task keeps a pool of zeroed kernel frames of minimum order,
+   as well as the zeroed pool of the page allocator, topped up. It
+   yields after every frame or page it clears, so it only makes
+   progress when other tasks leave the CPU idle.
+*/
+
+/* number of zeroed pages the background task keeps in the page
+   allocator */
+#define PREZERO_PAGES 16
+
+void prezero_start_background_task(void);
+
+/* wake up the background task, if some pool is running low */
+void prezero_kick(void);
+
+/* take a zeroed kernel frame of minimum order from the pool, or return
+   null if the pool is empty */
+void *prezero_take_frame(void);
+
+#endif /* PREZERO_H */
@@ -0,0 +1,90 @@
+#ifndef RING_H
+#define RING_H
+
+#include <assert.h>
+
+/* Single producer, single consumer ring buffer.
+
+   A ring only manages indices into a caller provided array, whose size
+   must be a power of two. The head is only written by the producer and
+   the tail only by the consumer. Both are free running and are reduced
+   modulo the size when used as indices. So the producer can run in an
+   interrupt handler and the consumer in a task, without any locking.
+
+   Each side reserves a slot, accesses the element, then commits. The
+   commit publishes the index with release semantics, and the other side
+   loads it with acquire semantics. This means an element is never read
+   before it has been written, nor overwritten before it has been read.
+*/
+
+typedef struct ring {
+  unsigned head;
+  unsigned tail;
+  unsigned size;
+} ring_t;
+
+#define RING_INIT(n) ((ring_t) { .head = 0, .tail = 0, .size = (n) })
+
+static inline void ring_init(ring_t *ring, unsigned size)
+{
+  assert(size && (size & (size - 1)) == 0);
+  *ring = RING_INIT(size);
+}
+
+static inline unsigned ring_count(ring_t *ring)
+{
+  return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) -
+    __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+/* producer: index of the next free slot, or -1 if the ring is full */
+static inline int ring_push_slot(ring_t *ring)
+{
+  unsigned head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+  unsigned tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  if (head - tail == ring->size) return -1;
+  return head & (ring->size - 1);
+}
+
+/* producer: publish the slot returned by ring_push_slot */
+static inline void ring_push_commit(ring_t *ring)
+{
+  unsigned head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* consumer: index of the oldest element, or -1 if the ring is empty */
+static inline int ring_pop_slot(ring_t *ring)
+{
+  unsigned tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+  unsigned head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  if (head == tail) return -1;
+  return tail & (ring->size - 1);
+}
+
+/* consumer: release the slot returned by ring_pop_slot */
+static inline void ring_pop_commit(ring_t *ring)
+{
+  unsigned tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* copy a value into the ring, evaluates to 0 if the ring is full */
+#define RING_PUSH(ring, items, value) ({          \
+      int _slot = ring_push_slot(ring);           \
+      if (_slot != -1) {                          \
+        (items)[_slot] = (value);                 \
+        ring_push_commit(ring);                   \
+      }                                           \
+      _slot != -1; })
+
+/* copy a value out of the ring, evaluates to 0 if the ring is empty */
+#define RING_POP(ring, items, ptr) ({             \
+      int _slot = ring_pop_slot(ring);            \
+      if (_slot != -1) {                          \
+        *(ptr) = (items)[_slot];                  \
+        ring_pop_commit(ring);                    \
+      }                                           \
+      _slot != -1; })
+
+#endif /* RING_H */
@@ -1,4 +1,5 @@
 #include "atomic.h"
+#include "clock.h"
 #include "core/debug.h"
 #include "core/gdt.h"
 #include "core/interrupts.h"
@@ -6,7 +7,10 @@
 #include "kmalloc.h"
 #include "memory.h"
 #include "scheduler.h"
+#include "slab.h"
+#include "stacks.h"
 #include "timer.h"
+#include "work.h"
 
 #include <assert.h>
 
@@ -18,14 +22,101 @@
 #endif
 
 #define SCHED_QUANTUM 20
+#define SCHED_TRACE_SIZE 256
+
+/* one queue per priority level, and a bitmap of the non-empty ones */
+static list_t *sched_runqueue[SCHED_NUM_PRIORITIES];
+static volatile uint32_t sched_ready = 0;
+/* set when a task with a higher priority than the current one wakes */
+static volatile int sched_resched = 0;
 
-list_t *sched_runqueue = 0;
 task_t *sched_current = 0;
+static kmem_cache_t *task_cache = 0;
+
+/* Terminated tasks. Their stacks and structures are released by a
+   work item, since freeing memory takes the preemption lock, which
+   must not happen inside the scheduler. */
+static list_t *sched_dead = 0;
+static void sched_reap(void *data);
+static work_t sched_reaper = WORK_INIT(sched_reap, 0);
+
+/* all tasks, and accounting data */
+static list_t *sched_tasks = 0;
+static unsigned sched_next_id = 1;
+static sched_stats_t sched_stats;
+static uint64_t sched_switch_ns = 0;
+
+/* the most recent switch events, overwritten in a circle */
+static sched_trace_event_t sched_trace[SCHED_TRACE_SIZE];
+static unsigned sched_trace_count = 0;
 
 /* when this is set the current task cannot be preempted, and it has
 exclusive access to scheduler data structures */
 volatile int sched_locked = 1;
 
+static void runqueue_add(task_t *task)
+{
+  task->ready_ns = clock_ns();
+  list_add(&sched_runqueue[task->priority], &task->head);
+  sched_ready |= 1 << task->priority;
+}
+
+/* put a preempted task back at the front of its queue */
+static void runqueue_push(task_t *task)
+{
+  task->ready_ns = clock_ns();
+  list_push(&sched_runqueue[task->priority], &task->head);
+  sched_ready |= 1 << task->priority;
+}
+
+/* take the first task of the highest priority non-empty queue */
+static task_t *runqueue_pop(void)
+{
+  if (!sched_ready) return 0;
+  int priority = __builtin_ctz(sched_ready);
+  list_t *item = list_pop(&sched_runqueue[priority]);
+  if (!sched_runqueue[priority])
+    sched_ready &= ~(1 << priority);
+  return TASK_LIST_ENTRY(item);
+}
+
+/* charge the time since the last switch to the previous task, and
+   record the switch */
+static void sched_account(task_t *previous, task_t *next, int reason)
+{
+  uint64_t now = clock_ns();
+  /* the time before the first switch is spent initialising */
+  uint64_t elapsed = sched_stats.switches ? now - sched_switch_ns : 0;
+  sched_switch_ns = now;
+
+  if (previous) {
+    previous->stats.run_ns += elapsed;
+    if (reason < SCHED_SWITCH_QUANTUM)
+      previous->stats.voluntary++;
+    else
+      previous->stats.involuntary++;
+  }
+  else {
+    sched_stats.idle_ns += elapsed;
+  }
+
+  if (next) {
+    next->stats.switches++;
+    uint64_t wait = now - next->ready_ns;
+    if (wait > next->stats.max_wait_ns)
+      next->stats.max_wait_ns = wait;
+  }
+
+  sched_stats.switches++;
+  sched_trace[sched_trace_count % SCHED_TRACE_SIZE] = (sched_trace_event_t) {
+    .time_ns = now,
+    .from = previous ? previous->id : 0,
+    .to = next ? next->id : 0,
+    .reason = reason,
+  };
+  sched_trace_count++;
+}
+
 static void context_switch(isr_stack_t *stack)
 {
   __asm__ volatile
@@ -36,6 +127,23 @@ static void context_switch(isr_stack_t *stack)
      : : "m"(stack));
 }
 
+/* Wait for a task to become runnable. This never returns: once the
+   runqueue is not empty, a nested call to the scheduler switches to
+   the next task, abandoning the idle frame. */
+static void sched_idle(void)
+{
+  while (!sched_ready) {
+    /* no ticks are needed until the next timer expires */
+    timer_tickless(0);
+    __asm__ volatile("sti\n"
+                     "hlt\n"
+                     "cli\n");
+  }
+
+  timer_tickless_exit();
+  syscall_yield();
+}
+
 void sched_schedule(isr_stack_t *stack)
 {
   /* no task switch if the scheduler is locked */
@@ -44,47 +152,92 @@ void sched_schedule(isr_stack_t *stack)
 
   /* TODO: take the lock and reenable interrupts */
 
+  int preempted = sched_resched;
+  sched_resched = 0;
   unsigned long ticks = timer_get_tick();
 
   /* do nothing if the task still has time left */
   if (sched_current &&
       sched_current->state == TASK_RUNNING &&
-      sched_current->timeout > ticks) return;
+      sched_current->timeout > ticks) {
+    if (!sched_ready) timer_tickless(sched_current->timeout);
+    return;
+  }
 
   /* put task back into runqueue */
+  int reason = SCHED_SWITCH_IDLE;
   if (sched_current) {
     sched_current->stack = stack;
     if (sched_current->state == TASK_RUNNING) {
-      list_add(&sched_runqueue, &sched_current->head);
+      if (preempted)
+        reason = SCHED_SWITCH_PREEMPT;
+      else if (stack->int_num == IDT_SYSCALL)
+        reason = SCHED_SWITCH_YIELD;
+      else
+        reason = SCHED_SWITCH_QUANTUM;
+
+      if (preempted)
+        runqueue_push(sched_current);
+      else
+        runqueue_add(sched_current);
     }
     else if (sched_current->state == TASK_TERMINATED) {
-      ffree(sched_current->stack_top);
+      reason = SCHED_SWITCH_EXIT;
+      /* we are still running on the stack of the terminated task, but
+         the reaper only runs after switching to a worker */
+      list_take(&sched_tasks, &sched_current->all);
+      list_add(&sched_dead, &sched_current->head);
+      work_schedule(&sched_reaper);
+    }
+    else {
+      reason = SCHED_SWITCH_WAIT;
     }
   }
 
   /* update current task */
   task_t *previous = sched_current;
-  sched_current = TASK_LIST_ENTRY(list_pop(&sched_runqueue));
+  sched_current = runqueue_pop();
 
   /* same task, no switch necessary */
-  if (sched_current == previous) return;
-
-  if (previous || sched_current) {
-    TRACE("switch %p => %p\n", previous, sched_current);
+  if (sched_current == previous) {
+    if (sched_current) {
+      sched_current->timeout = ticks + SCHED_QUANTUM;
+      timer_tickless(sched_current->timeout);
+    }
+    return;
   }
 
+  TRACE("switch %p => %p\n", previous, sched_current);
+  sched_account(previous, sched_current, reason);
+
   if (!sched_current) {
     /* no more tasks, idle */
-    sti();
-    hang_system();
+    sched_idle();
     return;
   }
 
   /* do context switch */
   sched_current->timeout = ticks + SCHED_QUANTUM;
+  if (!sched_ready) timer_tickless(sched_current->timeout);
   context_switch(sched_current->stack);
 }
 
+static void sched_reap(void *data)
+{
+  while (1) {
+    uint32_t flags = cpu_flags();
+    cli();
+    list_t *item = list_pop(&sched_dead);
+    if (flags & EFLAGS_IF) sti();
+    if (!item) break;
+
+    task_t *task = TASK_LIST_ENTRY(item);
+    TRACE("reaping %p\n", task);
+    stack_free(task->stack_top);
+    kmem_cache_free(task_cache, task);
+  }
+}
+
 void task_terminate()
 {
   TRACE("task %p terminating\n", sched_current);
@@ -93,15 +246,43 @@ void task_terminate()
   sched_yield();
 }
 
-void sched_spawn_task(task_entry_t entry)
+void sched_wake(task_t *task)
+{
+  task->state = TASK_RUNNING;
+
+  /* the task might not have yielded yet */
+  if (task == sched_current) return;
+
+  runqueue_add(task);
+  if (sched_current && task->priority < sched_current->priority) {
+    sched_current->timeout = 0;
+    sched_resched = 1;
+  }
+}
+
+void sched_preempt(isr_stack_t *stack)
 {
+  if (sched_resched) sched_schedule(stack);
+}
+
+void sched_spawn_task(task_entry_t entry, const char *name, int priority)
+{
+  assert(priority >= 0 && priority < SCHED_NUM_PRIORITIES);
+
   sched_disable_preemption();
 
   /* allocate memory for the task */
-  task_t *task = kmalloc(sizeof(task_t));
-  task->stack_top = falloc(0x4000);
+  if (!task_cache)
+    task_cache = kmem_cache_create("task", sizeof(task_t), 0, 0);
+  task_t *task = kmem_cache_alloc(task_cache);
+  task->stack_top = stack_alloc();
+  if (!task->stack_top) {
+    kmem_cache_free(task_cache, task);
+    sched_enable_preemption();
+    return;
+  }
 
-  void *stack = task->stack_top + 0x4000;
+  void *stack = task->stack_top + STACK_SIZE;
 
   /* add space for final return address */
   stack -= sizeof(void *);
@@ -113,14 +294,18 @@ void sched_spawn_task(task_entry_t entry)
   /* set isr stack frame */
   stack -= sizeof(isr_stack_t);
   task->stack = stack;
-  task->state = TASK_RUNNING;
+  task->priority = priority;
   task->timeout = timer_get_tick(); /* start immediately */
+  task->id = sched_next_id++;
+  task->name = name;
+  task->stats = (task_stats_t) { 0 };
+  list_add(&sched_tasks, &task->all);
 
   task->stack->eip = (uint32_t) entry;
   task->stack->cs = GDT_SEL(GDT_CODE);
   task->stack->eflags = EFLAGS_IF;
 
-  list_add(&sched_runqueue, &task->head);
+  sched_wake(task);
   TRACE("spawned %p\n", task);
 
   sched_enable_preemption();
@@ -131,6 +316,8 @@ void sched_enable_preemption(void)
   assert(sched_locked);
   cli();
   sched_locked--;
+  /* a higher priority task was woken while preemption was disabled */
+  if (!sched_locked && sched_resched) syscall_yield();
   sti();
 }
 
@@ -152,3 +339,52 @@ void sched_yield(void)
   syscall_yield();
   sti();
 }
+
+void sched_get_stats(sched_stats_t *stats)
+{
+  sched_disable_preemption();
+  *stats = sched_stats;
+  sched_enable_preemption();
+}
+
+unsigned sched_get_tasks(sched_task_info_t *tasks, unsigned max)
+{
+  unsigned count = 0;
+
+  sched_disable_preemption();
+  list_t *item = sched_tasks;
+  if (item) {
+    do {
+      task_t *task = LIST_ENTRY(item, task_t, all);
+      if (count < max) {
+        tasks[count] = (sched_task_info_t) {
+          .id = task->id,
+          .name = task->name,
+          .priority = task->priority,
+          .state = task->state,
+          .stats = task->stats,
+        };
+      }
+      count++;
+      item = item->next;
+    } while (item != sched_tasks);
+  }
+  sched_enable_preemption();
+
+  return count;
+}
+
+unsigned sched_trace_read(sched_trace_event_t *events, unsigned max)
+{
+  sched_disable_preemption();
+  unsigned n = sched_trace_count;
+  if (n > SCHED_TRACE_SIZE) n = SCHED_TRACE_SIZE;
+  if (n > max) n = max;
+  for (unsigned i = 0; i < n; i++) {
+    unsigned index = sched_trace_count - n + i;
+    events[i] = sched_trace[index % SCHED_TRACE_SIZE];
+  }
+  sched_enable_preemption();
+
+  return n;
+}
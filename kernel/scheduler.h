@@ -3,10 +3,25 @@
 
 #include "list.h"
 
+#include <stdint.h>
+
 struct isr_stack;
 
 typedef void (*task_entry_t)(void);
 
+typedef struct task_stats {
+  /* time spent running */
+  uint64_t run_ns;
+  /* longest time spent runnable before being switched in */
+  uint64_t max_wait_ns;
+  /* times the task has been switched in */
+  uint32_t switches;
+  /* times the task left the CPU by blocking, yielding or exiting, and
+     times it was preempted */
+  uint32_t voluntary;
+  uint32_t involuntary;
+} task_stats_t;
+
 typedef struct task {
   list_t head;
 
@@ -14,6 +29,16 @@ typedef struct task {
   void *stack_top;
   struct isr_stack *stack;
   int state;
+  int priority;
+
+  /* list of all tasks */
+  list_t all;
+  unsigned id;
+  const char *name;
+
+  /* time the task last became runnable */
+  uint64_t ready_ns;
+  task_stats_t stats;
 } task_t;
 
 #define TASK_LIST_ENTRY(item) LIST_ENTRY(item, task_t, head)
@@ -25,14 +50,73 @@ enum {
   TASK_TERMINATED,
 };
 
+/* Priorities, from the most urgent. Runnable tasks of a level only
+   run when all higher levels are empty, and tasks of the same level
+   share the CPU round robin. */
+enum {
+  SCHED_PRIO_IRQ,     /* deferred interrupt work */
+  SCHED_PRIO_HIGH,
+  SCHED_PRIO_NORMAL,
+  SCHED_PRIO_LOW,     /* background work */
+  SCHED_NUM_PRIORITIES,
+};
+
 extern task_t *sched_current;
-extern list_t *sched_runqueue;
 
 void sched_schedule(struct isr_stack *stack);
-void sched_spawn_task(task_entry_t entry);
+void sched_spawn_task(task_entry_t entry, const char *name, int priority);
 void sched_yield(void);
 
+/* Make a waiting task runnable. If it has a higher priority than the
+   current task, the current task is preempted at the end of the
+   interrupt handler, or when preemption is enabled again. This can be
+   called from interrupt handlers. */
+void sched_wake(task_t *task);
+/* switch task if a higher priority task has been woken, called at the
+   end of interrupt handlers */
+void sched_preempt(struct isr_stack *stack);
+
 void sched_disable_preemption();
 void sched_enable_preemption();
 
+/* Accounting. Task 0 stands for the idle loop in the switch trace. */
+
+/* why a task left the CPU */
+enum {
+  SCHED_SWITCH_WAIT,
+  SCHED_SWITCH_YIELD,
+  SCHED_SWITCH_EXIT,
+  SCHED_SWITCH_QUANTUM,
+  SCHED_SWITCH_PREEMPT,
+  SCHED_SWITCH_IDLE,
+};
+
+typedef struct sched_trace_event {
+  uint64_t time_ns;
+  uint16_t from;
+  uint16_t to;
+  uint8_t reason;
+} sched_trace_event_t;
+
+typedef struct sched_task_info {
+  unsigned id;
+  const char *name;
+  int priority;
+  int state;
+  task_stats_t stats;
+} sched_task_info_t;
+
+typedef struct sched_stats {
+  uint32_t switches;
+  uint64_t idle_ns;
+} sched_stats_t;
+
+void sched_get_stats(sched_stats_t *stats);
+/* copy information about up to max tasks, and return the number of
+   tasks */
+unsigned sched_get_tasks(sched_task_info_t *tasks, unsigned max);
+/* copy up to max of the most recent switch events, oldest first, and
+   return the number of events copied */
+unsigned sched_trace_read(sched_trace_event_t *events, unsigned max);
+
 #endif /* SCHEDULER_H */
@@ -1,6 +1,11 @@
+#include "atomic.h"
 #include "core/debug.h"
+#include "core/x86.h"
 #include "scheduler.h"
 #include "semaphore.h"
+#include "timer.h"
+
+#include <assert.h>
 
 #define SEMAPHORE_DEBUG 0
 #if SEMAPHORE_DEBUG
@@ -26,21 +31,89 @@ void sem_init(semaphore_t *sem, int value)
   sem->waiting = 0;
 }
 
+/* The waiting list and the value are also updated by timeout callbacks
+   in interrupt context, so interrupts are disabled around every change
+   to them. */
+
 void sem_wait(semaphore_t *sem)
 {
   spin_lock(&sem->lock);
+  uint32_t flags = cpu_flags();
+  cli();
 
   if (--sem->value < 0) {
     TRACE("%p: %p sleeping\n", sem, sched_current);
     sched_current->state = TASK_WAITING;
     list_add(&sem->waiting, &sched_current->head);
+    if (flags & EFLAGS_IF) sti();
     spin_unlock(&sem->lock);
     sched_disable_preemption();
     sched_yield();
   }
   else {
+    if (flags & EFLAGS_IF) sti();
+    spin_unlock(&sem->lock);
+  }
+}
+
+typedef struct sem_waiter {
+  semaphore_t *sem;
+  task_t *task;
+  int timed_out;
+} sem_waiter_t;
+
+/* timer callback: give up waiting, unless the semaphore has already
+   been signalled */
+static void sem_timeout(void *data)
+{
+  sem_waiter_t *waiter = data;
+  if (waiter->task->state != TASK_WAITING) return;
+
+  TRACE("%p: %p timed out\n", waiter->sem, waiter->task);
+  list_take(&waiter->sem->waiting, &waiter->task->head);
+  waiter->sem->value++;
+  waiter->timed_out = 1;
+  sched_wake(waiter->task);
+}
+
+int sem_wait_timeout(semaphore_t *sem, unsigned long ticks)
+{
+  spin_lock(&sem->lock);
+  uint32_t flags = cpu_flags();
+  cli();
+
+  if (--sem->value >= 0) {
+    if (flags & EFLAGS_IF) sti();
     spin_unlock(&sem->lock);
+    return 0;
   }
+
+  TRACE("%p: %p sleeping for %lu ticks\n", sem, sched_current, ticks);
+  sem_waiter_t waiter = { sem, sched_current, 0 };
+  timer_event_t event = TIMER_EVENT_INIT;
+  sched_current->state = TASK_WAITING;
+  list_add(&sem->waiting, &sched_current->head);
+  if (flags & EFLAGS_IF) sti();
+  /* the timer lock turns interrupts back on, so the timer is only armed
+     once the task is on the waiting list */
+  timer_add(&event, sem_timeout, &waiter, ticks);
+  spin_unlock(&sem->lock);
+  sched_disable_preemption();
+  sched_yield();
+
+  timer_cancel(&event);
+  return waiter.timed_out ? -1 : 0;
+}
+
+void sem_reset(semaphore_t *sem, int value)
+{
+  spin_lock(&sem->lock);
+  uint32_t flags = cpu_flags();
+  cli();
+  assert(!sem->waiting);
+  sem->value = value;
+  if (flags & EFLAGS_IF) sti();
+  spin_unlock(&sem->lock);
 }
 
 void _sem_signal(semaphore_t *sem)
@@ -48,14 +121,16 @@ void _sem_signal(semaphore_t *sem)
   if (sem->value++ < 0 && sem->waiting) {
     TRACE("%p: %p waking %p\n", sem, sched_current, sem->waiting);
     task_t *task = TASK_LIST_ENTRY(list_pop(&sem->waiting));
-    task->state = TASK_RUNNING;
-    list_add(&sched_runqueue, &task->head);
+    sched_wake(task);
   }
 }
 
 void sem_signal(semaphore_t *sem)
 {
   spin_lock(&sem->lock);
+  uint32_t flags = cpu_flags();
+  cli();
   _sem_signal(sem);
+  if (flags & EFLAGS_IF) sti();
   spin_unlock(&sem->lock);
 }
@@ -20,8 +20,13 @@ typedef struct semaphore {
 
 void sem_init(semaphore_t *sem, int value);
 void sem_wait(semaphore_t *sem);
+/* wait for at most the given number of ticks, returns -1 on timeout */
+int sem_wait_timeout(semaphore_t *sem, unsigned long ticks);
 void sem_signal(semaphore_t *sem);
 
+/* set the value of a semaphore that has no waiters */
+void sem_reset(semaphore_t *sem, int value);
+
 /* signal semaphore without disabling preemption */
 void _sem_signal(semaphore_t *sem);
 
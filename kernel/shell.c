@@ -1,3 +1,5 @@
+#include "bcache.h"
+#include "clock.h"
 #include "console/console.h"
 #include "core/debug.h"
 #include "core/x86.h"
@@ -5,11 +7,18 @@
 #include "drivers/ata/ata.h"
 #include "drivers/keyboard/keyboard.h"
 #include "frames.h"
+#include "heap.h"
 #include "kmalloc.h"
 #include "memory.h"
+#include "pages.h"
+#include "scheduler.h"
 #include "semaphore.h"
+#include "slab.h"
+#include "stacks.h"
 #include "timer.h"
+#include "work.h"
 
+#include <math.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
@@ -25,6 +34,94 @@ typedef struct shell {
   size_t input_len;
 } shell_t;
 
+#define SHELL_MAX_TASKS 32
+#define SHELL_TRACE_EVENTS 20
+
+static uint64_t ns_to_us(uint64_t ns)
+{
+  return div64sd(ns, 1000);
+}
+
+/* part / total as a percentage, without 64 bit divisions */
+static unsigned percent(uint64_t part, uint64_t total)
+{
+  while (total >= 0xffff) {
+    part >>= 1;
+    total >>= 1;
+  }
+  return total ? div64sd(part * 100, total) : 0;
+}
+
+static void shell_print_tasks(void)
+{
+  sched_task_info_t tasks[SHELL_MAX_TASKS];
+  unsigned count = sched_get_tasks(tasks, SHELL_MAX_TASKS);
+  unsigned shown = count < SHELL_MAX_TASKS ? count : SHELL_MAX_TASKS;
+
+  sched_stats_t stats;
+  sched_get_stats(&stats);
+
+  uint64_t total = stats.idle_ns;
+  for (unsigned i = 0; i < shown; i++)
+    total += tasks[i].stats.run_ns;
+
+  kprintf("tasks: %u, switches: %u, idle: %llu ms (%u%%)\n",
+          count, stats.switches, ns_to_us(ns_to_us(stats.idle_ns)),
+          percent(stats.idle_ns, total));
+  kprintf("  id pri st     cpu ms  cpu%%  switches    vol  invol  "
+          "max wait us  name\n");
+  for (unsigned i = 0; i < shown; i++) {
+    sched_task_info_t *task = &tasks[i];
+    kprintf("%4u %3d  %c %10llu %4u%% %9u %6u %6u %12llu  %s\n",
+            task->id, task->priority, "RSWT"[task->state],
+            ns_to_us(ns_to_us(task->stats.run_ns)),
+            percent(task->stats.run_ns, total),
+            task->stats.switches, task->stats.voluntary,
+            task->stats.involuntary, ns_to_us(task->stats.max_wait_ns),
+            task->name);
+  }
+  if (shown < count)
+    kprintf("  ... and %u more\n", count - shown);
+}
+
+static void shell_print_trace(void)
+{
+  static const char *reasons[] = {
+    [SCHED_SWITCH_WAIT] = "wait",
+    [SCHED_SWITCH_YIELD] = "yield",
+    [SCHED_SWITCH_EXIT] = "exit",
+    [SCHED_SWITCH_QUANTUM] = "quantum",
+    [SCHED_SWITCH_PREEMPT] = "preempt",
+    [SCHED_SWITCH_IDLE] = "idle",
+  };
+
+  sched_trace_event_t events[SHELL_TRACE_EVENTS];
+  unsigned n = sched_trace_read(events, SHELL_TRACE_EVENTS);
+  for (unsigned i = 0; i < n; i++) {
+    kprintf("%12llu us  %4u -> %4u  %s\n",
+            ns_to_us(events[i].time_ns), events[i].from, events[i].to,
+            reasons[events[i].reason]);
+  }
+}
+
+static void shell_print_frames_stats(const char *name, frames_t *frames)
+{
+  if (!frames->metadata) return;
+
+  frames_stats_t stats;
+  frames_get_stats(frames, &stats);
+  kprintf("%s: free %u kB, largest %u kB, allocs %u, frees %u, failed %u\n",
+          name, (unsigned) (stats.free_bytes >> 10),
+          (unsigned) (stats.largest_free >> 10),
+          stats.allocs, stats.frees, stats.failed);
+  kprintf("  free blocks:");
+  for (unsigned k = frames->min_order; k <= frames->max_order; k++) {
+    uint32_t n = stats.free_blocks[k - frames->min_order];
+    if (n) kprintf(" %u:%u", k, n);
+  }
+  kprintf("\n");
+}
+
 void shell_process_command(shell_t *shell)
 {
   if (shell->input_len == 0) return;
@@ -39,8 +136,16 @@ void shell_process_command(shell_t *shell)
             "  reboot       reboot machine\n"
             "  poweroff     poweroff via BIOS call\n"
             "  ticks        number of milliseconds since boot\n"
+            "  uptime       time since boot\n"
+            "  clock        clock source and current time in ns\n"
             "  drives       list detected drives\n"
+            "  cache        block cache statistics\n"
+            "  slabs        object cache statistics\n"
             "  memory       memory information (kernel, dma, user)\n"
+            "  memstat      allocator statistics\n"
+            "  repaint      console repaint timing\n"
+            "  work         deferred work statistics\n"
+            "  top [trace]  CPU usage per task, or recent task switches\n"
             "  cpuid        CPU information\n");
   }
   else if (!strcmp("reboot", cmd)) {
@@ -53,9 +158,32 @@ void shell_process_command(shell_t *shell)
     uint32_t tick = timer_get_tick();
     kprintf("%u\n", tick);
   }
+  else if (!strcmp("uptime", cmd)) {
+    uint64_t us = div64sd(clock_ns(), 1000);
+    uint64_t ms = div64sd(us, 1000);
+    kprintf("up %llu.%06llu s\n", div64sd(ms, 1000),
+            mod64sd(ms, 1000) * 1000 + mod64sd(us, 1000));
+  }
+  else if (!strcmp("clock", cmd)) {
+    if (clock_source() == CLOCK_SOURCE_TSC)
+      kprintf("source: tsc, %u kHz\n", clock_tsc_khz());
+    else
+      kprintf("source: ticks\n");
+    kprintf("%llu ns\n", clock_ns());
+  }
   else if (!strcmp("drives", cmd)) {
     ata_list_drives();
   }
+  else if (!strcmp("cache", cmd)) {
+    bcache_stats_t stats;
+    bcache_get_stats(&stats);
+    kprintf("blocks: %u / %u, hits: %u, misses: %u, evictions: %u\n",
+            stats.blocks, stats.max_blocks,
+            stats.hits, stats.misses, stats.evictions);
+  }
+  else if (!strcmp("slabs", cmd)) {
+    kmem_cache_dump_diagnostics();
+  }
   else if (!strcmp("memory", cmd)) {
     const char *ty = strtok_r(0, " ", &saveptr);
     if (!ty || strlen(ty) == 0 || !strcmp(ty, "kernel")) {
@@ -73,6 +201,47 @@ void shell_process_command(shell_t *shell)
       console_reset_fg();
     }
   }
+  else if (!strcmp("memstat", cmd)) {
+    shell_print_frames_stats("kernel", &kernel_frames);
+    shell_print_frames_stats("dma", &dma_frames);
+    shell_print_frames_stats("user", &user_frames);
+
+    heap_stats_t stats;
+    kmalloc_get_stats(&stats);
+    kprintf("kmalloc: in use %u kB of %u kB, largest free >= %u B, "
+            "allocs %u, frees %u, failed %u\n",
+            (unsigned) (stats.in_use >> 10), (unsigned) (stats.reserved >> 10),
+            (unsigned) stats.largest_free,
+            stats.allocs, stats.frees, stats.failed);
+
+    pages_stats_t pstats;
+    pages_get_stats(&pstats);
+    kprintf("pages: chunks %u, free %u, zeroed %u\n",
+            pstats.chunks, pstats.free, pstats.zeroed);
+
+    stacks_stats_t sstats;
+    stacks_get_stats(&sstats);
+    kprintf("stacks: %u, committed %u pages, reserve %u\n",
+            sstats.stacks, sstats.committed, sstats.reserve);
+  }
+  else if (!strcmp("repaint", cmd)) {
+    kprintf("repaints: %lu, total %lu ms, max %lu ms\n",
+            console.repaints, console.repaint_ticks,
+            console.max_repaint_ticks);
+  }
+  else if (!strcmp("work", cmd)) {
+    work_stats_t stats;
+    work_get_stats(&stats);
+    kprintf("scheduled: %u, coalesced: %u, runs: %u, batches: %u\n",
+            stats.scheduled, stats.coalesced, stats.runs, stats.batches);
+  }
+  else if (!strcmp("top", cmd)) {
+    const char *arg = strtok_r(0, " ", &saveptr);
+    if (arg && !strcmp(arg, "trace"))
+      shell_print_trace();
+    else
+      shell_print_tasks();
+  }
   else if (!strcmp("cpuid", cmd)) {
     if (cpuid_is_supported()) {
       char vendor[20];
@@ -0,0 +1,353 @@
+#if _HELIUM
+# include "core/debug.h"
+# include "scheduler.h"
+#else
+# include <stdio.h>
+# define serial_printf printf
+#endif
+
+#include "core/util.h"
+#include "frames.h"
+#include "memory.h"
+#include "slab.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SLAB_DEBUG 0
+
+#if SLAB_DEBUG
+# define TRACE(fmt, ...) serial_printf("[slab] " fmt \
+                                       __VA_OPT__(,) __VA_ARGS__)
+#else
+# define TRACE(...) do {} while(0)
+#endif
+
+/* slabs are grown until they contain at least this many objects, or
+   waste at most 1/2^SLAB_WASTE_SHIFT of their size */
+#define SLAB_MIN_OBJECTS 8
+#define SLAB_WASTE_SHIFT 3
+#define SLAB_NONE 0xffff
+
+/* Layout of a slab:
+
+     slab_t | free index array | padding | objects
+
+   The free index array links free objects together: next[i] is the
+   index of the free object following object i. */
+typedef struct slab {
+  list_t head;
+  uint16_t free;
+  uint16_t in_use;
+  uint16_t next[];
+} slab_t;
+
+static inline void *slab_object(kmem_cache_t *cache, slab_t *slab,
+                                unsigned index)
+{
+  return (void *) slab + cache->first_offset + index * cache->size;
+}
+
+static inline unsigned slab_object_index(kmem_cache_t *cache, slab_t *slab,
+                                         void *obj)
+{
+  return (obj - (void *) slab - cache->first_offset) / cache->size;
+}
+
+/* slabs are naturally aligned with respect to the beginning of the
+   frame allocator */
+static inline slab_t *slab_of(kmem_cache_t *cache, void *obj)
+{
+  size_t start = cache->frames->start;
+  size_t offset = ALIGN_BITS((size_t) obj - start, cache->slab_bits);
+  return (slab_t *) (start + offset);
+}
+
+static size_t slab_first_offset(size_t align, unsigned num)
+{
+  return ALIGN_UP(sizeof(slab_t) + num * sizeof(uint16_t), align);
+}
+
+static void kmem_cache_lock(kmem_cache_t *cache)
+{
+  if (cache->lock) cache->lock(cache);
+}
+
+static void kmem_cache_unlock(kmem_cache_t *cache)
+{
+  if (cache->unlock) cache->unlock(cache);
+}
+
+int kmem_cache_init(kmem_cache_t *cache, frames_t *frames,
+                    const char *name, size_t size, size_t align,
+                    void (*ctor)(void *obj))
+{
+  if (align < sizeof(void *)) align = sizeof(void *);
+  if (align & (align - 1)) return -1;
+  size = ALIGN_UP(size, align);
+
+  cache->name = name;
+  cache->frames = frames;
+  cache->ctor = ctor;
+  cache->size = size;
+  cache->align = align;
+  cache->partial = 0;
+  cache->full = 0;
+  cache->empty = 0;
+  cache->stats = (kmem_cache_stats_t) {0};
+  cache->lock = 0;
+  cache->unlock = 0;
+
+  /* find the smallest slab size fitting enough objects */
+  cache->slab_bits = frames->min_order;
+  if (cache->slab_bits < PAGE_BITS) cache->slab_bits = PAGE_BITS;
+  while (1) {
+    size_t slab_size = 1UL << cache->slab_bits;
+    unsigned num = (slab_size - sizeof(slab_t)) / (size + sizeof(uint16_t));
+    if (num >= SLAB_NONE) num = SLAB_NONE - 1;
+    while (num > 0 && slab_first_offset(align, num) + num * size > slab_size)
+      num--;
+
+    size_t waste = slab_size - slab_first_offset(align, num) - num * size;
+    if (num >= SLAB_MIN_OBJECTS ||
+        (num > 0 && waste <= slab_size >> SLAB_WASTE_SHIFT)) {
+      cache->objs_per_slab = num;
+      cache->first_offset = slab_first_offset(align, num);
+      break;
+    }
+    cache->slab_bits++;
+  }
+
+  TRACE("cache %s: size %lu, %u objects per slab of order %u\n",
+        name, (unsigned long) size, cache->objs_per_slab, cache->slab_bits);
+  return 0;
+}
+
+static void slab_init(kmem_cache_t *cache, slab_t *slab)
+{
+#if _HELIUM
+  assert((size_t) slab < KERNEL_MEMORY_END);
+#endif
+  assert(slab_of(cache, slab) == slab);
+
+  slab->in_use = 0;
+  slab->free = 0;
+  for (unsigned i = 0; i < cache->objs_per_slab; i++) {
+    slab->next[i] = i + 1 < cache->objs_per_slab ? i + 1 : SLAB_NONE;
+    if (cache->ctor) cache->ctor(slab_object(cache, slab, i));
+  }
+
+  cache->stats.slabs++;
+}
+
+static slab_t *kmem_cache_grow(kmem_cache_t *cache)
+{
+  slab_t *slab = (slab_t *) (size_t)
+    frames_alloc(cache->frames, 1UL << cache->slab_bits);
+  if (!slab) return 0;
+  slab_init(cache, slab);
+  return slab;
+}
+
+/* take an object from the first partial slab, which must exist */
+static void *kmem_cache_take(kmem_cache_t *cache)
+{
+  slab_t *slab = LIST_ENTRY(cache->partial, slab_t, head);
+  unsigned index = slab->free;
+  assert(index != SLAB_NONE);
+  slab->free = slab->next[index];
+  slab->in_use++;
+
+  if (slab->free == SLAB_NONE) {
+    list_take(&cache->partial, &slab->head);
+    list_add(&cache->full, &slab->head);
+  }
+
+  cache->stats.allocs++;
+  cache->stats.in_use++;
+  return slab_object(cache, slab, index);
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache)
+{
+  kmem_cache_lock(cache);
+
+  if (!cache->partial) {
+    list_t *item = list_pop(&cache->empty);
+    slab_t *slab = item ? LIST_ENTRY(item, slab_t, head) :
+      kmem_cache_grow(cache);
+    if (!slab) {
+      kmem_cache_unlock(cache);
+      return 0;
+    }
+    list_add(&cache->partial, &slab->head);
+  }
+
+  void *obj = kmem_cache_take(cache);
+
+  kmem_cache_unlock(cache);
+  return obj;
+}
+
+/* number of slabs requested from the frame allocator at once */
+#define SLAB_BULK_BATCH 8
+
+/* Allocate n objects at once. The slabs that are needed are requested
+   from the frame allocator in bulk, a batch at a time. Either all
+   objects are allocated, or none is. */
+int kmem_cache_alloc_bulk(kmem_cache_t *cache, unsigned n, void **objs)
+{
+  kmem_cache_lock(cache);
+
+  uint32_t available = cache->stats.slabs * cache->objs_per_slab -
+    cache->stats.in_use;
+  if (n > available) {
+    unsigned num_slabs = DIV_UP(n - available, cache->objs_per_slab);
+    uint64_t slabs[SLAB_BULK_BATCH];
+    for (unsigned done = 0; done < num_slabs; ) {
+      unsigned batch = num_slabs - done;
+      if (batch > SLAB_BULK_BATCH) batch = SLAB_BULK_BATCH;
+
+      if (frames_alloc_bulk(cache->frames, 1UL << cache->slab_bits,
+                            batch, slabs) == -1) {
+        /* release the slabs of the previous batches, which are at the
+           front of the empty list */
+        for (; done > 0; done--) {
+          list_t *item = list_pop(&cache->empty);
+          frames_free(cache->frames,
+                      (size_t) LIST_ENTRY(item, slab_t, head));
+          cache->stats.slabs--;
+        }
+        kmem_cache_unlock(cache);
+        return -1;
+      }
+
+      for (unsigned i = 0; i < batch; i++) {
+        slab_t *slab = (slab_t *) (size_t) slabs[i];
+        slab_init(cache, slab);
+        list_push(&cache->empty, &slab->head);
+      }
+      done += batch;
+    }
+  }
+
+  for (unsigned i = 0; i < n; i++) {
+    if (!cache->partial) {
+      list_t *item = list_pop(&cache->empty);
+      assert(item);
+      list_add(&cache->partial, item);
+    }
+    objs[i] = kmem_cache_take(cache);
+  }
+
+  kmem_cache_unlock(cache);
+  return 0;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj)
+{
+  if (!obj) return;
+
+  kmem_cache_lock(cache);
+
+  slab_t *slab = slab_of(cache, obj);
+  unsigned index = slab_object_index(cache, slab, obj);
+  assert(index < cache->objs_per_slab);
+  assert(slab_object(cache, slab, index) == obj);
+
+  if (slab->free == SLAB_NONE) {
+    list_take(&cache->full, &slab->head);
+    list_add(&cache->partial, &slab->head);
+  }
+  slab->next[index] = slab->free;
+  slab->free = index;
+  slab->in_use--;
+
+  if (slab->in_use == 0) {
+    list_take(&cache->partial, &slab->head);
+    if (cache->empty) {
+      /* keep at most one empty slab around */
+      frames_free(cache->frames, (size_t) slab);
+      cache->stats.slabs--;
+    }
+    else {
+      list_add(&cache->empty, &slab->head);
+    }
+  }
+
+  cache->stats.frees++;
+  cache->stats.in_use--;
+
+  kmem_cache_unlock(cache);
+}
+
+#if _HELIUM
+
+static list_t *kmem_caches = 0;
+static kmem_cache_t kmem_cache_cache;
+
+static void _lock_cache(kmem_cache_t *cache)
+{
+  sched_disable_preemption();
+}
+
+static void _unlock_cache(kmem_cache_t *cache)
+{
+  sched_enable_preemption();
+}
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align,
+                                void (*ctor)(void *obj))
+{
+  return kmem_cache_create_on(&kernel_frames, name, size, align, ctor);
+}
+
+kmem_cache_t *kmem_cache_create_on(frames_t *frames, const char *name,
+                                   size_t size, size_t align,
+                                   void (*ctor)(void *obj))
+{
+  sched_disable_preemption();
+
+  /* caches are themselves allocated from a cache */
+  if (!kmem_caches) {
+    kmem_cache_init(&kmem_cache_cache, &kernel_frames, "kmem_cache",
+                    sizeof(kmem_cache_t), 0, 0);
+    kmem_cache_cache.lock = _lock_cache;
+    kmem_cache_cache.unlock = _unlock_cache;
+    list_add(&kmem_caches, &kmem_cache_cache.head);
+  }
+
+  kmem_cache_t *cache = kmem_cache_alloc(&kmem_cache_cache);
+  if (cache) {
+    if (kmem_cache_init(cache, frames, name, size, align, ctor) == -1) {
+      kmem_cache_free(&kmem_cache_cache, cache);
+      cache = 0;
+    }
+    else {
+      cache->lock = _lock_cache;
+      cache->unlock = _unlock_cache;
+      list_add(&kmem_caches, &cache->head);
+    }
+  }
+
+  sched_enable_preemption();
+  return cache;
+}
+
+void kmem_cache_dump_diagnostics(void)
+{
+  /* caches are never destroyed, so the list can be walked without
+     locking */
+  list_t *item = kmem_caches;
+  if (item) do {
+    kmem_cache_t *cache = LIST_ENTRY(item, kmem_cache_t, head);
+    kprintf("%s: size %u, in use %u, slabs %u, allocs %u, frees %u\n",
+            cache->name, (unsigned) cache->size,
+            cache->stats.in_use, cache->stats.slabs,
+            cache->stats.allocs, cache->stats.frees);
+    item = item->next;
+  } while (item != kmem_caches);
+}
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include "list.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Object caches for fixed-size kernel objects.
+
+   Each cache obtains slabs from a frame allocator, and carves them
+   into objects of the same size. The free objects of a slab are
+   tracked in an index array placed after the slab header, so object
+   memory is never touched by the allocator. This means that objects
+   only need to be constructed once, when their slab is created, and
+   should be returned to the cache in their constructed state.
+*/
+
+struct frames;
+
+typedef struct kmem_cache_stats {
+  uint32_t allocs;
+  uint32_t frees;
+  /* slabs currently owned by the cache */
+  uint32_t slabs;
+  /* objects currently allocated */
+  uint32_t in_use;
+} kmem_cache_stats_t;
+
+typedef struct kmem_cache {
+  /* list of all caches */
+  list_t head;
+
+  const char *name;
+  struct frames *frames;
+  void (*ctor)(void *obj);
+
+  /* object size and alignment */
+  size_t size;
+  size_t align;
+  /* layout of a slab */
+  unsigned slab_bits;
+  unsigned objs_per_slab;
+  size_t first_offset;
+
+  /* slabs with some free objects, none, or only free ones */
+  list_t *partial;
+  list_t *full;
+  list_t *empty;
+
+  kmem_cache_stats_t stats;
+
+  void (*lock)(struct kmem_cache *cache);
+  void (*unlock)(struct kmem_cache *cache);
+} kmem_cache_t;
+
+int kmem_cache_init(kmem_cache_t *cache, struct frames *frames,
+                    const char *name, size_t size, size_t align,
+                    void (*ctor)(void *obj));
+void *kmem_cache_alloc(kmem_cache_t *cache);
+int kmem_cache_alloc_bulk(kmem_cache_t *cache, unsigned n, void **objs);
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+#if _HELIUM
+/* create a cache of objects allocated from kernel frames */
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align,
+                                void (*ctor)(void *obj));
+/* create a cache of objects allocated from the given frames */
+kmem_cache_t *kmem_cache_create_on(struct frames *frames, const char *name,
+                                   size_t size, size_t align,
+                                   void (*ctor)(void *obj));
+void kmem_cache_dump_diagnostics(void);
+#endif
+
+#endif /* SLAB_H */
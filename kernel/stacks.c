@@ -0,0 +1,217 @@
+#include "atomic.h"
+#include "bitset.h"
+#include "core/debug.h"
+#include "core/serial.h"
+#include "core/util.h"
+#include "core/x86.h"
+#include "memory.h"
+#include "pages.h"
+#include "paging/paging.h"
+#include "scheduler.h"
+#include "stacks.h"
+#include "work.h"
+
+#include <assert.h>
+
+#define STACKS_DEBUG 0
+
+#if STACKS_DEBUG
+# define TRACE(fmt, ...) serial_printf("[stacks] " fmt \
+                                       __VA_OPT__(,) __VA_ARGS__)
+#else
+# define TRACE(...) do {} while(0)
+#endif
+
+#define STACK_SLOTS ((128 * 1024 * 1024) >> STACK_SLOT_BITS) /* 256 MB - 384 MB */
+#define STACK_PAGES (STACK_SIZE >> PAGE_BITS)
+
+/* Pages handed out by the fault handler. The handler runs with
+   interrupts disabled and cannot take the scheduler lock, so it
+   cannot call into the page allocator: this reserve is refilled from
+   task context instead, whenever it drops below the low-water mark.
+   The fault handler can interrupt any code, so the reserve is only
+   updated with interrupts disabled. */
+#define STACKS_RESERVE 16
+#define STACKS_RESERVE_LOW 8
+
+static uint32_t stack_slots[STACK_SLOTS / 32];
+static unsigned stack_hint = 0;
+static void *stacks_reserve[STACKS_RESERVE];
+static volatile unsigned stacks_num_reserve = 0;
+static stacks_stats_t stacks_stats;
+
+static void stacks_refill_work(void *data);
+static work_t stacks_refill_item = WORK_INIT(stacks_refill_work, 0);
+
+static inline void *slot_base(unsigned slot)
+{
+  return KERNEL_VM_STACK_START + ((size_t) slot << STACK_SLOT_BITS);
+}
+
+static inline unsigned slot_of(void *addr)
+{
+  return (addr - KERNEL_VM_STACK_START) >> STACK_SLOT_BITS;
+}
+
+/* add a page to the reserve, returns -1 if the reserve is full */
+static int stacks_reserve_add(void *page)
+{
+  int ret = -1;
+  uint32_t flags = cpu_flags();
+  cli();
+  if (stacks_num_reserve < STACKS_RESERVE) {
+    stacks_reserve[stacks_num_reserve] = page;
+    stacks_num_reserve++;
+    ret = 0;
+  }
+  if (flags & EFLAGS_IF) sti();
+  return ret;
+}
+
+static void stacks_refill(void)
+{
+  while (stacks_num_reserve < STACKS_RESERVE) {
+    void *page = page_alloc();
+    if (!page) break;
+    if (stacks_reserve_add(page) == -1) {
+      page_free(page);
+      break;
+    }
+  }
+}
+
+static void stacks_refill_work(void *data)
+{
+  stacks_refill();
+}
+
+void stacks_check_reserve(void)
+{
+  if (stacks_num_reserve < STACKS_RESERVE_LOW)
+    work_schedule(&stacks_refill_item);
+}
+
+/* release a page that is no longer mapped */
+static void stacks_release_page(void *page)
+{
+  if (stacks_reserve_add(page) == -1)
+    page_free(page);
+}
+
+void *stack_alloc(void)
+{
+  sched_disable_preemption();
+
+  unsigned slot = stack_hint;
+  while (GET_BIT(stack_slots, slot)) {
+    slot = (slot + 1) % STACK_SLOTS;
+    if (slot == stack_hint) {
+      sched_enable_preemption();
+      int col = serial_set_colour(SERIAL_COLOUR_ERR);
+      serial_printf("ERROR: out of task stacks\n");
+      serial_set_colour(col);
+      return 0;
+    }
+  }
+
+  /* commit the top page, which also creates the page table that the
+     fault handler relies on */
+  void *page = page_alloc();
+  if (!page) {
+    sched_enable_preemption();
+    return 0;
+  }
+  SET_BIT(stack_slots, slot);
+  stack_hint = (slot + 1) % STACK_SLOTS;
+
+  void *stack = slot_base(slot) + (1 << PAGE_BITS);
+  paging_map_page(stack + STACK_SIZE - (1 << PAGE_BITS), (size_t) page);
+  uint32_t flags = cpu_flags();
+  cli();
+  stacks_stats.stacks++;
+  stacks_stats.committed++;
+  if (flags & EFLAGS_IF) sti();
+
+  stacks_refill();
+  sched_enable_preemption();
+
+  TRACE("new stack at %p\n", stack);
+  return stack;
+}
+
+void stack_free(void *stack)
+{
+  if (!stack) return;
+
+  unsigned slot = slot_of(stack);
+  assert(slot < STACK_SLOTS && GET_BIT(stack_slots, slot));
+  assert(stack == slot_base(slot) + (1 << PAGE_BITS));
+
+  sched_disable_preemption();
+  for (unsigned i = 0; i < STACK_PAGES; i++) {
+    void *vaddr = stack + (i << PAGE_BITS);
+    uint64_t p;
+    if (paging_lookup(vaddr, &p) == -1) continue;
+    paging_unmap_page(vaddr);
+    stacks_release_page((void *) (size_t) p);
+
+    uint32_t flags = cpu_flags();
+    cli();
+    stacks_stats.committed--;
+    if (flags & EFLAGS_IF) sti();
+  }
+  UNSET_BIT(stack_slots, slot);
+  uint32_t flags = cpu_flags();
+  cli();
+  stacks_stats.stacks--;
+  if (flags & EFLAGS_IF) sti();
+  sched_enable_preemption();
+
+  TRACE("freed stack at %p\n", stack);
+}
+
+int stack_contains(void *stack, void *addr)
+{
+  return addr >= stack - (1 << PAGE_BITS) && addr < stack + STACK_SIZE;
+}
+
+int stack_handle_fault(uint32_t addr, uint32_t error)
+{
+  void *vaddr = (void *) addr;
+  if (vaddr < KERNEL_VM_STACK_START || vaddr >= KERNEL_VM_STACK_END)
+    return -1;
+
+  unsigned slot = slot_of(vaddr);
+  if (!GET_BIT(stack_slots, slot)) return -1;
+
+  /* protection violations are never resolved here */
+  if (error & PT_ENTRY_PRESENT) return -1;
+
+  if (vaddr < slot_base(slot) + (1 << PAGE_BITS)) {
+    int col = serial_set_colour(SERIAL_COLOUR_ERR);
+    serial_printf("ERROR: stack overflow at %p\n", vaddr);
+    serial_set_colour(col);
+    return -1;
+  }
+
+  if (stacks_num_reserve == 0) {
+    int col = serial_set_colour(SERIAL_COLOUR_ERR);
+    serial_printf("ERROR: no pages left for task stacks\n");
+    serial_set_colour(col);
+    return -1;
+  }
+
+  void *page = stacks_reserve[--stacks_num_reserve];
+  paging_map_page(PAGE(addr), (size_t) page);
+  stacks_stats.committed++;
+  return 0;
+}
+
+void stacks_get_stats(stacks_stats_t *stats)
+{
+  uint32_t flags = cpu_flags();
+  cli();
+  *stats = stacks_stats;
+  stats->reserve = stacks_num_reserve;
+  if (flags & EFLAGS_IF) sti();
+}
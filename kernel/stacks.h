@@ -0,0 +1,40 @@
+#ifndef STACKS_H
+#define STACKS_H
+
+#include "memory.h"
+
+#include <stdint.h>
+
+/* Demand-paged task stacks.
+
+   Stacks live in their own region of kernel virtual memory, divided
+   into fixed-size slots. The lowest page of every slot is never
+   mapped, and acts as a guard page. Only the topmost page of a stack
+   is committed when it is allocated; the others are mapped by the
+   page fault handler the first time they are touched.
+*/
+
+#define STACK_SLOT_BITS 15
+#define STACK_SIZE ((1 << STACK_SLOT_BITS) - (1 << PAGE_BITS))
+
+typedef struct stacks_stats {
+  uint32_t stacks;
+  uint32_t committed;
+  uint32_t reserve;
+} stacks_stats_t;
+
+/* return the lowest usable address of a new stack, or 0 */
+void *stack_alloc(void);
+void stack_free(void *stack);
+int stack_contains(void *stack, void *addr);
+
+/* commit the page containing addr, returns -1 if addr is not in an
+   allocated stack */
+int stack_handle_fault(uint32_t addr, uint32_t error);
+/* schedule a refill of the page reserve of the fault handler if it is
+   running low; only call this where an interrupt handler could run */
+void stacks_check_reserve(void);
+
+void stacks_get_stats(stacks_stats_t *stats);
+
+#endif /* STACKS_H */
@@ -5,18 +5,36 @@
 #include "handlers.h"
 #include "scheduler.h"
 #include "timer.h"
+#include "wheel.h"
 
 #include <assert.h>
 
-#define PIT_FREQ 1193182
+#define PIT_TICK (PIT_FREQ / 1000)
+/* longest one-shot period the 16 bit counter can measure */
+#define TIMER_MAX_ONESHOT (0xffff / PIT_TICK)
+
+#define TIMER_DEBUG 0
+#if TIMER_DEBUG
+#define TRACE(...) serial_printf(__VA_ARGS__)
+#else
+#define TRACE(...) do {} while(0)
+#endif
 
 typedef struct {
   unsigned long count;
   unsigned long quantum;
+
+  /* ticks covered by the programmed one-shot period, 0 when the timer
+     is periodic */
+  unsigned long oneshot;
+  /* PIT counts programmed for the one-shot period, and counts of its
+     first tick that had already elapsed when it was programmed */
+  uint16_t oneshot_count;
+  uint16_t oneshot_phase;
 } timer_t;
 
 static timer_t timer;
-static list_t *waiting;
+static wheel_t timer_wheel;
 
 static int timer_waiting_locked = 0;
 
@@ -54,24 +72,124 @@ void timer_send_command(uint8_t cmd, uint16_t data)
 
 void timer_set_divider(uint16_t d)
 {
-  timer_send_command(PIT_MODE_SQUARE_WAVE, d);
+  /* the counter of a rate generator goes down by one at every clock,
+     so it tells how far into the current tick we are */
+  timer_send_command(PIT_MODE_RATE_GEN, d);
+}
+
+static uint16_t timer_read_counter(void)
+{
+  outb(PIT_CMD, PIT_CHANNEL0 | PIT_ACCESS_LATCH);
+  uint16_t current = inb(PIT_DATA0);
+  current |= inb(PIT_DATA0) << 8;
+  return current;
+}
+
+/* Tickless operation.
+
+   When at most one task is runnable, the scheduler has no use for
+   periodic ticks, so the PIT is programmed in one-shot mode for the
+   next deadline: the expiry of the next timer, or the end of the
+   quantum of the running task. The tick count is advanced by the
+   whole period when the interrupt fires, or by the time actually
+   elapsed when periodic mode has to be resumed earlier.
+
+   Periods always end on a tick boundary, so the phase of the ticks
+   is kept: the part of the current tick that has already elapsed is
+   subtracted from the one-shot period, and an early exit finishes
+   the current tick with a short one-shot period before going back to
+   periodic mode. */
+static void timer_program_oneshot(unsigned long ticks, uint16_t phase)
+{
+  uint16_t count = ticks * PIT_TICK - phase;
+  outb(PIT_CMD, PIT_CHANNEL0 | PIT_MODE_INTERRUPT | PIT_ACCESS_LOHI);
+  outb(PIT_DATA0, count);
+  outb(PIT_DATA0, count >> 8);
+  timer.oneshot = ticks;
+  timer.oneshot_count = count;
+  timer.oneshot_phase = phase;
+}
+
+/* PIT counts elapsed since the beginning of the first tick of the
+   current one-shot period */
+static unsigned timer_oneshot_elapsed(void)
+{
+  uint16_t current = timer_read_counter();
+
+  /* the counter wraps around after reaching zero */
+  if (current > timer.oneshot_count) return timer.oneshot * PIT_TICK;
+  return timer.oneshot_phase + timer.oneshot_count - current;
+}
+
+static void timer_resume_periodic(void)
+{
+  if (!timer.oneshot) return;
+
+  unsigned elapsed = timer_oneshot_elapsed();
+  unsigned ticks = elapsed / PIT_TICK;
+  if (ticks >= timer.oneshot) {
+    /* the period is over and its interrupt is pending, let the
+       interrupt count the last tick */
+    timer.count += timer.oneshot - 1;
+    timer.oneshot = 0;
+    timer_set_divider(PIT_TICK);
+    return;
+  }
+
+  /* finish the current tick, then go back to periodic mode */
+  timer.count += ticks;
+  timer_program_oneshot(1, elapsed % PIT_TICK);
+}
+
+/* only call this function with interrupts disabled */
+void timer_tickless(unsigned long deadline)
+{
+  if (timer.oneshot || timer_waiting_locked) return;
+
+  unsigned long ticks = wheel_next_event(&timer_wheel, TIMER_MAX_ONESHOT);
+  if (deadline) {
+    long left = deadline - timer.count;
+    if (left < (long) ticks) ticks = left > 0 ? left : 0;
+  }
+
+  /* not worth it for a single tick */
+  if (ticks < 2) return;
+
+  /* keep the phase of the current tick */
+  uint16_t current = timer_read_counter();
+  uint16_t phase = current < PIT_TICK ? PIT_TICK - current : 0;
+
+  TRACE("[timer] one-shot for %lu ticks\n", ticks);
+  timer_program_oneshot(ticks, phase);
+}
+
+/* only call this function with interrupts disabled */
+void timer_tickless_exit(void)
+{
+  timer_resume_periodic();
 }
 
 void timer_irq(isr_stack_t *stack)
 {
   pic_eoi(0);
-  timer.count++;
+  if (timer.oneshot) {
+    /* the whole period has elapsed */
+    timer.count += timer.oneshot;
+    timer.oneshot = 0;
+    timer_set_divider(PIT_TICK);
+  }
+  else {
+    timer.count++;
+  }
 
+  /* expired timers are caught up on the next tick */
   if (timer_waiting_locked) return;
   barrier();
 
-  /* wake sleeping tasks */
-  while (waiting &&
-         TASK_LIST_ENTRY(waiting)->timeout <= timer.count) {
-    task_t *task = TASK_LIST_ENTRY(list_pop(&waiting));
-    task->state = TASK_RUNNING;
-    list_add(&sched_runqueue, &task->head);
-  }
+  /* run expired timers, with interrupts still disabled */
+  timer_waiting_locked++;
+  wheel_advance(&timer_wheel, timer.count);
+  timer_waiting_locked--;
 
   /* run scheduler */
   sched_schedule(stack);
@@ -80,7 +198,8 @@ HANDLER_STATIC(timer_irq_handler, timer_irq);
 
 int timer_init(void)
 {
-  timer_set_divider(PIT_FREQ / 1000);
+  wheel_init(&timer_wheel, 0);
+  timer_set_divider(PIT_TICK);
   timer.quantum = 25;
   irq_grab(IRQ_TIMER, &timer_irq_handler);
   return 0;
@@ -88,34 +207,59 @@ int timer_init(void)
 
 unsigned long timer_get_tick(void)
 {
-  return timer.count;
+  if (!timer.oneshot) return timer.count;
+
+  /* account for the part of the one-shot period elapsed so far */
+  uint32_t flags = cpu_flags();
+  cli();
+  unsigned long ticks = timer.count;
+  if (timer.oneshot) {
+    unsigned elapsed = timer_oneshot_elapsed() / PIT_TICK;
+    /* the last tick is counted by the pending interrupt */
+    ticks += elapsed < timer.oneshot ? elapsed : timer.oneshot - 1;
+  }
+  if (flags & EFLAGS_IF) sti();
+  return ticks;
 }
 
-void timer_sleep(unsigned long delay)
+void timer_add(timer_event_t *event, void (*callback)(void *data),
+               void *data, unsigned long ticks)
 {
-  sched_disable_preemption();
-  sched_current->state = TASK_WAITING;
-  sched_current->timeout = timer.count + delay;
-
   timer_waiting_lock();
-  task_t *task = waiting ? TASK_LIST_ENTRY(waiting) : 0;
+  /* the new timer might expire before the end of the one-shot period,
+     and its expiry is relative to an up to date tick count */
+  timer_resume_periodic();
+  wheel_cancel(&timer_wheel, event);
+  event->callback = callback;
+  event->data = data;
+  wheel_add(&timer_wheel, event, timer.count + ticks);
+  timer_waiting_unlock();
+}
 
-  /* insert in the list of waiting tasks in order of timeout */
-  if (!waiting || sched_current->timeout <= task->timeout) {
-    /* insert at the beginning */
-    list_push(&waiting, &sched_current->head);
-  }
-  else {
-    /* insert before the first task with higher priority */
-    list_t *p = waiting->next;
-    task = TASK_LIST_ENTRY(p);
-    while (p != waiting &&
-           TASK_LIST_ENTRY(p)->timeout < sched_current->timeout) {
-      p = p->next;
-    }
-    list_insert(p, &sched_current->head);
-  }
+int timer_cancel(timer_event_t *event)
+{
+  timer_waiting_lock();
+  int pending = wheel_cancel(&timer_wheel, event);
   timer_waiting_unlock();
+  return pending;
+}
 
+void timer_rearm(timer_event_t *event, unsigned long ticks)
+{
+  timer_add(event, event->callback, event->data, ticks);
+}
+
+static void timer_wake_task(void *data)
+{
+  sched_wake(data);
+}
+
+void timer_sleep(unsigned long delay)
+{
+  timer_event_t event = TIMER_EVENT_INIT;
+
+  sched_disable_preemption();
+  sched_current->state = TASK_WAITING;
+  timer_add(&event, timer_wake_task, sched_current, delay);
   sched_yield();
 }
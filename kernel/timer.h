@@ -1,11 +1,16 @@
-#ifndef timer_H
+#ifndef TIMER_H
 #define TIMER_H
 
+#include "wheel.h"
+
 struct isr_stack;
 
+#define PIT_FREQ 1193182
+
 /* ports */
 enum {
   PIT_DATA0 = 0x40,
+  PIT_DATA2 = 0x42,
   PIT_CMD = 0x43,
 };
 
@@ -53,6 +58,29 @@ void timer_irq();
 
 unsigned long timer_get_tick(void);
 
+/* Switch to one-shot mode until the next timer expires, or until the
+   given tick if it is not zero. This is called by the scheduler when
+   it has no other task to switch to, with interrupts disabled. */
+void timer_tickless(unsigned long deadline);
+/* go back to periodic ticks */
+void timer_tickless_exit(void);
+
 void timer_sleep(unsigned long delay);
 
+/* Callback timers. Callbacks run in interrupt context, and can re-arm
+   their own timer. The timer structure is owned by the caller, must be
+   initialised with TIMER_EVENT_INIT, and must stay valid while the
+   timer is pending. */
+typedef wheel_timer_t timer_event_t;
+#define TIMER_EVENT_INIT ((timer_event_t) { .slot = 0 })
+
+/* run callback after the given number of ticks, rescheduling the
+   timer if it is already pending */
+void timer_add(timer_event_t *event, void (*callback)(void *data),
+               void *data, unsigned long ticks);
+/* returns 1 if the timer was pending */
+int timer_cancel(timer_event_t *event);
+/* schedule a timer again with its current callback */
+void timer_rearm(timer_event_t *event, unsigned long ticks);
+
 #endif /* TIMER_H */
@@ -0,0 +1,127 @@
+#include "wheel.h"
+
+#include <assert.h>
+
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_RANGE(level) (1UL << ((level) * WHEEL_BITS))
+
+void wheel_init(wheel_t *wheel, unsigned long now)
+{
+  wheel->now = now;
+  wheel->pending = 0;
+  for (int k = 0; k < WHEEL_LEVELS; k++) {
+    for (int i = 0; i < WHEEL_SIZE; i++)
+      wheel->slots[k][i] = 0;
+  }
+}
+
+/* put a timer in its slot relative to the current time, which can be
+   equal to its expiry time while cascading */
+static void wheel_insert(wheel_t *wheel, wheel_timer_t *timer)
+{
+  unsigned long delta = timer->expires - wheel->now;
+  unsigned long when = timer->expires;
+
+  int level = 0;
+  while (level < WHEEL_LEVELS - 1 && delta >= WHEEL_RANGE(level + 1))
+    level++;
+
+  /* park timers beyond the range of the wheel */
+  if (level == WHEEL_LEVELS - 1 && delta >= WHEEL_RANGE(WHEEL_LEVELS))
+    when = wheel->now + WHEEL_RANGE(WHEEL_LEVELS) - 1;
+
+  unsigned index = (when >> (level * WHEEL_BITS)) & WHEEL_MASK;
+  timer->slot = &wheel->slots[level][index];
+  list_add(timer->slot, &timer->head);
+}
+
+void wheel_add(wheel_t *wheel, wheel_timer_t *timer, unsigned long expires)
+{
+  assert(!timer->slot);
+
+  /* the current tick has already been processed */
+  if ((long) (expires - wheel->now) <= 0)
+    expires = wheel->now + 1;
+
+  timer->expires = expires;
+  wheel_insert(wheel, timer);
+  wheel->pending++;
+}
+
+int wheel_cancel(wheel_t *wheel, wheel_timer_t *timer)
+{
+  if (!timer->slot) return 0;
+
+  list_take(timer->slot, &timer->head);
+  timer->slot = 0;
+  wheel->pending--;
+  return 1;
+}
+
+/* move all timers of a slot to lower levels, and return its index */
+static unsigned wheel_cascade(wheel_t *wheel, int level)
+{
+  unsigned index = (wheel->now >> (level * WHEEL_BITS)) & WHEEL_MASK;
+  list_t *list = wheel->slots[level][index];
+  wheel->slots[level][index] = 0;
+
+  while (list) {
+    wheel_timer_t *timer = LIST_ENTRY(list_pop(&list), wheel_timer_t, head);
+    wheel_insert(wheel, timer);
+  }
+
+  return index;
+}
+
+static void wheel_tick(wheel_t *wheel)
+{
+  wheel->now++;
+
+  /* cascade from the lowest level, so that timers coming down from
+     higher levels are inserted after the slots they skip */
+  for (int level = 1; level < WHEEL_LEVELS; level++) {
+    if ((wheel->now & (WHEEL_RANGE(level) - 1)) != 0) break;
+    if (wheel_cascade(wheel, level) != 0) break;
+  }
+
+  list_t **slot = &wheel->slots[0][wheel->now & WHEEL_MASK];
+  while (*slot) {
+    wheel_timer_t *timer = LIST_ENTRY(list_pop(slot), wheel_timer_t, head);
+    assert(timer->expires == wheel->now);
+    timer->slot = 0;
+    wheel->pending--;
+    timer->callback(timer->data);
+  }
+}
+
+unsigned long wheel_next_event(wheel_t *wheel, unsigned long max)
+{
+  if (wheel->pending == 0) return max;
+
+  for (unsigned long d = 1; d < max; d++) {
+    unsigned long t = wheel->now + d;
+
+    for (int level = 1; level < WHEEL_LEVELS; level++) {
+      if ((t & (WHEEL_RANGE(level) - 1)) != 0) break;
+      unsigned index = (t >> (level * WHEEL_BITS)) & WHEEL_MASK;
+      if (wheel->slots[level][index]) return d;
+      if (index != 0) break;
+    }
+
+    if (wheel->slots[0][t & WHEEL_MASK]) return d;
+  }
+
+  return max;
+}
+
+void wheel_advance(wheel_t *wheel, unsigned long now)
+{
+  while ((long) (now - wheel->now) > 0) {
+    /* skip ahead while nothing is pending */
+    if (wheel->pending == 0) {
+      wheel->now = now;
+      return;
+    }
+    wheel_tick(wheel);
+  }
+}
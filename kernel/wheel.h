@@ -0,0 +1,58 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include "list.h"
+
+/* Hierarchical timing wheel.
+
+   Level k has WHEEL_SIZE slots, each covering WHEEL_SIZE^k ticks.
+   A timer is placed in the lowest level whose range contains its
+   expiry time, so insertion and removal are O(1). When the lower
+   level wraps around, the next slot of the level above is cascaded
+   down, which moves each timer at most once per level. Timers
+   further away than the whole wheel are parked in the last slot of
+   the top level, and re-inserted when it is cascaded.
+
+   The wheel does no locking of its own. */
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+typedef struct wheel_timer {
+  list_t head;
+  list_t **slot; /* list containing the timer, 0 when not pending */
+  unsigned long expires;
+  void (*callback)(void *data);
+  void *data;
+} wheel_timer_t;
+
+typedef struct wheel {
+  /* last tick processed */
+  unsigned long now;
+  unsigned long pending;
+  list_t *slots[WHEEL_LEVELS][WHEEL_SIZE];
+} wheel_t;
+
+void wheel_init(wheel_t *wheel, unsigned long now);
+
+/* schedule a timer at an absolute time, which is moved to the next
+   tick if it is already in the past; the timer must not be pending */
+void wheel_add(wheel_t *wheel, wheel_timer_t *timer, unsigned long expires);
+/* returns 1 if the timer was pending */
+int wheel_cancel(wheel_t *wheel, wheel_timer_t *timer);
+
+/* process all ticks up to now, running the callbacks of expired
+   timers in order of expiry */
+void wheel_advance(wheel_t *wheel, unsigned long now);
+
+/* number of ticks until the wheel next has work to do, either running
+   a timer or cascading a non-empty slot, or max if that is further */
+unsigned long wheel_next_event(wheel_t *wheel, unsigned long max);
+
+static inline int wheel_timer_pending(wheel_timer_t *timer)
+{
+  return timer->slot != 0;
+}
+
+#endif /* WHEEL_H */
@@ -0,0 +1,113 @@
+#include "atomic.h"
+#include "core/debug.h"
+#include "core/x86.h"
+#include "scheduler.h"
+#include "work.h"
+
+#define WORK_DEBUG 0
+
+#if WORK_DEBUG
+# define TRACE(fmt, ...) serial_printf("[work] " fmt \
+                                       __VA_OPT__(,) __VA_ARGS__)
+#else
+# define TRACE(...) do {} while(0)
+#endif
+
+#define WORK_WORKERS 2
+
+enum {
+  WORK_IDLE = 0,
+  WORK_QUEUED,
+  WORK_RUNNING,
+  /* scheduled again while running */
+  WORK_RERUN,
+};
+
+/* Queued items and idle workers. These are accessed by interrupt
+   handlers, so they are only touched with interrupts disabled. */
+static list_t *work_queue = 0;
+static list_t *work_idle = 0;
+static work_stats_t work_stats;
+
+void work_init(work_t *work, work_func_t func, void *data)
+{
+  *work = WORK_INIT(func, data);
+}
+
+/* only call this function with interrupts disabled */
+static void work_enqueue(work_t *work)
+{
+  work->state = WORK_QUEUED;
+  list_add(&work_queue, &work->head);
+
+  if (work_idle) {
+    task_t *worker = TASK_LIST_ENTRY(list_pop(&work_idle));
+    sched_wake(worker);
+  }
+}
+
+void work_schedule(work_t *work)
+{
+  uint32_t flags = cpu_flags();
+  cli();
+
+  work_stats.scheduled++;
+  switch (work->state) {
+  case WORK_IDLE:
+    work_enqueue(work);
+    break;
+  case WORK_RUNNING:
+    work->state = WORK_RERUN;
+    break;
+  default:
+    work_stats.coalesced++;
+    break;
+  }
+
+  if (flags & EFLAGS_IF) sti();
+}
+
+static void work_worker(void)
+{
+  while (1) {
+    cli();
+    work_stats.batches++;
+    while (work_queue) {
+      work_t *work = LIST_ENTRY(list_pop(&work_queue), work_t, head);
+      work->state = WORK_RUNNING;
+      work_stats.runs++;
+      sti();
+
+      TRACE("%p running %p\n", sched_current, work);
+      work->func(work->data);
+
+      cli();
+      if (work->state == WORK_RERUN)
+        work_enqueue(work);
+      else
+        work->state = WORK_IDLE;
+    }
+
+    /* wait for more work; an item scheduled before the yield makes
+       the task runnable again, so no wakeup is lost */
+    sched_current->state = TASK_WAITING;
+    list_add(&work_idle, &sched_current->head);
+    sti();
+    sched_disable_preemption();
+    sched_yield();
+  }
+}
+
+void work_start_background_tasks(void)
+{
+  for (int i = 0; i < WORK_WORKERS; i++)
+    sched_spawn_task(work_worker, "worker", SCHED_PRIO_IRQ);
+}
+
+void work_get_stats(work_stats_t *stats)
+{
+  uint32_t flags = cpu_flags();
+  cli();
+  *stats = work_stats;
+  if (flags & EFLAGS_IF) sti();
+}
@@ -0,0 +1,54 @@
+#ifndef WORK_H
+#define WORK_H
+
+#include "list.h"
+
+#include <stdint.h>
+
+/* Deferred work.
+
+   Interrupt handlers do the minimum amount of work needed to silence
+   the device, and schedule a work item for the rest. Work items are
+   run by a small pool of worker tasks at interrupt priority, which
+   drain the queue in batches.
+
+   Scheduling an item that is already queued does nothing, and
+   scheduling an item while it runs makes it run once more after it
+   returns, so an item never runs concurrently with itself and does
+   not need to be reentrant. Items can block, in which case the other
+   workers keep draining the queue.
+*/
+
+typedef void (*work_func_t)(void *data);
+
+typedef struct work {
+  list_t head;
+  work_func_t func;
+  void *data;
+  int state;
+} work_t;
+
+#define WORK_INIT(f, d) ((work_t) { .func = (f), .data = (d) })
+
+typedef struct work_stats {
+  /* calls to work_schedule */
+  uint32_t scheduled;
+  /* calls merged with a pending run */
+  uint32_t coalesced;
+  uint32_t runs;
+  /* worker wakeups */
+  uint32_t batches;
+} work_stats_t;
+
+void work_init(work_t *work, work_func_t func, void *data);
+
+/* queue a work item, can be called from interrupt handlers */
+void work_schedule(work_t *work);
+
+/* spawn the worker tasks, items scheduled before this are run once
+   the workers start */
+void work_start_background_tasks(void);
+
+void work_get_stats(work_stats_t *stats);
+
+#endif /* WORK_H */
@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../core/storage.h"
+#include "../kernel/bcache.h"
+#include "../kernel/frames.h"
+#include "../kernel/kmalloc.h"
+#include "../kernel/semaphore.h"
+
+#include "test_assert.h"
+
+/* kernel services used by the cache */
+
+#define POOL_SIZE (256 * 1024)
+frames_t kernel_frames;
+static uint8_t pool[POOL_SIZE] __attribute__((aligned(65536)));
+static int locks_held = 0;
+
+void *kmalloc(size_t bytes) { return malloc(bytes); }
+void kfree(void *p) { free(p); }
+
+void sem_init(semaphore_t *sem, int value) { sem->value = value; }
+void sem_wait(semaphore_t *sem) { sem->value--; locks_held++; }
+void sem_signal(semaphore_t *sem) { sem->value++; locks_held--; }
+
+/* memory backed fake disk */
+
+#define DISK_BLOCKS 256
+#define DISK_SIZE (DISK_BLOCKS * BCACHE_BLOCK_SIZE)
+
+typedef struct {
+  uint8_t data[DISK_SIZE];
+  unsigned reads;
+  unsigned writes;
+  /* a backing read was performed while holding the cache lock */
+  int locked_read;
+  /* called in the middle of the next backing read */
+  void (*hook)(void);
+  /* reads past this offset fail, unless it is 0 */
+  storage_offset_t end;
+} disk_t;
+
+static disk_t disk;
+
+static int disk_read(void *data, void *buf,
+                     storage_offset_t offset, uint32_t bytes)
+{
+  storage_offset_t base = *(storage_offset_t *) data;
+  if (locks_held) disk.locked_read = 1;
+  disk.reads++;
+  if (disk.end && base + offset + bytes > disk.end) return -1;
+  memcpy(buf, disk.data + base + offset, bytes);
+  if (disk.hook) {
+    void (*hook)(void) = disk.hook;
+    disk.hook = 0;
+    hook();
+  }
+  return 0;
+}
+
+static int disk_write(void *data, void *buf,
+                      storage_offset_t offset, uint32_t bytes)
+{
+  storage_offset_t base = *(storage_offset_t *) data;
+  disk.writes++;
+  memcpy(disk.data + base + offset, buf, bytes);
+  return 0;
+}
+
+static storage_ops_t disk_ops = {
+  .read = disk_read,
+  .write = disk_write,
+  .sector_size = 512,
+};
+
+/* two views of the disk: the whole of it, and a partition */
+#define PART_OFFSET (64 * BCACHE_BLOCK_SIZE)
+static storage_offset_t whole_base = 0;
+static storage_offset_t part_base = PART_OFFSET;
+static storage_t whole_raw = { &disk_ops, &whole_base };
+static storage_t part_raw = { &disk_ops, &part_base };
+static storage_t whole, part;
+
+static int mem_info(uint64_t start, uint64_t size, void *data)
+{
+  return MEM_INFO_USABLE;
+}
+
+static void setup(void)
+{
+  for (int i = 0; i < DISK_SIZE; i++)
+    disk.data[i] = (i / BCACHE_BLOCK_SIZE) ^ i;
+  disk.reads = 0;
+  disk.writes = 0;
+  disk.locked_read = 0;
+  disk.hook = 0;
+  disk.end = 0;
+}
+
+static uint32_t block_tag(storage_t *storage, uint64_t block)
+{
+  uint32_t tag = 0;
+  storage_read(storage, &tag, block * BCACHE_BLOCK_SIZE, sizeof(tag));
+  return tag;
+}
+
+static int test_hits(void)
+{
+  setup();
+
+  bcache_stats_t before, after;
+  bcache_get_stats(&before);
+
+  uint8_t buf[3 * BCACHE_BLOCK_SIZE];
+  /* an unaligned read spanning three blocks */
+  T_ASSERT(storage_read(&whole, buf, 512, sizeof(buf) - 512) == 0);
+  T_ASSERT(memcmp(buf, disk.data + 512, sizeof(buf) - 512) == 0);
+  T_ASSERT_EQ((unsigned long) disk.reads, 3UL);
+
+  /* the same blocks are now served from memory */
+  T_ASSERT(storage_read(&whole, buf, 0, sizeof(buf)) == 0);
+  T_ASSERT(memcmp(buf, disk.data, sizeof(buf)) == 0);
+  T_ASSERT_EQ((unsigned long) disk.reads, 3UL);
+
+  /* partition blocks are keyed by their position on the disk */
+  T_ASSERT(storage_read(&whole, buf, PART_OFFSET, 512) == 0);
+  T_ASSERT_EQ((unsigned long) disk.reads, 4UL);
+  T_ASSERT(storage_read(&part, buf, 0, 512) == 0);
+  T_ASSERT_EQ((unsigned long) disk.reads, 4UL);
+  T_ASSERT(memcmp(buf, disk.data + PART_OFFSET, 512) == 0);
+
+  bcache_get_stats(&after);
+  T_ASSERT_EQ((unsigned long) (after.misses - before.misses), 4UL);
+  T_ASSERT_EQ((unsigned long) (after.hits - before.hits), 4UL);
+
+  T_ASSERT(!disk.locked_read);
+  return 0;
+}
+
+static int test_eviction(void)
+{
+  setup();
+
+  bcache_stats_t stats;
+  bcache_get_stats(&stats);
+  uint32_t max = stats.max_blocks;
+  T_ASSERT(max < DISK_BLOCKS);
+
+  /* fill the cache, then touch block 0 so that block 1 is the least
+     recently used */
+  for (uint32_t i = 0; i < max; i++)
+    block_tag(&whole, i);
+  block_tag(&whole, 0);
+  unsigned reads = disk.reads;
+  bcache_get_stats(&stats);
+  uint32_t evictions = stats.evictions;
+
+  /* one more block evicts block 1 only */
+  block_tag(&whole, max);
+  bcache_get_stats(&stats);
+  T_ASSERT_EQ((unsigned long) (stats.evictions - evictions), 1UL);
+  T_ASSERT_EQ((unsigned long) stats.blocks, (unsigned long) max);
+
+  block_tag(&whole, 0);
+  block_tag(&whole, 2);
+  T_ASSERT_EQ((unsigned long) disk.reads, (unsigned long) reads + 1);
+  T_ASSERT(block_tag(&whole, 1) == *(uint32_t *) (disk.data +
+                                                  BCACHE_BLOCK_SIZE));
+  T_ASSERT_EQ((unsigned long) disk.reads, (unsigned long) reads + 2);
+
+  T_ASSERT(!disk.locked_read);
+  return 0;
+}
+
+static int test_write_through(void)
+{
+  setup();
+
+  uint8_t buf[BCACHE_BLOCK_SIZE];
+  T_ASSERT(storage_read(&part, buf, 0, sizeof(buf)) == 0);
+  unsigned reads = disk.reads;
+
+  /* writes reach the disk immediately, and update the cached copy
+     seen by every storage on the same disk */
+  memset(buf, 0xaa, 512);
+  T_ASSERT(storage_write(&part, buf, 512, 512) == 0);
+  T_ASSERT_EQ((unsigned long) disk.writes, 1UL);
+  T_ASSERT(memcmp(disk.data + PART_OFFSET + 512, buf, 512) == 0);
+
+  uint8_t check[512];
+  T_ASSERT(storage_read(&whole, check, PART_OFFSET + 512, 512) == 0);
+  T_ASSERT(memcmp(check, buf, 512) == 0);
+  T_ASSERT_EQ((unsigned long) disk.reads, (unsigned long) reads);
+
+  return 0;
+}
+
+static void racing_write(void)
+{
+  uint32_t tag = 0xdeadbeef;
+  storage_write(&whole, &tag, 5 * BCACHE_BLOCK_SIZE, sizeof(tag));
+}
+
+static int test_racing_write(void)
+{
+  setup();
+
+  /* drop block 5 from the cache */
+  bcache_storage_cleanup(&whole);
+  T_ASSERT(bcache_storage_init(&whole, &whole_raw, &disk, 0) == 0);
+
+  /* a block written while being read is not cached */
+  disk.hook = racing_write;
+  block_tag(&whole, 5);
+  unsigned reads = disk.reads;
+  T_ASSERT_EQ((unsigned long) block_tag(&whole, 5), 0xdeadbeefUL);
+  T_ASSERT_EQ((unsigned long) disk.reads, (unsigned long) reads + 1);
+
+  T_ASSERT(!disk.locked_read);
+  return 0;
+}
+
+static int test_short_disk(void)
+{
+  setup();
+
+  /* the last block of the disk is only half readable */
+  disk.end = DISK_SIZE - 512;
+  uint8_t buf[512];
+  storage_offset_t offset = DISK_SIZE - BCACHE_BLOCK_SIZE;
+  T_ASSERT(storage_read(&whole, buf, offset, sizeof(buf)) == 0);
+  T_ASSERT(memcmp(buf, disk.data + offset, sizeof(buf)) == 0);
+  T_ASSERT_EQ((unsigned long) disk.reads, 2UL);
+
+  /* the block is not cached */
+  T_ASSERT(storage_read(&whole, buf, offset, sizeof(buf)) == 0);
+  T_ASSERT_EQ((unsigned long) disk.reads, 4UL);
+
+  /* the missing sector still fails */
+  T_ASSERT(storage_read(&whole, buf, offset + 512, sizeof(buf)) == -1);
+
+  return 0;
+}
+
+int bcache_test(void)
+{
+  frames_init(&kernel_frames, 0,
+              (size_t) pool,
+              (size_t) (pool + POOL_SIZE),
+              8, mem_info, 0);
+  bcache_set_budget(64 * BCACHE_BLOCK_SIZE);
+
+  if (bcache_storage_init(&whole, &whole_raw, &disk, 0) == -1 ||
+      bcache_storage_init(&part, &part_raw, &disk, PART_OFFSET) == -1) {
+    fprintf(stderr, "ASSERT (%s:%d): bcache_storage_init failed\n",
+            __FILE__, __LINE__);
+    return 1;
+  }
+
+  int ret = 0;
+  ret = test_hits() || ret;
+  ret = test_eviction() || ret;
+  ret = test_write_through() || ret;
+  ret = test_racing_write() || ret;
+  ret = test_short_disk() || ret;
+
+  bcache_storage_cleanup(&part);
+  bcache_storage_cleanup(&whole);
+  return ret;
+}
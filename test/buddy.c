@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "../kernel/frames.h"
 
@@ -96,6 +97,78 @@ static int test_chunk_alloc(void *mem, size_t sz0) {
   return 0;
 }
 
+static int test_out_of_band(void *mem, size_t sz)
+{
+  size_t aux_sz = 0x10000;
+  void *aux_mem = malloc(aux_sz);
+  frames_t aux;
+  frames_init(&aux, 0, (uint64_t) aux_mem, (uint64_t) aux_mem + aux_sz,
+              5, default_mem_info, 0);
+
+  frames_t frames;
+  memset(mem, 0xab, sz);
+  T_ASSERT(frames_init_flags(&frames, &aux, (uint64_t) mem,
+                             (uint64_t) mem + sz, 12, FRAMES_OUT_OF_BAND,
+                             default_mem_info, 0) == 0);
+  T_ASSERT(frames.links);
+  size_t total = frames_available_memory(&frames);
+
+  uint64_t x[16];
+  for (int i = 0; i < 16; i++) {
+    x[i] = frames_alloc(&frames, 0x1000 << (i % 3));
+    T_ASSERT(x[i]);
+  }
+  for (int i = 0; i < 16; i += 2)
+    frames_free(&frames, x[i]);
+  for (int i = 1; i < 16; i += 2)
+    frames_free(&frames, x[i]);
+  T_ASSERT_EQ(frames_available_memory(&frames), total);
+
+  /* the managed memory has never been written to */
+  for (size_t i = 0; i < sz; i++) {
+    if (((unsigned char *) mem)[i] != 0xab) {
+      T_ASSERT_MSG(0, "byte at offset %lu overwritten", (unsigned long) i);
+    }
+  }
+
+  free(aux_mem);
+  return 0;
+}
+
+static int test_alloc_bulk(void *mem, size_t sz)
+{
+  frames_t *frames = frames_new((uint64_t) mem,
+                                (uint64_t) mem + sz,
+                                5, default_mem_info, 0);
+  size_t total = frames_available_memory(frames);
+
+  uint64_t x[16];
+  T_ASSERT(frames_alloc_bulk(frames, 100, 11, x) == 0);
+  T_ASSERT_EQ(frames_available_memory(frames), total - 11 * 128);
+  for (int i = 0; i < 11; i++) {
+    for (int j = 0; j < i; j++)
+      T_ASSERT(x[i] != x[j]);
+  }
+
+  /* freeing some blocks individually works */
+  frames_free(frames, x[3]);
+  frames_free(frames, x[10]);
+  T_ASSERT_EQ(frames_available_memory(frames), total - 9 * 128);
+  x[3] = x[9];
+  frames_free_bulk(frames, x, 9);
+  T_ASSERT_EQ(frames_available_memory(frames), total);
+  T_ASSERT_EQ((unsigned long) frames->stats.allocs, 11UL);
+  T_ASSERT_EQ((unsigned long) frames->stats.frees, 11UL);
+
+  /* failed allocations leave nothing behind */
+  T_ASSERT(sz / 0x10000 <= 16);
+  T_ASSERT(frames_alloc_bulk(frames, 0x10000, sz / 0x10000, x) == -1);
+  T_ASSERT_EQ(frames_available_memory(frames), total);
+
+  free(frames);
+  return 0;
+}
+
 static int test_order_of()
 {
   T_ASSERT(ORDER_OF(0xf) == 4);
@@ -114,6 +187,8 @@ int buddy_test(void)
   int err = 0;
   err = test_alloc_free(mem, sz) || err;
   err = test_chunk_alloc(mem, sz) || err;
+  err = test_out_of_band(mem, sz) || err;
+  err = test_alloc_bulk(mem, sz) || err;
   err = test_order_of() || err;
 
   free(mem);
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "../kernel/heap.h"
 #include "../kernel/frames.h"
@@ -86,10 +87,222 @@ static int test_alloc_free_disjoint(void)
   return 0;
 }
 
+static heap_t *fresh_heap(void)
+{
+  frames_init(&frames, 0,
+              (size_t) pool,
+              (size_t) (pool + POOL_SIZE),
+              8, mem_info, 0);
+  return heap_new_with_growth(&frames, 1);
+}
+
+/* freeing every other block, then the rest, must coalesce everything
+   back into a single chunk */
+static int test_coalesce_interleaved(void)
+{
+  heap_t *heap = fresh_heap();
+  T_ASSERT(heap);
+  uint64_t available = frames_available_memory(&frames);
+
+  enum { N = 32, SIZE = 64 };
+  void *p[N];
+  for (int i = 0; i < N; i++) {
+    p[i] = heap_malloc(heap, SIZE);
+    T_ASSERT(p[i]);
+  }
+  T_ASSERT_EQ(frames_available_memory(&frames), available);
+
+  for (int i = 0; i < N; i += 2) heap_free(heap, p[i]);
+  for (int i = 1; i < N; i += 2) heap_free(heap, p[i]);
+
+  /* only fits if all the freed blocks have been merged */
+  void *q = heap_malloc(heap, N * SIZE);
+  T_ASSERT(q == p[0]);
+  T_ASSERT_EQ(frames_available_memory(&frames), available);
+
+  return 0;
+}
+
+/* holes left by freed blocks are reused by allocations that fit, and
+   skipped by those that do not */
+static int test_reuse_holes(void)
+{
+  heap_t *heap = fresh_heap();
+  T_ASSERT(heap);
+
+  enum { N = 16, SIZE = 48 };
+  void *p[N];
+  for (int i = 0; i < N; i++) {
+    p[i] = heap_malloc(heap, SIZE);
+    T_ASSERT(p[i]);
+  }
+  for (int i = 0; i < N; i += 2) heap_free(heap, p[i]);
+
+  /* too big for any hole */
+  void *big = heap_malloc(heap, 3 * SIZE);
+  T_ASSERT(big);
+  for (int i = 1; i < N; i += 2) {
+    T_ASSERT_MSG(disjoint(big, 3 * SIZE, p[i], SIZE),
+                 "big block overlaps %d", i);
+  }
+
+  /* same size as the holes */
+  for (int i = 0; i < N; i += 2) {
+    void *q = heap_malloc(heap, SIZE);
+    int found = 0;
+    for (int j = 0; j < N; j += 2) found = found || q == p[j];
+    T_ASSERT_MSG(found, "allocation %d did not reuse a hole", i);
+  }
+
+  return 0;
+}
+
+/* random allocations and frees, checking that block contents are
+   preserved and that everything coalesces at the end */
+static int test_random_fragmentation(void)
+{
+  heap_t *heap = fresh_heap();
+  T_ASSERT(heap);
+  void *first = heap_malloc(heap, 1);
+  heap_free(heap, first);
+
+  enum { N = 24 };
+  uint8_t *p[N] = {0};
+  size_t sizes[N] = {0};
+  uint32_t seed = 12345;
+
+  for (int k = 0; k < 2000; k++) {
+    seed = seed * 1103515245 + 12345;
+    int i = (seed >> 16) % N;
+    if (p[i]) {
+      for (size_t j = 0; j < sizes[i]; j++)
+        T_ASSERT_MSG(p[i][j] == (uint8_t) (i + j),
+                     "block %d corrupted at %lu", i, j);
+      heap_free(heap, p[i]);
+      p[i] = 0;
+    }
+    else {
+      sizes[i] = 1 + (seed >> 8) % 200;
+      p[i] = heap_malloc(heap, sizes[i]);
+      T_ASSERT(p[i]);
+      for (size_t j = 0; j < sizes[i]; j++) p[i][j] = i + j;
+    }
+  }
+
+  for (int i = 0; i < N; i++) heap_free(heap, p[i]);
+
+  /* the first span is whole again */
+  void *q = heap_malloc(heap, 2048);
+  T_ASSERT(q == first);
+
+  return 0;
+}
+
+/* bulk allocations are contiguous, and can be freed individually */
+static int test_malloc_bulk(void)
+{
+  heap_t *heap = fresh_heap();
+  T_ASSERT(heap);
+  uint64_t available = frames_available_memory(&frames);
+
+  enum { N = 20, SIZE = 40 };
+  void *p[N];
+  T_ASSERT(heap_malloc_bulk(heap, SIZE, N, p) == 0);
+  for (int i = 0; i < N; i++) {
+    T_ASSERT(p[i]);
+    memset(p[i], i, SIZE);
+    if (i > 0) T_ASSERT(p[i] > p[i - 1] && p[i] - p[i - 1] >= SIZE);
+  }
+  for (int i = 0; i < N; i++) {
+    for (int j = 0; j < SIZE; j++)
+      T_ASSERT(((uint8_t *) p[i])[j] == i);
+  }
+
+  for (int i = 0; i < N; i += 2) heap_free(heap, p[i]);
+  for (int i = 1; i < N; i += 2) heap_free(heap, p[i]);
+
+  void *q = heap_malloc(heap, N * SIZE);
+  T_ASSERT(q == p[0]);
+  T_ASSERT_EQ(frames_available_memory(&frames), available);
+
+  return 0;
+}
+
+static int test_heap_stats(void)
+{
+  heap_t *heap = fresh_heap();
+  T_ASSERT(heap);
+  heap_stats_t stats;
+  heap_get_stats(heap, &stats);
+  size_t reserved = stats.reserved;
+  T_ASSERT_EQ(stats.in_use, 0UL);
+
+  void *p = heap_malloc(heap, 100);
+  void *q = heap_malloc(heap, 2 * POOL_SIZE);
+  T_ASSERT(p && !q);
+  heap_get_stats(heap, &stats);
+  T_ASSERT(stats.in_use >= 100);
+  T_ASSERT_EQ((unsigned long) stats.allocs, 1UL);
+  T_ASSERT_EQ((unsigned long) stats.failed, 1UL);
+  T_ASSERT_EQ(stats.reserved, reserved);
+
+  heap_free(heap, p);
+  heap_get_stats(heap, &stats);
+  T_ASSERT_EQ(stats.in_use, 0UL);
+  T_ASSERT_EQ((unsigned long) stats.frees, 1UL);
+
+  return 0;
+}
+
+/* empty spans are returned to the frame allocator, except for those
+   needed to keep the free memory above the watermark */
+static int test_release_spans(void)
+{
+  heap_t *heap = fresh_heap();
+  T_ASSERT(heap);
+  uint64_t available = frames_available_memory(&frames);
+
+  enum { SIZE = 3000 };
+  void *p1 = heap_malloc(heap, SIZE);
+  void *p2 = heap_malloc(heap, SIZE);
+  void *p3 = heap_malloc(heap, SIZE);
+  T_ASSERT(p1 && p2 && p3);
+  T_ASSERT_EQ(frames_available_memory(&frames), available - 0x2000);
+
+  /* the first empty span is kept, as free memory would fall below
+     the watermark */
+  heap_free(heap, p2);
+  T_ASSERT_EQ(frames_available_memory(&frames), available - 0x2000);
+
+  heap_free(heap, p3);
+  T_ASSERT_EQ(frames_available_memory(&frames), available - 0x1000);
+
+  /* the initial span is never released */
+  heap_free(heap, p1);
+  heap_stats_t stats;
+  heap_get_stats(heap, &stats);
+  T_ASSERT_EQ(stats.in_use, 0UL);
+  T_ASSERT_EQ(stats.reserved, 0x2000UL);
+
+  /* the kept span is reused */
+  p2 = heap_malloc(heap, SIZE);
+  p1 = heap_malloc(heap, SIZE);
+  T_ASSERT(p1 && p2);
+  T_ASSERT_EQ(frames_available_memory(&frames), available - 0x1000);
+
+  return 0;
+}
+
 int kmalloc_test(void)
 {
   int err = test_alloc_disjoint();
   err = test_alloc_free_disjoint() || err;
+  err = test_coalesce_interleaved() || err;
+  err = test_reuse_holes() || err;
+  err = test_random_fragmentation() || err;
+  err = test_malloc_bulk() || err;
+  err = test_heap_stats() || err;
+  err = test_release_spans() || err;
 
   return err;
 }
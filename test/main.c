@@ -1,6 +1,10 @@
 int division_test(void);
 int buddy_test(void);
 int kmalloc_test(void);
+int slab_test(void);
+int wheel_test(void);
+int ring_test(void);
+int bcache_test(void);
 
 int main(int argc, char **argv)
 {
@@ -8,5 +12,9 @@ int main(int argc, char **argv)
   ret = division_test() || ret;
   ret = buddy_test() || ret;
   ret = kmalloc_test() || ret;
+  ret = slab_test() || ret;
+  ret = wheel_test() || ret;
+  ret = ring_test() || ret;
+  ret = bcache_test() || ret;
   return ret;
 }
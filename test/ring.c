@@ -0,0 +1,65 @@
+#include <stdio.h>
+
+#include "../kernel/ring.h"
+
+#include "test_assert.h"
+
+#define RING_SIZE 8
+
+static ring_t ring;
+static unsigned items[RING_SIZE];
+
+static int test_fill(void)
+{
+  ring_init(&ring, RING_SIZE);
+  T_ASSERT_EQ((unsigned long) ring_count(&ring), 0UL);
+  T_ASSERT(ring_pop_slot(&ring) == -1);
+
+  for (unsigned i = 0; i < RING_SIZE; i++)
+    T_ASSERT(RING_PUSH(&ring, items, i));
+  T_ASSERT_EQ((unsigned long) ring_count(&ring), (unsigned long) RING_SIZE);
+
+  /* a full ring rejects new elements */
+  T_ASSERT(!RING_PUSH(&ring, items, 100));
+
+  for (unsigned i = 0; i < RING_SIZE; i++) {
+    unsigned x;
+    T_ASSERT(RING_POP(&ring, items, &x));
+    T_ASSERT_EQ((unsigned long) x, (unsigned long) i);
+  }
+
+  unsigned x;
+  T_ASSERT(!RING_POP(&ring, items, &x));
+  return 0;
+}
+
+static int test_wrap(void)
+{
+  /* start close to the overflow of the free running indices */
+  ring_init(&ring, RING_SIZE);
+  ring.head = ring.tail = ~0U - 2;
+
+  unsigned next = 0, expected = 0;
+  for (int round = 0; round < 10; round++) {
+    for (int i = 0; i < 5; i++)
+      T_ASSERT(RING_PUSH(&ring, items, next++));
+    T_ASSERT_EQ((unsigned long) ring_count(&ring), 5UL);
+    for (int i = 0; i < 5; i++) {
+      unsigned x;
+      T_ASSERT(RING_POP(&ring, items, &x));
+      T_ASSERT_EQ((unsigned long) x, (unsigned long) expected);
+      expected++;
+    }
+  }
+
+  T_ASSERT_EQ((unsigned long) ring_count(&ring), 0UL);
+  return 0;
+}
+
+int ring_test(void)
+{
+  int err = test_fill();
+  err = test_wrap() || err;
+
+  return err;
+}
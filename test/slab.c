@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../kernel/frames.h"
+#include "../kernel/slab.h"
+
+#include "test_assert.h"
+
+#define POOL_SIZE (64 * 1024)
+static frames_t frames;
+static uint8_t pool[POOL_SIZE];
+
+typedef struct {
+  uint32_t magic;
+  uint8_t payload[44];
+} object_t;
+
+#define OBJECT_MAGIC 0xc0ffee
+
+static int num_constructed;
+
+static void object_ctor(void *obj)
+{
+  object_t *o = obj;
+  o->magic = OBJECT_MAGIC;
+  num_constructed++;
+}
+
+static int mem_info(uint64_t start, uint64_t size, void *data)
+{
+  return MEM_INFO_USABLE;
+}
+
+static int init_cache(kmem_cache_t *cache)
+{
+  frames_init(&frames, 0,
+              (size_t) pool,
+              (size_t) (pool + POOL_SIZE),
+              8, mem_info, 0);
+  num_constructed = 0;
+  return kmem_cache_init(cache, &frames, "object",
+                         sizeof(object_t), 0, object_ctor);
+}
+
+static int test_alloc_free(void)
+{
+  kmem_cache_t cache;
+  T_ASSERT(init_cache(&cache) == 0);
+
+  object_t *o1 = kmem_cache_alloc(&cache);
+  object_t *o2 = kmem_cache_alloc(&cache);
+  T_ASSERT(o1 && o2 && o1 != o2);
+  T_ASSERT(o1->magic == OBJECT_MAGIC);
+  T_ASSERT(o2->magic == OBJECT_MAGIC);
+  T_ASSERT_EQ((unsigned long) cache.stats.in_use, 2UL);
+
+  /* freed objects are reused first, and not reconstructed */
+  int constructed = num_constructed;
+  kmem_cache_free(&cache, o1);
+  object_t *o3 = kmem_cache_alloc(&cache);
+  T_ASSERT(o3 == o1);
+  T_ASSERT(o3->magic == OBJECT_MAGIC);
+  T_ASSERT_EQ((unsigned long) num_constructed, (unsigned long) constructed);
+
+  T_ASSERT_EQ((unsigned long) cache.stats.allocs, 3UL);
+  T_ASSERT_EQ((unsigned long) cache.stats.frees, 1UL);
+
+  return 0;
+}
+
+static int test_many_slabs(void)
+{
+  kmem_cache_t cache;
+  T_ASSERT(init_cache(&cache) == 0);
+  uint64_t available = frames_available_memory(&frames);
+
+  /* enough objects for several slabs */
+  unsigned n = 3 * cache.objs_per_slab + 1;
+  object_t **objs = malloc(n * sizeof(object_t *));
+  for (unsigned i = 0; i < n; i++) {
+    objs[i] = kmem_cache_alloc(&cache);
+    T_ASSERT(objs[i]);
+    T_ASSERT_MSG((size_t) objs[i] % cache.align == 0,
+                 "object %u not aligned", i);
+    objs[i]->payload[0] = i;
+  }
+  T_ASSERT_EQ((unsigned long) cache.stats.slabs, 4UL);
+
+  for (unsigned i = 0; i < n; i++) {
+    T_ASSERT_MSG(objs[i]->payload[0] == (uint8_t) i,
+                 "object %u overwritten", i);
+  }
+
+  /* all but one empty slab go back to the frame allocator */
+  for (unsigned i = 0; i < n; i++) kmem_cache_free(&cache, objs[i]);
+  T_ASSERT_EQ((unsigned long) cache.stats.slabs, 1UL);
+  T_ASSERT_EQ((unsigned long) cache.stats.in_use, 0UL);
+  T_ASSERT_EQ(frames_available_memory(&frames) + (1UL << cache.slab_bits),
+              available);
+
+  free(objs);
+  return 0;
+}
+
+static int test_alloc_bulk(void)
+{
+  kmem_cache_t cache;
+  T_ASSERT(init_cache(&cache) == 0);
+
+  /* one object is allocated normally, the rest in bulk */
+  unsigned n = 2 * cache.objs_per_slab + 3;
+  object_t **objs = malloc(n * sizeof(object_t *));
+  objs[0] = kmem_cache_alloc(&cache);
+  T_ASSERT(kmem_cache_alloc_bulk(&cache, n - 1, (void **) objs + 1) == 0);
+  T_ASSERT_EQ((unsigned long) cache.stats.slabs, 3UL);
+  T_ASSERT_EQ((unsigned long) cache.stats.in_use, (unsigned long) n);
+  T_ASSERT_EQ((unsigned long) num_constructed,
+              3UL * cache.objs_per_slab);
+
+  for (unsigned i = 0; i < n; i++) {
+    T_ASSERT(objs[i]->magic == OBJECT_MAGIC);
+    for (unsigned j = 0; j < i; j++)
+      T_ASSERT_MSG(objs[i] != objs[j], "objects %u and %u coincide", i, j);
+  }
+
+  for (unsigned i = 0; i < n; i++) kmem_cache_free(&cache, objs[i]);
+  T_ASSERT_EQ((unsigned long) cache.stats.in_use, 0UL);
+
+  free(objs);
+  return 0;
+}
+
+static int test_alloc_bulk_batches(void)
+{
+  kmem_cache_t cache;
+  T_ASSERT(init_cache(&cache) == 0);
+
+  /* more slabs than fit in the pool: the slabs of the batches that
+     succeeded are given back */
+  unsigned n = (POOL_SIZE >> cache.slab_bits) * cache.objs_per_slab;
+  void **objs = malloc(n * sizeof(void *));
+  T_ASSERT(kmem_cache_alloc_bulk(&cache, n, objs) == -1);
+  T_ASSERT_EQ((unsigned long) cache.stats.slabs, 0UL);
+  T_ASSERT_EQ((unsigned long) cache.stats.in_use, 0UL);
+
+  /* enough slabs for more than one batch */
+  n = 11 * cache.objs_per_slab;
+  T_ASSERT(kmem_cache_alloc_bulk(&cache, n, objs) == 0);
+  T_ASSERT_EQ((unsigned long) cache.stats.slabs, 11UL);
+  for (unsigned i = 0; i < n; i++)
+    T_ASSERT(((object_t *) objs[i])->magic == OBJECT_MAGIC);
+
+  for (unsigned i = 0; i < n; i++) kmem_cache_free(&cache, objs[i]);
+  T_ASSERT_EQ((unsigned long) cache.stats.in_use, 0UL);
+
+  free(objs);
+  return 0;
+}
+
+int slab_test(void)
+{
+  int err = test_alloc_free();
+  err = test_many_slabs() || err;
+  err = test_alloc_bulk() || err;
+  err = test_alloc_bulk_batches() || err;
+
+  return err;
+}
@@ -0,0 +1,144 @@
+#include <stdio.h>
+
+#include "../kernel/wheel.h"
+
+#include "test_assert.h"
+
+#define NUM_TIMERS 64
+
+static wheel_t wheel;
+static wheel_timer_t timers[NUM_TIMERS];
+static unsigned long fired_at[NUM_TIMERS];
+static unsigned num_fired;
+
+static void record(void *data)
+{
+  wheel_timer_t *timer = data;
+  fired_at[timer - timers] = wheel.now;
+  num_fired++;
+}
+
+static void setup(unsigned long now)
+{
+  wheel_init(&wheel, now);
+  num_fired = 0;
+  for (int i = 0; i < NUM_TIMERS; i++) {
+    timers[i] = (wheel_timer_t) { .callback = record, .data = &timers[i] };
+    fired_at[i] = 0;
+  }
+}
+
+static int test_expiry(void)
+{
+  /* start in the middle of a block, so that cascades happen at odd
+     offsets from the insertion time */
+  setup(1000);
+
+  /* delays around every level boundary, and past the whole wheel */
+  unsigned long delays[] = {
+    1, 2, 63, 64, 65, 100, 4095, 4096, 4097, 70000,
+    (1UL << 18) - 1, 1UL << 18, (1UL << 18) + 1, 3000000,
+    (1UL << 24) + 5,
+  };
+  unsigned n = sizeof(delays) / sizeof(delays[0]);
+  for (unsigned i = 0; i < n; i++)
+    wheel_add(&wheel, &timers[i], 1000 + delays[i]);
+  T_ASSERT_EQ(wheel.pending, (unsigned long) n);
+
+  /* advance in uneven steps */
+  unsigned long now = 1000;
+  while (num_fired < n) {
+    now += 37;
+    wheel_advance(&wheel, now);
+  }
+
+  for (unsigned i = 0; i < n; i++) {
+    T_ASSERT_MSG(fired_at[i] == 1000 + delays[i],
+                 "timer %u fired at %lu instead of %lu",
+                 i, fired_at[i], 1000 + delays[i]);
+  }
+  T_ASSERT_EQ(wheel.pending, 0UL);
+
+  return 0;
+}
+
+static int test_cancel(void)
+{
+  setup(0);
+
+  wheel_add(&wheel, &timers[0], 10);
+  wheel_add(&wheel, &timers[1], 5000);
+  wheel_add(&wheel, &timers[2], 10);
+  T_ASSERT(wheel_cancel(&wheel, &timers[1]) == 1);
+  T_ASSERT(wheel_cancel(&wheel, &timers[2]) == 1);
+  T_ASSERT(wheel_cancel(&wheel, &timers[2]) == 0);
+  T_ASSERT(!wheel_timer_pending(&timers[2]));
+
+  wheel_advance(&wheel, 10000);
+  T_ASSERT_EQ((unsigned long) num_fired, 1UL);
+  T_ASSERT_EQ(fired_at[0], 10UL);
+
+  return 0;
+}
+
+static wheel_timer_t periodic;
+static unsigned periodic_count;
+
+static void rearm(void *data)
+{
+  periodic_count++;
+  if (periodic_count < 10)
+    wheel_add(&wheel, &periodic, wheel.now + 100);
+}
+
+static int test_rearm(void)
+{
+  setup(0);
+  periodic = (wheel_timer_t) { .callback = rearm };
+  periodic_count = 0;
+
+  /* timers in the past fire on the next tick */
+  wheel_add(&wheel, &periodic, 0);
+  wheel_advance(&wheel, 1);
+  T_ASSERT_EQ((unsigned long) periodic_count, 1UL);
+
+  wheel_advance(&wheel, 1000);
+  T_ASSERT_EQ((unsigned long) periodic_count, 10UL);
+  T_ASSERT(!wheel_timer_pending(&periodic));
+
+  return 0;
+}
+
+static int test_next_event(void)
+{
+  setup(10);
+  T_ASSERT_EQ(wheel_next_event(&wheel, 50), 50UL);
+
+  wheel_add(&wheel, &timers[0], 30);
+  T_ASSERT_EQ(wheel_next_event(&wheel, 50), 20UL);
+  T_ASSERT_EQ(wheel_next_event(&wheel, 5), 5UL);
+
+  /* a timer in a higher level needs a wakeup at the cascade */
+  wheel_cancel(&wheel, &timers[0]);
+  wheel_add(&wheel, &timers[0], 200);
+  T_ASSERT_EQ(wheel_next_event(&wheel, 100), 100UL);
+  T_ASSERT_EQ(wheel_next_event(&wheel, 1000), 182UL);
+
+  wheel_advance(&wheel, 128);
+  T_ASSERT_EQ(wheel_next_event(&wheel, 100), 64UL);
+  wheel_advance(&wheel, 192);
+  T_ASSERT_EQ(wheel_next_event(&wheel, 100), 8UL);
+  T_ASSERT_EQ((unsigned long) num_fired, 0UL);
+
+  return 0;
+}
+
+int wheel_test(void)
+{
+  int err = test_expiry();
+  err = test_cancel() || err;
+  err = test_rearm() || err;
+  err = test_next_event() || err;
+
+  return err;
+}